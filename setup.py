@@ -4,10 +4,23 @@ pypp = Extension('PyPrinseq',
                  sources = [
                      'src/pyprinseq.c',
                      'src/predictprimers.c',
+                     'src/kmertable.c',
+                     'src/heavyhitters.c',
+                     'src/kmerspill.c',
+                     'src/kmersnapshot.c',
+                     'src/basecounts.c',
                      'src/trimprimers.c',
+                     'src/gzshard.c',
+                     'src/readcache.c',
+                     'src/packedread.c',
                      'src/pyprimer-predictions.c',
                      'src/pyprimer-trimming.c',
-                 ])
+                     'src/pyprimerset.c',
+                     'src/pytrimresults.c',
+                     'src/pyreader.c',
+                 ],
+                 include_dirs = ['include'],
+                 libraries = ['z', 'm', 'pthread'])
 
 setup (name = 'PyPrinseq',
        version = '1.0',
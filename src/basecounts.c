@@ -0,0 +1,165 @@
+/*
+ * Count the bases at either end of the sequences. This is the same naive primer prediction as
+ * primer-basecounting, but without any global state so that we can run it alongside the kmer counting,
+ * or in several threads and merge the counts at the end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "basecounts.h"
+
+// the slot for every possible character: 0: A; 1: G; 2: C; 3: T; 4: everything else
+static const uint8_t base_slots[256] = {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 2, 4, 4, 4, 1, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 2, 4, 4, 4, 1, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+};
+
+// start with room for this many positions when we are counting whole reads
+#define initial_capacity 256
+
+static bool basecounts_grow(struct basecounts *bc, int capacity) {
+    if (capacity <= bc->capacity)
+        return true;
+    long (*left)[5] = realloc(bc->left, sizeof(*bc->left) * capacity);
+    if (left == NULL)
+        return false;
+    bc->left = left;
+    long (*right)[5] = realloc(bc->right, sizeof(*bc->right) * capacity);
+    if (right == NULL)
+        return false;
+    bc->right = right;
+    struct qualstats *leftqual = realloc(bc->leftqual, sizeof(*bc->leftqual) * capacity);
+    if (leftqual == NULL)
+        return false;
+    bc->leftqual = leftqual;
+    struct qualstats *rightqual = realloc(bc->rightqual, sizeof(*bc->rightqual) * capacity);
+    if (rightqual == NULL)
+        return false;
+    bc->rightqual = rightqual;
+
+    int extra = capacity - bc->capacity;
+    memset(bc->left + bc->capacity, 0, sizeof(*bc->left) * extra);
+    memset(bc->right + bc->capacity, 0, sizeof(*bc->right) * extra);
+    memset(bc->leftqual + bc->capacity, 0, sizeof(*bc->leftqual) * extra);
+    memset(bc->rightqual + bc->capacity, 0, sizeof(*bc->rightqual) * extra);
+    bc->capacity = capacity;
+    return true;
+}
+
+struct basecounts *basecounts_init(int window) {
+    struct basecounts *bc = calloc(1, sizeof(*bc));
+    if (bc == NULL)
+        return NULL;
+    bc->window = window;
+    if (!basecounts_grow(bc, window > 0 ? window : initial_capacity)) {
+        basecounts_free(bc);
+        return NULL;
+    }
+    // with a fixed window we always report every position, even if the reads are shorter
+    bc->length = window;
+    return bc;
+}
+
+void basecounts_free(struct basecounts *bc) {
+    if (bc == NULL)
+        return;
+    free(bc->left);
+    free(bc->right);
+    free(bc->leftqual);
+    free(bc->rightqual);
+    free(bc);
+}
+
+bool basecounts_add(struct basecounts *bc, const char *seq, const char *qual, size_t len) {
+    size_t n = len;
+    if (bc->window > 0 && n > (size_t) bc->window)
+        n = bc->window;
+    if (n > (size_t) bc->capacity) {
+        size_t capacity = 2 * (size_t) bc->capacity > n ? 2 * (size_t) bc->capacity : n;
+        if (!basecounts_grow(bc, (int) capacity))
+            return false;
+    }
+    if ((int) n > bc->length)
+        bc->length = (int) n;
+
+    const unsigned char *s = (const unsigned char *) seq;
+    for (size_t i = 0; i < n; i++)
+        bc->left[i][base_slots[s[i]]]++;
+    for (size_t i = 0; i < n; i++)
+        bc->right[i][base_slots[s[len - 1 - i]]]++;
+
+    if (qual) {
+        const unsigned char *q = (const unsigned char *) qual;
+        for (size_t i = 0; i < n; i++) {
+            int score = q[i] - 33;
+            bc->leftqual[i].n++;
+            bc->leftqual[i].sum += score;
+            bc->leftqual[i].low += score < 20;
+        }
+        for (size_t i = 0; i < n; i++) {
+            int score = q[len - 1 - i] - 33;
+            bc->rightqual[i].n++;
+            bc->rightqual[i].sum += score;
+            bc->rightqual[i].low += score < 20;
+        }
+    }
+    bc->numseqs++;
+    return true;
+}
+
+bool basecounts_merge(struct basecounts *dst, const struct basecounts *src) {
+    if (!basecounts_grow(dst, src->length))
+        return false;
+    if (src->length > dst->length)
+        dst->length = src->length;
+    for (int i = 0; i < src->length; i++) {
+        for (int j = 0; j < 5; j++) {
+            dst->left[i][j] += src->left[i][j];
+            dst->right[i][j] += src->right[i][j];
+        }
+        dst->leftqual[i].n += src->leftqual[i].n;
+        dst->leftqual[i].sum += src->leftqual[i].sum;
+        dst->leftqual[i].low += src->leftqual[i].low;
+        dst->rightqual[i].n += src->rightqual[i].n;
+        dst->rightqual[i].sum += src->rightqual[i].sum;
+        dst->rightqual[i].low += src->rightqual[i].low;
+    }
+    dst->numseqs += src->numseqs;
+    return true;
+}
+
+void basecounts_consensus(const struct basecounts *bc, bool right, double cutoff, char *consensus) {
+    static const char bases[] = "AGCTN";
+    for (int i = 0; i < bc->length; i++) {
+        const long *counts = right ? bc->right[bc->length - 1 - i] : bc->left[i];
+        // find the maximum element in the array
+        int idx = 0;
+        long total = counts[0];
+        for (int j = 1; j < 5; j++) {
+            total += counts[j];
+            if (counts[j] > counts[idx])
+                idx = j;
+        }
+        if (total > 0 && (double) counts[idx] / total > cutoff)
+            consensus[i] = bases[idx];
+        else
+            consensus[i] = '-';
+    }
+    consensus[bc->length] = 0;
+}
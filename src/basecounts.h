@@ -0,0 +1,64 @@
+#ifndef BASE_COUNTS_H
+#define BASE_COUNTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Summary of the quality scores at one position
+ */
+struct qualstats {
+    long n;         // the number of bases with a quality score
+    long sum;       // the sum of the (phred) scores
+    long low;       // the number of scores below 20
+};
+
+/*
+ * Counts of each base at each of the first and last window positions of a set of sequences.
+ * If window is 0 we count every position in the reads, from both ends.
+ *
+ * We have five slots for each position: 0: A; 1: G; 2: C; 3: T; 4: everything else.
+ * left[i] is i bases from the start of the sequence, and right[i] is i bases from the end
+ * (so right[0] is the last base).
+ */
+struct basecounts {
+    int window;
+    int length;                     // the number of positions we report
+    int capacity;                   // the number of positions we have allocated
+    long numseqs;
+    long (*left)[5];
+    long (*right)[5];
+    struct qualstats *leftqual;
+    struct qualstats *rightqual;
+};
+
+/*
+ * Allocate the counts for the first and last window positions (or 0 for the whole read).
+ * Returns NULL if we can't.
+ */
+struct basecounts *basecounts_init(int window);
+
+/*
+ * Free the counts
+ */
+void basecounts_free(struct basecounts *bc);
+
+/*
+ * Add the bases at either end of a sequence of length len, and their phred+33 quality scores
+ * if qual is not NULL. Returns false if we could not allocate memory for a longer read.
+ */
+bool basecounts_add(struct basecounts *bc, const char *seq, const char *qual, size_t len);
+
+/*
+ * Add all the counts in src to dst (e.g. from different threads). They must have the same window.
+ */
+bool basecounts_merge(struct basecounts *dst, const struct basecounts *src);
+
+/*
+ * Write the most abundant base at each position to consensus (which needs length + 1 characters)
+ * if it is more than cutoff of the sequences that reach that position, otherwise a '-'.
+ * right chooses the 3' end, and is written in the same direction as the sequence.
+ */
+void basecounts_consensus(const struct basecounts *bc, bool right, double cutoff, char *consensus);
+
+#endif //BASE_COUNTS_H
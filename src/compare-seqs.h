@@ -3,35 +3,134 @@
 #define COMPARE_SEQS_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 /*
- * This is an unbalanced binary search tree, and so could devolve into O(n)
- * performance, however with random ints it should be ~O(log n)
+ * A primer and its encoding, while we are building the index
  */
-typedef struct kmer_bst {
+struct primer_pair {
     uint64_t value;
-    char* id;
-    struct kmer_bst *bigger;
-    struct kmer_bst *smaller;
-} kmer_bst_t;
+    int id;
+};
+
+/*
+ * An immutable lookup table from encodings to primer ids. We add all the
+ * primers, build it once, and then it is just sorted arrays: the distinct
+ * encodings, where each encoding's ids start, and a directory on the top
+ * bits of the encodings so that a lookup only touches one or two cache lines.
+ * More than one primer can have the same encoding.
+ */
+typedef struct primer_index {
+    int n;                      // the number of primers
+    int nvalues;                // the number of distinct encodings
+    uint64_t *values;           // the distinct encodings, sorted
+    int *starts;                // the ids for values[i] are ids[starts[i]] .. ids[starts[i+1]-1]
+    int *ids;
+    int shift;                  // the directory bucket of an encoding is encoding >> shift
+    int nbuckets;
+    int *directory;             // bucket b is values[directory[b]] .. values[directory[b+1]-1]
+    struct primer_pair *pairs;  // the primers we have added but not yet built
+    int capacity;
+    bool built;
+} primer_index_t;
+
+/*
+ * Make a new, empty, primer index
+ */
+primer_index_t* primer_index_init();
 
 /* 
- * Add a sequence encoding (a long long int) to a binary
- * search tree.
+ * Add a sequence encoding (a long long int) and its primer id
+ * to the index. You must add everything before primer_index_build.
+ */
+void add_primer(uint64_t, int, primer_index_t*);
+
+/*
+ * Sort the primers so we can search them
  */
-void add_primer(uint64_t, char*, kmer_bst_t*);
+void primer_index_build(primer_index_t*);
 
 /*
- * Find an encoding in a bst
+ * Find an encoding in the index. Returns the primer ids and sets the
+ * number of them, or returns NULL if the encoding is not a primer.
  */
-kmer_bst_t* find_primer(uint64_t, kmer_bst_t*);
+const int* find_primer(uint64_t, primer_index_t*, int*);
+
+/*
+ * Free the index
+ */
+void primer_index_free(primer_index_t*);
 
 /*
  * convert a kmer of A,T,G,C into a uint64_t
  */
 uint64_t kmer_encoding(char*, int, int);
 
+/*
+ * A two word encoding for k-mers up to 64 bp. The seeds in find-primers
+ * come straight from a packedread, so lo has the first 32 bases (the first
+ * base in the lowest two bits) and hi has the rest. kmer_encoding128 and
+ * the k-mer iterator shift each base in at the bottom instead, so there hi
+ * has the first k-32 bases (if there are any) and lo has the last 32. Only
+ * compare encodings that were made the same way.
+ */
+typedef struct kmer128 {
+    uint64_t hi;
+    uint64_t lo;
+} kmer128_t;
+
+/*
+ * convert a kmer (k <= 64) of A,T,G,C into a kmer128_t
+ */
+kmer128_t kmer_encoding128(char*, int, int);
+
+/*
+ * Fold a two word encoding into a uint64_t key for the primer index. This
+ * is the encoding itself for k <= 32, and a hash for longer k-mers, so
+ * different long k-mers can share a key and you must check the sequence.
+ */
+static inline uint64_t kmer128_key(kmer128_t enc) {
+    return enc.lo ^ (enc.hi * 0x9E3779B97F4A7C15ULL);
+}
+
 
 uint64_t next_kmer_encoding(char*, int, int, uint64_t);
 
+/*
+ * Walk along a sequence one k-mer at a time, updating the encoding with
+ * each new base rather than encoding every k-mer again. We keep the
+ * reverse complement as we go too, so the canonical encoding (the
+ * smaller of the two) is free.
+ *
+ * Any base that is not A, C, G, or T (e.g. an N) can't be encoded, so we
+ * quietly skip every k-mer that contains it and start again after it.
+ */
+typedef struct kmer_iterator {
+    const char *seq;
+    size_t len;
+    int k;
+    size_t pos;         // the next base to add
+    int valid;          // how many good bases we have in a row (up to k)
+    kmer128_t forward;  // for k <= 32 we only use the lo words
+    kmer128_t reverse;
+    uint64_t mask;      // the bits of the hi word (or lo word for k <= 32) we use
+} kmer_iterator_t;
+
+/*
+ * Start iterating over the k-mers (k <= 64) of seq, which has length len
+ */
+void kmer_iterator_init(kmer_iterator_t*, const char*, size_t, int);
+
+/*
+ * Move to the next k-mer with no ambiguous bases. Sets its forward and
+ * canonical encodings and its (0 indexed) start position in the sequence.
+ * Returns false at the end of the sequence. This is only for k <= 32.
+ */
+bool kmer_iterator_next(kmer_iterator_t*, uint64_t*, uint64_t*, int*);
+
+/*
+ * The same as kmer_iterator_next, but with two word encodings for any k <= 64
+ */
+bool kmer_iterator_next128(kmer_iterator_t*, kmer128_t*, kmer128_t*, int*);
+
 #endif
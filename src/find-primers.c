@@ -2,6 +2,20 @@
  * Find primers whereever they are in the sequence. We hash the primers and then look through the sequence to see if we have that hash
  *
  * This should be O(n) complexity where n = length of sequence
+ *
+ * Each read is packed two bits per base once (packedread.h), and we take the seeds and count the mismatches
+ * from the packed bases.
+ *
+ * To allow mismatches we use pigeonhole seeds: if we cut a primer into m+1 pieces, and it matches
+ * a read with at most m mismatches, at least one of the pieces must match exactly. So we index the
+ * pieces of every primer (and its reverse complement), look up each k-mer of the read, and check the
+ * whole primer wherever a piece matches.
+ *
+ * The primers can have IUPAC codes (e.g. R for A or G). Those match any of their bases when we check the
+ * whole primer, and the seeds with them are added to the index once for each sequence they could be.
+ *
+ * Rather than printing every hit, we count how many times each primer is found at each position in
+ * the reads, so we can see where the primers (e.g. chimeras or adapters in the middle of the reads) are.
  */
 
 
@@ -10,30 +24,182 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <unistd.h>
 #include <math.h>
 #include <stdint.h>
 #include "kseq.h"
 #include "version.h"
 #include "compare-seqs.h"
+#include "packedread.h"
 #include "print-sequences.h"
 #include "colours.h"
 #include <float.h>
 
 KSEQ_INIT(gzFile, gzread);
 
-void encode_primers(char* primerfile, kmer_bst_t* primers, int kmer) {
+// the most versions of one seed with IUPAC codes that we add to the index
+#define max_seed_variants 1024
+
+/*
+ * One primer sequence that we are looking for, either the primer or its reverse complement,
+ * and where we have found it.
+ */
+typedef struct pattern {
+	char *name;
+	char *seq;
+	int len;
+	struct packedread packed;
+	char strand;            // + for the primer, - for its reverse complement
+	long hits;
+	long reads;             // the number of reads with at least one hit
+	long lastread;          // the last read we found this in, so we only count each read once
+	long mismatches[3];     // 0, 1, and 2+ mismatches
+	long *histogram;        // the hits in each bin of positions
+	int nbins;
+} pattern_t;
+
+typedef struct patterns {
+	pattern_t *p;
+	int n;
+	int capacity;
+} patterns_t;
+
+
+void print_usage() {
+	printf("Usage: find-primers [OPTIONS] -p PRIMER_FILE Sequence File [Sequence File ...] (fasta or fastq)\n");
+	printf("\t-p primer file (fasta or fastq) (required)\n");
+	printf("\t-m maximum number of mismatches between the primer and the read (default 1)\n");
+	printf("\t-b bin size for the position histograms (default 10)\n");
+	printf("\t-k seed length (default: the primer length / (mismatches + 1), up to 64)\n");
+	printf("\t-a print every hit as well as the histograms\n");
+	printf("\t-v print the version and exit\n");
+	printf("Find primers anywhere in the reads, and count where they are\n\n");
+}
+
+char* reverse_complement(char *seq, int len) {
 	/*
-	 * encode the primers in primerfile 
-	 * We need to use a fixed kmer length (kmer), and the primers should not be 
-	 * shorter than this, so if they are we put a warning out
+	 * The reverse complement, including the IUPAC codes (R <-> Y, K <-> M, B <-> V, D <-> H)
+	 */
+	char *rc = malloc(sizeof(char) * (len + 1));
+	for (int i = 0; i < len; i++) {
+		switch (toupper(seq[len - i - 1])) {
+			case 'A': rc[i] = 'T'; break;
+			case 'C': rc[i] = 'G'; break;
+			case 'G': rc[i] = 'C'; break;
+			case 'T': rc[i] = 'A'; break;
+			case 'U': rc[i] = 'A'; break;
+			case 'R': rc[i] = 'Y'; break;
+			case 'Y': rc[i] = 'R'; break;
+			case 'S': rc[i] = 'S'; break;
+			case 'W': rc[i] = 'W'; break;
+			case 'K': rc[i] = 'M'; break;
+			case 'M': rc[i] = 'K'; break;
+			case 'B': rc[i] = 'V'; break;
+			case 'V': rc[i] = 'B'; break;
+			case 'D': rc[i] = 'H'; break;
+			case 'H': rc[i] = 'D'; break;
+			default: rc[i] = 'N';
+		}
+	}
+	rc[len] = '\0';
+	return rc;
+}
+
+void add_pattern(patterns_t *patterns, char *name, char *seq, int len, char strand) {
+	if (patterns->n == patterns->capacity) {
+		patterns->capacity = patterns->capacity ? patterns->capacity * 2 : 32;
+		patterns->p = realloc(patterns->p, sizeof(*patterns->p) * patterns->capacity);
+		if (patterns->p == NULL) {
+			fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+			exit(-1);
+		}
+	}
+	pattern_t *p = &patterns->p[patterns->n++];
+	memset(p, 0, sizeof(*p));
+	p->name = strdup(name);
+	p->seq = seq;
+	p->len = len;
+	p->strand = strand;
+	p->lastread = -1;
+	for (int i = 0; i < len; i++)
+		p->seq[i] = toupper(p->seq[i]);
+	packedread_init(&p->packed);
+	if (!packedread_pack_iupac(&p->packed, p->seq, len)) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+		exit(-1);
+	}
+}
+
+/*
+ * The key for the seed of length seedlen at pos, from the packed bases. Returns false if the seed has an N.
+ * Seeds longer than 32 bp are folded into one key (see kmer128_key), so different seeds can share a key.
+ */
+static inline bool seed_key(const struct packedread *pr, size_t pos, int seedlen, uint64_t *key) {
+	if (seedlen <= 32) {
+		if (packedread_nmask(pr, pos) & packed_mask(seedlen))
+			return false;
+		*key = packedread_bases(pr, pos) & packed_mask(seedlen);
+		return true;
+	}
+	if (packedread_nmask(pr, pos) || (packedread_nmask(pr, pos + 32) & packed_mask(seedlen - 32)))
+		return false;
+	kmer128_t enc = {packedread_bases(pr, pos + 32) & packed_mask(seedlen - 32), packedread_bases(pr, pos)};
+	*key = kmer128_key(enc);
+	return true;
+}
+
+/*
+ * Add every version of the seed at pos in a degenerate primer to the index, so a seed with an R is added
+ * once with an A and once with a G. Returns false if there are more than max_seed_variants versions, or
+ * the seed has something that is not an IUPAC code.
+ */
+static bool add_degenerate_seed(const pattern_t *p, int pos, int seedlen, int id, primer_index_t *primers) {
+	int masks[64];
+	long nvariants = 1;
+	for (int i = 0; i < seedlen; i++) {
+		masks[i] = iupac_mask(p->seq[pos + i]);
+		nvariants *= __builtin_popcount(masks[i]);
+		if (nvariants == 0 || nvariants > max_seed_variants)
+			return false;
+	}
+	for (long v = 0; v < nvariants; v++) {
+		// v is a mixed radix number with one digit for each of the bases the position can be
+		uint64_t words[2] = {0, 0};
+		long rest = v;
+		for (int i = 0; i < seedlen; i++) {
+			int n = __builtin_popcount(masks[i]);
+			int choice = rest % n;
+			rest /= n;
+			int code = 0;
+			for (int b = 0; b < 4; b++)
+				if ((masks[i] & (1 << b)) && choice-- == 0)
+					code = b;
+			words[i / 32] |= (uint64_t) code << (2 * (i % 32));
+		}
+		if (seedlen <= 32) {
+			add_primer(words[0], id, primers);
+		} else {
+			kmer128_t enc = {words[1], words[0]};
+			add_primer(kmer128_key(enc), id, primers);
+		}
+	}
+	return true;
+}
+
+patterns_t* read_primers(char* primerfile) {
+	/*
+	 * Read the primers and make a pattern for each primer and its reverse
+	 * complement (unless the primer is its own reverse complement)
 	 */
 
 	if( access( primerfile, R_OK ) == -1 ) {
 		// file doesn't exist
 		fprintf(stderr, "ERROR: The file %s can not be found. Please check the file path\n", primerfile);
-		return;
+		return NULL;
 	}
 
+	patterns_t *patterns = calloc(1, sizeof(*patterns));
 	gzFile fp;
 	kseq_t *seq;
 
@@ -41,26 +207,76 @@ void encode_primers(char* primerfile, kmer_bst_t* primers, int kmer) {
 	seq = kseq_init(fp);
 	int l;
 	while ((l = kseq_read(seq)) >= 0) {
-		if (seq->seq.l < kmer) {
-			fprintf(stderr, "%sWARNING: Length of %s is only %ld, so we had to adjust k-mer size down%s\n", RED, seq->name.s, seq->seq.l, ENDC);
-			kmer = seq->seq.l;
+		char *rc = reverse_complement(seq->seq.s, seq->seq.l);
+		add_pattern(patterns, seq->name.s, strdup(seq->seq.s), seq->seq.l, '+');
+		if (strcasecmp(rc, seq->seq.s) == 0)
+			free(rc);
+		else
+			add_pattern(patterns, seq->name.s, rc, seq->seq.l, '-');
+	}
+	kseq_destroy(seq);
+	gzclose(fp);
+	return patterns;
+}
+
+void encode_primers(patterns_t *patterns, primer_index_t* primers, int seedlen, int nseeds) {
+	/*
+	 * Add the nseeds non-overlapping seeds of length seedlen from each pattern to the index.
+	 * The id of a seed is pattern * nseeds + the seed number, so we know where it came from.
+	 * Seeds with IUPAC codes are added once for each sequence they could be, but if there are too many of
+	 * those (or a base that is not an IUPAC code) we can't use the seed, and warn because we may miss some hits.
+	 */
+	for (int i = 0; i < patterns->n; i++) {
+		pattern_t *p = &patterns->p[i];
+		for (int j = 0; j < nseeds; j++) {
+			uint64_t key;
+			bool added;
+			if (p->packed.degenerate) {
+				added = add_degenerate_seed(p, j * seedlen, seedlen, i * nseeds + j, primers);
+			} else {
+				added = seed_key(&p->packed, j * seedlen, seedlen, &key);
+				if (added)
+					add_primer(key, i * nseeds + j, primers);
+			}
+			if (!added && p->strand == '+')
+				fprintf(stderr, "%sWARNING: Seed %d of %s has too many ambiguous bases, so we may miss some hits%s\n", RED, j, p->name, ENDC);
 		}
-		printf("Encoding %s with length %ld using k-mer %d\n", seq->seq.s, seq->seq.l, kmer);
-		uint64_t enc = kmer_encoding(seq->seq.s, 0, kmer);
-		add_primer(enc, seq->name.s, primers);
-		printf("Added primer %s with encoding %ld\n", seq->name.s, enc);
 	}
+	primer_index_build(primers);
 }
 
-void search_seqfile_for_primers(char* seqfile, kmer_bst_t* primers, int kmer) {
-	/* 
-	 * Search through the sequences in seqfile and see if they have the 
-	 * primers in primers
+void record_hit(pattern_t *p, long readnum, int posn, int mm, int binsize) {
+	p->hits++;
+	if (p->lastread != readnum) {
+		p->reads++;
+		p->lastread = readnum;
+	}
+	p->mismatches[mm < 2 ? mm : 2]++;
+	int bin = posn / binsize;
+	if (bin >= p->nbins) {
+		int nbins = bin + 1 > 2 * p->nbins ? bin + 1 : 2 * p->nbins;
+		p->histogram = realloc(p->histogram, sizeof(*p->histogram) * nbins);
+		if (p->histogram == NULL) {
+			fprintf(stderr, "ERROR: We cannot allocate memory for the histograms\n");
+			exit(-1);
+		}
+		memset(p->histogram + p->nbins, 0, sizeof(*p->histogram) * (nbins - p->nbins));
+		p->nbins = nbins;
+	}
+	p->histogram[bin]++;
+}
+
+long search_seqfile_for_primers(char* seqfile, primer_index_t* primers, patterns_t* patterns, int seedlen, int nseeds,
+		int maxmismatches, int binsize, bool print_hits, long readnum) {
+	/*
+	 * Search through the sequences in seqfile and see if they have the
+	 * primers in primers. Returns the number of sequences we have read
+	 * (including readnum sequences from earlier files).
 	 */
 	if( access( seqfile, R_OK ) == -1 ) {
 		// file doesn't exist
 		fprintf(stderr, "ERROR: The file %s can not be found. Please check the file path\n", seqfile);
-		return;
+		return readnum;
 	}
 
 	gzFile fp;
@@ -69,34 +285,152 @@ void search_seqfile_for_primers(char* seqfile, kmer_bst_t* primers, int kmer) {
 	fp = gzopen(seqfile, "r");
 	seq = kseq_init(fp);
 	int l;
+	struct packedread read;
+	packedread_init(&read);
 	while ((l = kseq_read(seq)) >= 0) {
-		uint64_t enc = kmer_encoding(seq->seq.s, 0, kmer);
-		kmer_bst_t *ks = find_primer(enc, primers);
-		if (ks) 
-			printf("Found primer %s (val: %ld) in sequence %s at position 0\n", ks->id, ks->value, seq->name.s);
-		for (int i=1; i<seq->seq.l - kmer; i++) {
-			enc = next_kmer_encoding(seq->seq.s, i, kmer, enc);
-			kmer_bst_t *ks = find_primer(enc, primers);
-			if (ks) 
-				printf("Found primer %s in sequence %s at position %d\n", ks->id, seq->name.s, i);
+		// pack the read once, and use it for both the seeds and checking the primers (which are upper case)
+		if (!packedread_pack_nocase(&read, seq->seq.s, seq->seq.l)) {
+			fprintf(stderr, "ERROR: We cannot allocate memory for %s\n", seq->name.s);
+			exit(-1);
 		}
+		int nids;
+		uint64_t key;
+		for (int posn = 0; posn + seedlen <= (int) seq->seq.l; posn++) {
+			if (!seed_key(&read, posn, seedlen, &key))
+				continue;
+			const int *ids = find_primer(key, primers, &nids);
+			for (int j=0; j<nids; j++) {
+				pattern_t *p = &patterns->p[ids[j] / nseeds];
+				int seed = ids[j] % nseeds;
+				int start = posn - seed * seedlen;
+				if (start < 0 || start + p->len > seq->seq.l)
+					continue;
+				// only the first seed that matches exactly reports a hit, so we don't count it twice
+				bool earlier = false;
+				for (int s = 0; s < seed && !earlier; s++)
+					earlier = packed_mismatches(&read, start + s * seedlen, &p->packed, s * seedlen, seedlen, 0) == 0;
+				if (earlier)
+					continue;
+				int mm = packed_mismatches(&read, start, &p->packed, 0, p->len, maxmismatches);
+				if (mm > maxmismatches)
+					continue;
+				record_hit(p, readnum, start, mm, binsize);
+				if (print_hits)
+					printf("Found primer %s (%c) in sequence %s at position %d with %d mismatches\n", p->name, p->strand, seq->name.s, start, mm);
+			}
+		}
+		readnum++;
 	}
+	packedread_free(&read);
+	kseq_destroy(seq);
+	gzclose(fp);
+	return readnum;
 }
 
+void print_histograms(patterns_t *patterns, long numseqs, int binsize) {
+	printf("Sequences: %ld\n\n", numseqs);
+	printf("Primer\tStrand\tLength\tHits\tReads\t0 mismatches\t1 mismatch\t2+ mismatches\n");
+	for (int i = 0; i < patterns->n; i++) {
+		pattern_t *p = &patterns->p[i];
+		printf("%s\t%c\t%d\t%ld\t%ld\t%ld\t%ld\t%ld\n", p->name, p->strand, p->len, p->hits, p->reads,
+				p->mismatches[0], p->mismatches[1], p->mismatches[2]);
+	}
+	printf("\nPrimer\tStrand\tPosition\tHits\n");
+	for (int i = 0; i < patterns->n; i++) {
+		pattern_t *p = &patterns->p[i];
+		for (int b = 0; b < p->nbins; b++)
+			if (p->histogram[b] > 0)
+				printf("%s\t%c\t%d-%d\t%ld\n", p->name, p->strand, b * binsize, (b + 1) * binsize - 1, p->histogram[b]);
+	}
+}
 
 
 int main(int argc, char *argv[]) {
-	char* primerfile = "primers/mgi.fa";
+	char* primerfile = NULL;
+	int maxmismatches = 1;
+	int binsize = 10;
+	int seedlen = 0;
+	bool print_hits = false;
+	int opt = 0;
+	static struct option long_options[] = {
+			{"primers",        required_argument, 0, 'p'},
+			{"mismatches",     required_argument, 0, 'm'},
+			{"bin_size",       required_argument, 0, 'b'},
+			{"seed_length",    required_argument, 0, 'k'},
+			{"all_hits",       no_argument,       0, 'a'},
+			{"version",        no_argument,       0, 'v'},
+			{0,                0,                 0, 0}
+	};
+	int option_index = 0;
+	while ((opt = getopt_long(argc, argv, "p:m:b:k:av", long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'p' :
+				primerfile = optarg;
+				break;
+			case 'm' :
+				maxmismatches = atoi(optarg);
+				break;
+			case 'b' :
+				binsize = atoi(optarg);
+				break;
+			case 'k' :
+				seedlen = atoi(optarg);
+				break;
+			case 'a' :
+				print_hits = true;
+				break;
+			case 'v':
+				printf("Version: %f\n", __version__);
+				return 0;
+			default:
+				print_usage();
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (primerfile == NULL || optind >= argc || maxmismatches < 0 || binsize < 1 || seedlen < 0) {
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
 
-	kmer_bst_t *primers;
-	primers = (kmer_bst_t *) malloc(sizeof(*primers));
-	int kmer = 24; // our max primer length
+	patterns_t *patterns = read_primers(primerfile);
+	if (patterns == NULL || patterns->n == 0) {
+		fprintf(stderr, "ERROR: No primers were found in %s\n", primerfile);
+		exit(EXIT_FAILURE);
+	}
 
-	encode_primers(primerfile, primers, kmer);
-	char* seqfile = "fastq/913873_20180417_S_R1.sample.fastq.gz";
-	search_seqfile_for_primers(seqfile, primers, kmer);
-}
+	// the seeds have to fit m+1 times into the shortest primer
+	int nseeds = maxmismatches + 1;
+	int shortest = patterns->p[0].len;
+	for (int i = 1; i < patterns->n; i++)
+		if (patterns->p[i].len < shortest)
+			shortest = patterns->p[i].len;
+	int maxseed = shortest / nseeds > 64 ? 64 : shortest / nseeds;
+	if (seedlen == 0 || seedlen > maxseed)
+		seedlen = maxseed;
+	if (seedlen < 1) {
+		fprintf(stderr, "ERROR: The shortest primer is %d bp, which is too short to find with %d mismatches\n", shortest, maxmismatches);
+		exit(EXIT_FAILURE);
+	}
+	if (seedlen < 10)
+		fprintf(stderr, "%sWARNING: The seeds are only %d bp, so this may be slow%s\n", PINK, seedlen, ENDC);
 
+	primer_index_t *primers = primer_index_init();
+	encode_primers(patterns, primers, seedlen, nseeds);
 
+	long numseqs = 0;
+	while (optind < argc)
+		numseqs = search_seqfile_for_primers(argv[optind++], primers, patterns, seedlen, nseeds, maxmismatches, binsize, print_hits, numseqs);
 
+	print_histograms(patterns, numseqs, binsize);
 
+	for (int i = 0; i < patterns->n; i++) {
+		free(patterns->p[i].name);
+		free(patterns->p[i].seq);
+		free(patterns->p[i].histogram);
+		packedread_free(&patterns->p[i].packed);
+	}
+	free(patterns->p);
+	free(patterns);
+	primer_index_free(primers);
+	return 0;
+}
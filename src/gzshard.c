@@ -0,0 +1,623 @@
+/*
+ * Index big sequence files, and read shards of them. See gzshard.h for the index format.
+ *
+ * We write every number explicitly as little endian bytes so that an index can be shared between
+ * the computers in a cluster.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "gzshard.h"
+
+#define index_magic "PTGZIDX"
+#define index_version 1
+// magic (8 bytes), version, format, gzipped (4 bytes each), file size, modification time, uncompressed size, checkpoints (8 bytes each)
+#define header_size 52
+// compressed offset, uncompressed offset, next record (8 bytes each), bits, has a window (4 bytes each)
+#define point_size 32
+#define window_size 32768
+#define chunk_size 65536
+// we aim for about this many checkpoints, but never less than min_span bytes of sequence apart
+#define target_points 2048
+#define min_span 65536
+// a checkpoint that we haven't found the next record for yet
+#define no_record UINT64_MAX
+
+enum seqformat {unknown_format, fastq_format, fasta_format};
+
+struct checkpoint {
+    uint64_t in;            // where to start reading the file
+    uint64_t out;           // how much sequence there is before that
+    uint64_t record;        // the uncompressed offset of the first record after out
+    int bits;               // how many bits of the byte before in we still need
+    unsigned char *window;  // the 32 kb before out, or NULL at the start of a gzip member
+};
+
+struct gzindex {
+    int format;
+    bool gzipped;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t total;         // the uncompressed size
+    long n;
+    long capacity;
+    struct checkpoint *points;
+};
+
+/*
+ * Follow the lines as we build the index, so we know where the records start
+ */
+struct recordscan {
+    int format;
+    long line;
+    bool linestart;
+    bool bad;
+    struct gzindex *index;
+};
+
+struct gzshard {
+    gzFile gz;              // the whole file, if we are not sharding it
+    FILE *fp;
+    char *filename;
+    bool gzipped;
+    z_stream strm;
+    bool raw;               // we started in the middle of a member, so there is no gzip header
+    bool member_start;      // the next thing in the file is a gzip header (or the end)
+    int trailer;            // how much of a gzip trailer we still need to skip
+    bool error;
+    uint64_t start;         // the part of the uncompressed file that is ours
+    uint64_t end;
+    uint64_t outoff;        // the uncompressed offset of out[0]
+    unsigned outpos;
+    unsigned outlen;
+    unsigned char in[chunk_size];
+    unsigned char out[chunk_size];
+};
+
+static void put_le(unsigned char *buf, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        buf[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *buf, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | buf[i];
+    return value;
+}
+
+static char *index_name(const char *filename) {
+    char *name = malloc(strlen(filename) + 7);
+    if (name == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the index of %s\n", filename);
+        exit(-1);
+    }
+    sprintf(name, "%s.ptidx", filename);
+    return name;
+}
+
+static void free_index(struct gzindex *ix) {
+    for (long i = 0; i < ix->n; i++)
+        free(ix->points[i].window);
+    free(ix->points);
+    free(ix);
+}
+
+/*
+ * Add a checkpoint, with a copy of the circular window (where left bytes are still to be written) if
+ * we need one. We don't add a checkpoint until a record has started after the last one, so every
+ * checkpoint has a different next record. Returns true if we added it.
+ */
+static bool add_point(struct gzindex *ix, uint64_t in, uint64_t out, int bits, const unsigned char *window, unsigned left) {
+    if (ix->n > 0 && ix->points[ix->n - 1].record == no_record)
+        return false;
+    if (ix->n == ix->capacity) {
+        ix->capacity = ix->capacity ? ix->capacity * 2 : 64;
+        ix->points = realloc(ix->points, sizeof(*ix->points) * ix->capacity);
+        if (ix->points == NULL) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for the index\n");
+            exit(-1);
+        }
+    }
+    struct checkpoint *p = &ix->points[ix->n++];
+    p->in = in;
+    p->out = out;
+    p->record = no_record;
+    p->bits = bits;
+    p->window = NULL;
+    if (window) {
+        p->window = malloc(window_size);
+        if (p->window == NULL) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for the index\n");
+            exit(-1);
+        }
+        memcpy(p->window, window + window_size - left, left);
+        memcpy(p->window + left, window, window_size - left);
+    }
+    return true;
+}
+
+/*
+ * Find the records in len bytes of sequence that start at offset. A fasta record starts with a >, and a
+ * fastq record is every fourth line (and we check the third line of each one starts with a +).
+ */
+static void scan_records(struct recordscan *rs, const unsigned char *buf, size_t len, uint64_t offset) {
+    for (size_t i = 0; i < len && !rs->bad; i++) {
+        if (rs->linestart) {
+            if (rs->format == unknown_format)
+                rs->format = buf[i] == '@' ? fastq_format : buf[i] == '>' ? fasta_format : unknown_format;
+            bool record = rs->format == fasta_format ? buf[i] == '>' : rs->line % 4 == 0;
+            if (rs->format == unknown_format || (rs->format == fastq_format && buf[i] != '\n' &&
+                    ((rs->line % 4 == 0 && buf[i] != '@') || (rs->line % 4 == 2 && buf[i] != '+'))))
+                rs->bad = true;
+            struct gzindex *ix = rs->index;
+            if (record && ix->n > 0 && ix->points[ix->n - 1].record == no_record)
+                ix->points[ix->n - 1].record = offset + i;
+            rs->linestart = false;
+        }
+        const unsigned char *nl = memchr(buf + i, '\n', len - i);
+        if (nl == NULL)
+            break;
+        i = nl - buf;
+        rs->line++;
+        rs->linestart = true;
+    }
+}
+
+/*
+ * Decompress the whole file once, adding a checkpoint at the start of a gzip member or a deflate block
+ * whenever we have read span bytes of sequence since the last one. Each gzip member starts with a new
+ * window, so a checkpoint there doesn't need one.
+ */
+static bool index_gzip(FILE *fp, struct gzindex *ix, struct recordscan *rs, uint64_t span) {
+    unsigned char *input = malloc(chunk_size);
+    unsigned char *window = calloc(window_size, 1);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (input == NULL || window == NULL || inflateInit2(&strm, 15 + 32) != Z_OK) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the index\n");
+        exit(-1);
+    }
+    uint64_t totin = 0, totout = 0, last = 0;
+    bool member_start = true;
+    bool ok = true;
+    while (!rs->bad) {
+        if (strm.avail_in == 0) {
+            strm.avail_in = fread(input, 1, chunk_size, fp);
+            strm.next_in = input;
+            if (ferror(fp)) {
+                ok = false;
+                break;
+            }
+        }
+        if (member_start) {
+            // the end of the file, or something that isn't gzip after the last member
+            if (strm.avail_in == 0 || strm.next_in[0] != 0x1f)
+                break;
+            if ((ix->n == 0 || totout - last >= span) && add_point(ix, totin, totout, 0, NULL, 0))
+                last = totout;
+            member_start = false;
+        }
+        if (strm.avail_in == 0) {
+            ok = false;
+            break;
+        }
+        if (strm.avail_out == 0) {
+            strm.avail_out = window_size;
+            strm.next_out = window;
+        }
+        unsigned char *from = strm.next_out;
+        unsigned availin = strm.avail_in;
+        int ret = inflate(&strm, Z_BLOCK);
+        totin += availin - strm.avail_in;
+        scan_records(rs, from, strm.next_out - from, totout);
+        totout += strm.next_out - from;
+        if (ret == Z_STREAM_END) {
+            inflateReset(&strm);
+            member_start = true;
+            continue;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            ok = false;
+            break;
+        }
+        // the end of a block that isn't the last one in the member
+        if ((strm.data_type & 128) && !(strm.data_type & 64) && totout - last >= span &&
+                add_point(ix, totin, totout, strm.data_type & 7, window, strm.avail_out))
+            last = totout;
+    }
+    ix->total = totout;
+    inflateEnd(&strm);
+    free(input);
+    free(window);
+    return ok;
+}
+
+static bool index_plain(FILE *fp, struct gzindex *ix, struct recordscan *rs, uint64_t span) {
+    unsigned char *input = malloc(chunk_size);
+    if (input == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the index\n");
+        exit(-1);
+    }
+    uint64_t offset = 0, last = 0;
+    size_t n;
+    while (!rs->bad && (n = fread(input, 1, chunk_size, fp)) > 0) {
+        if ((ix->n == 0 || offset - last >= span) && add_point(ix, offset, offset, 0, NULL, 0))
+            last = offset;
+        scan_records(rs, input, n, offset);
+        offset += n;
+    }
+    ix->total = offset;
+    free(input);
+    return !ferror(fp);
+}
+
+static struct gzindex *build_index(const char *filename, const struct stat *st) {
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Can not open %s\n", filename);
+        return NULL;
+    }
+    struct gzindex *ix = calloc(1, sizeof(*ix));
+    if (ix == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the index\n");
+        exit(-1);
+    }
+    ix->size = st->st_size;
+    ix->mtime = st->st_mtime;
+    int c1 = getc(fp), c2 = getc(fp);
+    ix->gzipped = c1 == 0x1f && c2 == 0x8b;
+    rewind(fp);
+
+    // assume the sequences are about four times bigger than the gzip file
+    uint64_t span = (ix->gzipped ? 4 : 1) * ix->size / target_points;
+    if (span < min_span)
+        span = min_span;
+    struct recordscan rs = {unknown_format, 0, true, false, ix};
+    bool ok = ix->gzipped ? index_gzip(fp, ix, &rs, span) : index_plain(fp, ix, &rs, span);
+    fclose(fp);
+    ix->format = rs.format;
+    // the last checkpoint might not have had a record after it
+    if (ix->n > 0 && ix->points[ix->n - 1].record == no_record) {
+        free(ix->points[ix->n - 1].window);
+        ix->n--;
+    }
+    if (rs.bad)
+        fprintf(stderr, "ERROR: %s is not a fasta file or a fastq file with four lines per record, so we can not split it into shards\n", filename);
+    else if (!ok)
+        fprintf(stderr, "ERROR: We could not read all of %s. Is it truncated?\n", filename);
+    if (rs.bad || !ok) {
+        free_index(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+/*
+ * Write the index to a temporary file and move it into place, so that lots of processes can build
+ * the same index at once.
+ */
+static bool save_index(const struct gzindex *ix, const char *indexfile) {
+    char *tmp = malloc(strlen(indexfile) + 32);
+    if (tmp == NULL)
+        return false;
+    sprintf(tmp, "%s.%ld.tmp", indexfile, (long) getpid());
+    gzFile fp = gzopen(tmp, "wb");
+    if (fp == NULL) {
+        free(tmp);
+        return false;
+    }
+    unsigned char header[header_size];
+    memset(header, 0, sizeof(header));
+    memcpy(header, index_magic, strlen(index_magic));
+    put_le(header + 8, index_version, 4);
+    put_le(header + 12, ix->format, 4);
+    put_le(header + 16, ix->gzipped, 4);
+    put_le(header + 20, ix->size, 8);
+    put_le(header + 28, (uint64_t) ix->mtime, 8);
+    put_le(header + 36, ix->total, 8);
+    put_le(header + 44, ix->n, 8);
+    bool ok = gzwrite(fp, header, header_size) == header_size;
+    for (long i = 0; ok && i < ix->n; i++) {
+        const struct checkpoint *p = &ix->points[i];
+        unsigned char point[point_size];
+        put_le(point, p->in, 8);
+        put_le(point + 8, p->out, 8);
+        put_le(point + 16, p->record, 8);
+        put_le(point + 24, p->bits, 4);
+        put_le(point + 28, p->window != NULL, 4);
+        ok = gzwrite(fp, point, point_size) == point_size;
+        if (ok && p->window)
+            ok = gzwrite(fp, p->window, window_size) == window_size;
+    }
+    if (gzclose(fp) != Z_OK)
+        ok = false;
+    if (ok)
+        ok = rename(tmp, indexfile) == 0;
+    if (!ok)
+        unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+/*
+ * Read an index if it is there and up to date. We only keep the window of the checkpoint where shard
+ * starts, because that is the only one we need. Returns NULL (quietly) if we need to build it again.
+ */
+static struct gzindex *load_index(const char *indexfile, const struct stat *st, int shard, int nshards) {
+    gzFile fp = gzopen(indexfile, "rb");
+    if (fp == NULL)
+        return NULL;
+    unsigned char header[header_size];
+    if (gzread(fp, header, header_size) != header_size || memcmp(header, index_magic, strlen(index_magic)) != 0 ||
+            get_le(header + 8, 4) != index_version || get_le(header + 20, 8) != (uint64_t) st->st_size ||
+            (int64_t) get_le(header + 28, 8) != (int64_t) st->st_mtime) {
+        gzclose(fp);
+        return NULL;
+    }
+    struct gzindex *ix = calloc(1, sizeof(*ix));
+    if (ix == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the index\n");
+        exit(-1);
+    }
+    ix->format = (int) get_le(header + 12, 4);
+    ix->gzipped = get_le(header + 16, 4) != 0;
+    ix->size = st->st_size;
+    ix->mtime = st->st_mtime;
+    ix->total = get_le(header + 36, 8);
+    long n = (long) get_le(header + 44, 8);
+    long keep = nshards > 0 ? (long) shard * n / nshards : -1;
+    ix->points = malloc(sizeof(*ix->points) * (n > 0 ? n : 1));
+    if (ix->points == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the index\n");
+        exit(-1);
+    }
+    ix->capacity = n;
+    unsigned char *window = malloc(window_size);
+    bool ok = window != NULL;
+    for (long i = 0; ok && i < n; i++) {
+        unsigned char point[point_size];
+        if (gzread(fp, point, point_size) != point_size) {
+            ok = false;
+            break;
+        }
+        struct checkpoint *p = &ix->points[ix->n++];
+        p->in = get_le(point, 8);
+        p->out = get_le(point + 8, 8);
+        p->record = get_le(point + 16, 8);
+        p->bits = (int) get_le(point + 24, 4);
+        p->window = NULL;
+        if (get_le(point + 28, 4)) {
+            if (i == keep && (p->window = malloc(window_size)) == NULL) {
+                fprintf(stderr, "ERROR: We cannot allocate memory for the index\n");
+                exit(-1);
+            }
+            ok = gzread(fp, p->window ? p->window : window, window_size) == window_size;
+        }
+    }
+    free(window);
+    gzclose(fp);
+    if (!ok) {
+        free_index(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+static struct gzindex *get_index(const char *filename, const struct stat *st, int shard, int nshards) {
+    char *indexfile = index_name(filename);
+    struct gzindex *ix = load_index(indexfile, st, shard, nshards);
+    if (ix == NULL) {
+        fprintf(stderr, "Building the shard index %s\n", indexfile);
+        ix = build_index(filename, st);
+        if (ix && !save_index(ix, indexfile))
+            fprintf(stderr, "WARNING: We could not save the index %s, so we will have to build it again next time\n", indexfile);
+    }
+    free(indexfile);
+    return ix;
+}
+
+bool gzshard_build_index(const char *filename) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        fprintf(stderr, "ERROR: Can not open %s\n", filename);
+        return false;
+    }
+    struct gzindex *ix = get_index(filename, &st, 0, 0);
+    if (ix == NULL)
+        return false;
+    free_index(ix);
+    return true;
+}
+
+bool gzshard_parse(const char *arg, int *shard, int *nshards) {
+    int i, n;
+    char extra;
+    if (sscanf(arg, "%d/%d%c", &i, &n, &extra) != 2 || n < 1 || i < 1 || i > n)
+        return false;
+    *shard = i - 1;
+    *nshards = n;
+    return true;
+}
+
+struct gzshard *gzshard_open(const char *filename, int shard, int nshards) {
+    struct gzshard *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory to read %s\n", filename);
+        exit(-1);
+    }
+    if (nshards < 2) {
+        s->gz = gzopen(filename, "r");
+        if (s->gz == NULL) {
+            free(s);
+            return NULL;
+        }
+        return s;
+    }
+
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        free(s);
+        return NULL;
+    }
+    struct gzindex *ix = get_index(filename, &st, shard, nshards);
+    if (ix == NULL) {
+        free(s);
+        return NULL;
+    }
+
+    // each shard gets the same number of checkpoints, which is about the same amount of sequence
+    long a = (long) shard * ix->n / nshards;
+    long b = (long) (shard + 1) * ix->n / nshards;
+    s->start = a < ix->n ? ix->points[a].record : ix->total;
+    s->end = b < ix->n ? ix->points[b].record : ix->total;
+    s->gzipped = ix->gzipped;
+    s->filename = strdup(filename);
+    s->fp = fopen(filename, "rb");
+    bool ok = s->fp != NULL;
+    if (ok && s->start < s->end) {
+        const struct checkpoint *p = &ix->points[a];
+        if (!s->gzipped) {
+            ok = fseeko(s->fp, (off_t) s->start, SEEK_SET) == 0;
+            s->outoff = s->start;
+        }
+        else if (p->window == NULL) {
+            ok = fseeko(s->fp, (off_t) p->in, SEEK_SET) == 0 && inflateInit2(&s->strm, 15 + 32) == Z_OK;
+            s->member_start = true;
+            s->outoff = p->out;
+        }
+        else {
+            // start in the middle of a deflate stream with the bits we need from the byte before
+            ok = fseeko(s->fp, (off_t) (p->in - (p->bits ? 1 : 0)), SEEK_SET) == 0 && inflateInit2(&s->strm, -15) == Z_OK;
+            if (ok && p->bits) {
+                int c = getc(s->fp);
+                ok = c != EOF && inflatePrime(&s->strm, p->bits, c >> (8 - p->bits)) == Z_OK;
+            }
+            ok = ok && inflateSetDictionary(&s->strm, p->window, window_size) == Z_OK;
+            s->raw = true;
+            s->outoff = p->out;
+        }
+    }
+    else {
+        // an empty shard (there are more shards than checkpoints)
+        s->end = s->start;
+        s->outoff = s->start;
+    }
+    free_index(ix);
+    if (!ok) {
+        fprintf(stderr, "ERROR: Can not open %s at the start of shard %d of %d\n", filename, shard + 1, nshards);
+        gzshard_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+/*
+ * Decompress some more of the file into out. Returns false at the end of the file, or if it is corrupt.
+ */
+static bool shard_fill(struct gzshard *s) {
+    s->outoff += s->outlen;
+    s->outpos = s->outlen = 0;
+    if (!s->gzipped) {
+        s->outlen = fread(s->out, 1, chunk_size, s->fp);
+        return s->outlen > 0;
+    }
+    z_stream *strm = &s->strm;
+    while (s->outlen == 0) {
+        if (strm->avail_in == 0) {
+            strm->avail_in = fread(s->in, 1, chunk_size, s->fp);
+            strm->next_in = s->in;
+        }
+        if (s->trailer > 0) {
+            if (strm->avail_in == 0)
+                return false;
+            unsigned skip = strm->avail_in < (unsigned) s->trailer ? strm->avail_in : (unsigned) s->trailer;
+            strm->next_in += skip;
+            strm->avail_in -= skip;
+            s->trailer -= skip;
+            continue;
+        }
+        if (s->member_start) {
+            if (strm->avail_in == 0 || strm->next_in[0] != 0x1f)
+                return false;
+            s->member_start = false;
+        }
+        if (strm->avail_in == 0) {
+            fprintf(stderr, "ERROR: %s is truncated\n", s->filename);
+            s->error = true;
+            return false;
+        }
+        strm->next_out = s->out;
+        strm->avail_out = chunk_size;
+        int ret = inflate(strm, Z_NO_FLUSH);
+        s->outlen = chunk_size - strm->avail_out;
+        if (ret == Z_STREAM_END) {
+            // a raw deflate stream leaves the gzip trailer for us, and the next member has a header
+            if (s->raw) {
+                s->trailer = 8;
+                s->raw = false;
+                inflateReset2(strm, 15 + 32);
+            }
+            else
+                inflateReset(strm);
+            s->member_start = true;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "ERROR: %s is corrupt: %s\n", s->filename, strm->msg ? strm->msg : "inflate failed");
+            s->error = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+int gzshard_read(struct gzshard *s, void *buf, unsigned len) {
+    if (s == NULL)
+        return -1;
+    if (s->gz)
+        return gzread(s->gz, buf, len);
+    unsigned char *to = buf;
+    unsigned got = 0;
+    while (got < len) {
+        if (s->outpos == s->outlen) {
+            if (s->outoff + s->outlen >= s->end || !shard_fill(s))
+                break;
+            // skip the end of the record before the shard, and stop at the first record of the next shard
+            if (s->outoff < s->start)
+                s->outpos = s->start - s->outoff < s->outlen ? (unsigned) (s->start - s->outoff) : s->outlen;
+            if (s->outoff + s->outlen > s->end)
+                s->outlen = (unsigned) (s->end - s->outoff);
+            continue;
+        }
+        unsigned n = s->outlen - s->outpos;
+        if (n > len - got)
+            n = len - got;
+        memcpy(to + got, s->out + s->outpos, n);
+        s->outpos += n;
+        got += n;
+    }
+    if (got == 0 && s->error)
+        return -1;
+    return (int) got;
+}
+
+int gzshard_close(struct gzshard *s) {
+    if (s == NULL)
+        return Z_STREAM_ERROR;
+    int ro = Z_OK;
+    if (s->gz)
+        ro = gzclose(s->gz);
+    if (s->fp)
+        fclose(s->fp);
+    if (s->gzipped)
+        inflateEnd(&s->strm);
+    free(s->filename);
+    free(s);
+    return ro;
+}
@@ -0,0 +1,57 @@
+/*
+ * Read one shard (slice) of a big sequence file, so that several processes (or computers) can each
+ * trim, or count the kmers in, part of the same file without splitting and compressing it again.
+ *
+ * To start part way through a file we need an index of places we can start decompressing from. The
+ * index is saved next to the sequence file (FILE.ptidx) the first time we need it, and is rebuilt if the
+ * file changes. Each checkpoint in the index is either the start of a gzip member (every block of a BGZF
+ * file is one, so we don't need anything else) or a deflate block boundary in the middle of a member with
+ * the 32 kb of sequence before it, like zlib's zran example. Uncompressed files only need the offsets.
+ *
+ * Every checkpoint also has the offset of the first record that starts after it, so a shard is always
+ * whole records. That means fastq files have to have four lines per record (no wrapped sequences).
+ *
+ * The index is a gzip compressed binary file. It starts with a header (the magic "PTGZIDX", a version,
+ * the format of the sequences, whether the file is gzipped, the size and modification time of the file,
+ * the uncompressed size and the number of checkpoints) and then has one record per checkpoint: the
+ * compressed offset, the uncompressed offset, the offset of the next record (little endian uint64s), the
+ * number of bits of the byte before the compressed offset we need, and whether a window follows (uint32s),
+ * then the window if there is one.
+ */
+
+#ifndef GZSHARD_H
+#define GZSHARD_H
+
+#include <stdbool.h>
+
+struct gzshard;
+
+/*
+ * Open shard of nshards (counting from 0) of filename. If nshards is less than 2 we read the whole file
+ * without an index, just like gzopen. Returns NULL (and prints why) if we can not open or index the file.
+ */
+struct gzshard *gzshard_open(const char *filename, int shard, int nshards);
+
+/*
+ * Read up to len bytes of the shard into buf, like gzread. Returns the number of bytes read, 0 at the end
+ * of the shard, or -1 if the file is corrupt.
+ */
+int gzshard_read(struct gzshard *s, void *buf, unsigned len);
+
+/*
+ * Close the shard. Returns 0 like gzclose.
+ */
+int gzshard_close(struct gzshard *s);
+
+/*
+ * Build (or rebuild, if it is out of date) the index for filename. Returns false if we could not.
+ */
+bool gzshard_build_index(const char *filename);
+
+/*
+ * Parse a shard given as i/N on the command line (counting from 1) into shard (counting from 0) and
+ * nshards. Returns false if it isn't a shard.
+ */
+bool gzshard_parse(const char *arg, int *shard, int *nshards);
+
+#endif //GZSHARD_H
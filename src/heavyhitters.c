@@ -0,0 +1,202 @@
+/*
+ * Approximate counting of the most abundant kmers in constant memory.
+ *
+ * See heavyhitters.h for the guarantees. Every operation is O(log capacity): a hash lookup
+ * to find the kmer's counter, and then moving that counter down the min-heap after we increment it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "heavyhitters.h"
+#include "kmertable.h"
+
+static inline char *hh_key(const struct heavyhitters *hh, int i) {
+    return hh->keys + (size_t) i * (hh->kmerlen + 1);
+}
+
+/*
+ * FNV-1a on a fixed length kmer. We need the bits to be well mixed because we use a power of two table.
+ */
+static unsigned int hh_hash(const char *s, int kmerlen) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < kmerlen; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+struct heavyhitters *heavyhitters_init(int kmerlen, int capacity) {
+    struct heavyhitters *hh = calloc(1, sizeof(*hh));
+    if (hh == NULL)
+        return NULL;
+    hh->kmerlen = kmerlen;
+    hh->capacity = capacity;
+
+    // keep the hash less than half full so probes stay short
+    unsigned int nslots = 2;
+    while (nslots < (unsigned int) capacity * 2)
+        nslots <<= 1;
+    hh->mask = nslots - 1;
+
+    hh->keys = malloc((size_t) capacity * (kmerlen + 1));
+    hh->counts = malloc(sizeof(*hh->counts) * capacity);
+    hh->errors = malloc(sizeof(*hh->errors) * capacity);
+    hh->heap = malloc(sizeof(*hh->heap) * capacity);
+    hh->heappos = malloc(sizeof(*hh->heappos) * capacity);
+    hh->slots = malloc(sizeof(*hh->slots) * nslots);
+    if (!hh->keys || !hh->counts || !hh->errors || !hh->heap || !hh->heappos || !hh->slots) {
+        heavyhitters_free(hh);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < nslots; i++)
+        hh->slots[i] = -1;
+    return hh;
+}
+
+void heavyhitters_free(struct heavyhitters *hh) {
+    if (hh == NULL)
+        return;
+    free(hh->keys);
+    free(hh->counts);
+    free(hh->errors);
+    free(hh->heap);
+    free(hh->heappos);
+    free(hh->slots);
+    free(hh);
+}
+
+/*
+ * Find the slot that holds kmer, or the empty slot where it should go
+ */
+static unsigned int hh_find_slot(const struct heavyhitters *hh, const char *kmer) {
+    unsigned int s = hh_hash(kmer, hh->kmerlen) & hh->mask;
+    while (hh->slots[s] != -1 && memcmp(hh_key(hh, hh->slots[s]), kmer, hh->kmerlen) != 0)
+        s = (s + 1) & hh->mask;
+    return s;
+}
+
+/*
+ * Remove the counter in slot s from the hash, shifting any later entries in the probe sequence back
+ * so that we never need tombstones.
+ */
+static void hh_remove_slot(struct heavyhitters *hh, unsigned int s) {
+    unsigned int hole = s;
+    unsigned int j = s;
+    while (1) {
+        j = (j + 1) & hh->mask;
+        if (hh->slots[j] == -1)
+            break;
+        unsigned int home = hh_hash(hh_key(hh, hh->slots[j]), hh->kmerlen) & hh->mask;
+        // can the entry at j move back to the hole? only if its home is not cyclically in (hole, j]
+        if (((j - home) & hh->mask) >= ((j - hole) & hh->mask)) {
+            hh->slots[hole] = hh->slots[j];
+            hole = j;
+        }
+    }
+    hh->slots[hole] = -1;
+}
+
+static void hh_swap(struct heavyhitters *hh, int a, int b) {
+    int t = hh->heap[a];
+    hh->heap[a] = hh->heap[b];
+    hh->heap[b] = t;
+    hh->heappos[hh->heap[a]] = a;
+    hh->heappos[hh->heap[b]] = b;
+}
+
+static void hh_sift_up(struct heavyhitters *hh, int p) {
+    while (p > 0) {
+        int parent = (p - 1) / 2;
+        if (hh->counts[hh->heap[parent]] <= hh->counts[hh->heap[p]])
+            break;
+        hh_swap(hh, p, parent);
+        p = parent;
+    }
+}
+
+static void hh_sift_down(struct heavyhitters *hh, int p) {
+    while (1) {
+        int smallest = p;
+        int l = 2 * p + 1, r = 2 * p + 2;
+        if (l < hh->n && hh->counts[hh->heap[l]] < hh->counts[hh->heap[smallest]])
+            smallest = l;
+        if (r < hh->n && hh->counts[hh->heap[r]] < hh->counts[hh->heap[smallest]])
+            smallest = r;
+        if (smallest == p)
+            break;
+        hh_swap(hh, p, smallest);
+        p = smallest;
+    }
+}
+
+void heavyhitters_add(struct heavyhitters *hh, const char *kmer, int count) {
+    hh->total += count;
+    unsigned int s = hh_find_slot(hh, kmer);
+    int c = hh->slots[s];
+    if (c != -1) {
+        hh->counts[c] += count;
+        hh_sift_down(hh, hh->heappos[c]);
+        return;
+    }
+
+    if (hh->n < hh->capacity) {
+        c = hh->n++;
+        memcpy(hh_key(hh, c), kmer, hh->kmerlen);
+        hh_key(hh, c)[hh->kmerlen] = 0;
+        hh->counts[c] = count;
+        hh->errors[c] = 0;
+        hh->heap[c] = c;
+        hh->heappos[c] = c;
+        hh->slots[s] = c;
+        hh_sift_up(hh, c);
+        return;
+    }
+
+    // replace the kmer with the smallest count
+    c = hh->heap[0];
+    hh_remove_slot(hh, hh_find_slot(hh, hh_key(hh, c)));
+    memcpy(hh_key(hh, c), kmer, hh->kmerlen);
+    hh->errors[c] = hh->counts[c];
+    hh->counts[c] += count;
+    // the hash may have shifted since we looked, so find the empty slot again
+    hh->slots[hh_find_slot(hh, kmer)] = c;
+    hh_sift_down(hh, 0);
+}
+
+int heavyhitters_max_error(const struct heavyhitters *hh) {
+    if (hh->n < hh->capacity)
+        return 0;
+    return hh->counts[hh->heap[0]];
+}
+
+struct kmertable *heavyhitters_to_kmertable(const struct heavyhitters *hh) {
+    struct kmertable *kt = kmertable_init(hh->kmerlen);
+    if (kt == NULL)
+        return NULL;
+    int *index = malloc(sizeof(*index) * (hh->n > 0 ? hh->n : 1));
+    if (index == NULL) {
+        kmertable_free(kt);
+        return NULL;
+    }
+    for (int i = 0; i < hh->n; i++) {
+        index[i] = kmertable_insert(kt, hh_key(hh, i), hh->counts[i]);
+        if (index[i] < 0) {
+            free(index);
+            kmertable_free(kt);
+            return NULL;
+        }
+    }
+    kt->errors = malloc(sizeof(*kt->errors) * (kt->n > 0 ? kt->n : 1));
+    if (kt->errors == NULL) {
+        free(index);
+        kmertable_free(kt);
+        return NULL;
+    }
+    for (int i = 0; i < hh->n; i++)
+        kt->errors[index[i]] = hh->errors[i];
+    free(index);
+    return kt;
+}
@@ -0,0 +1,64 @@
+#ifndef HEAVY_HITTERS_H
+#define HEAVY_HITTERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "kmertable.h"
+
+/*
+ * A Space-Saving sketch of the most abundant kmers (Metwally, Agrawal and El Abbadi, 2005).
+ *
+ * We keep a fixed number (capacity) of counters, so the memory does not depend on how many
+ * kmers there are in the file. When we see a kmer we don't have a counter for and all the counters are in
+ * use, we take over the counter with the smallest count, and remember that count as the error.
+ *
+ * For every kmer we report, count - error <= true count <= count, and every kmer that appears more than
+ * total / capacity times is guaranteed to be reported. The smallest count (and hence the largest error)
+ * is never more than total / capacity.
+ *
+ * heap is a min-heap of counters ordered by count, and slots is an open addressed hash (linear probing)
+ * from kmer to counter.
+ */
+struct heavyhitters {
+    int kmerlen;
+    int capacity;   // the number of counters
+    int n;          // the number of counters in use
+    long total;     // the total number of kmers we have seen
+    char *keys;     // capacity * (kmerlen + 1) bytes of null terminated kmers
+    int *counts;
+    int *errors;
+    int *heap;      // counter indices, smallest count first
+    int *heappos;   // where each counter is in the heap
+    int *slots;     // the counter for each hash slot (-1 if empty)
+    unsigned int mask;  // the number of slots - 1
+};
+
+/*
+ * Allocate a sketch with capacity counters for kmers of length kmerlen.
+ * Returns NULL if we can't allocate the memory.
+ */
+struct heavyhitters *heavyhitters_init(int kmerlen, int capacity);
+
+/*
+ * Free the sketch
+ */
+void heavyhitters_free(struct heavyhitters *hh);
+
+/*
+ * Count count occurrences of the kmerlen bases starting at kmer (which does not need to be null terminated)
+ */
+void heavyhitters_add(struct heavyhitters *hh, const char *kmer, int count);
+
+/*
+ * The most any count in the sketch can be overestimated by
+ */
+int heavyhitters_max_error(const struct heavyhitters *hh);
+
+/*
+ * Copy the counted kmers into a new kmertable so that they can be sorted and merged exactly like the
+ * exact counts. The table's errors are set to the error for each kmer.
+ * Returns NULL if we can't allocate the memory.
+ */
+struct kmertable *heavyhitters_to_kmertable(const struct heavyhitters *hh);
+
+#endif //HEAVY_HITTERS_H
@@ -0,0 +1,137 @@
+/*
+ * Read and write kmer count snapshots. See kmersnapshot.h for the format.
+ *
+ * We write every number explicitly as little endian bytes so that snapshots can be moved between machines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "kmersnapshot.h"
+#include "kmertable.h"
+
+#define snapshot_magic "PTKMERS"
+#define snapshot_version 1
+// magic (8 bytes), version, kmer length, three prime (4 bytes each), number of sequences, number of kmers (8 bytes each)
+#define header_size 36
+
+static void put_le(unsigned char *buf, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        buf[i] = (value >> (8 * i)) & 0xff;
+}
+
+static uint64_t get_le(const unsigned char *buf, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | buf[i];
+    return value;
+}
+
+static int sort_by_kmer(const void *p, const void *q) {
+    return strcmp(*(const char * const *)p, *(const char * const *)q);
+}
+
+bool kmersnapshot_write(const char *filename, const struct kmertable *kt, long numseqs, bool three_prime) {
+    // sort by kmer so snapshots are reproducible and easy to compare
+    const char **kmers = malloc(sizeof(*kmers) * (kt->n > 0 ? kt->n : 1));
+    if (kmers == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate the memory to write the snapshot %s\n", filename);
+        return false;
+    }
+    for (int i = 0; i < kt->n; i++)
+        kmers[i] = kmertable_key(kt, i);
+    qsort(kmers, kt->n, sizeof(*kmers), sort_by_kmer);
+
+    gzFile fp = gzopen(filename, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: We can not write the snapshot %s\n", filename);
+        free(kmers);
+        return false;
+    }
+
+    unsigned char header[header_size];
+    memset(header, 0, sizeof(header));
+    memcpy(header, snapshot_magic, strlen(snapshot_magic));
+    put_le(header + 8, snapshot_version, 4);
+    put_le(header + 12, kt->kmerlen, 4);
+    put_le(header + 16, three_prime, 4);
+    put_le(header + 20, numseqs, 8);
+    put_le(header + 28, kt->n, 8);
+    bool ok = gzwrite(fp, header, header_size) == header_size;
+
+    // the counts are in a separate array from the keys, so we need to find each kmer's index again
+    size_t width = kt->kmerlen + 1;
+    unsigned char count[4];
+    for (int i = 0; ok && i < kt->n; i++) {
+        int index = (int) ((kmers[i] - kt->keys) / width);
+        put_le(count, kt->counts[index], 4);
+        ok = gzwrite(fp, kmers[i], kt->kmerlen) == kt->kmerlen && gzwrite(fp, count, 4) == 4;
+    }
+    if (gzclose(fp) != Z_OK)
+        ok = false;
+    if (!ok)
+        fprintf(stderr, "ERROR: We could not write all the kmers to the snapshot %s\n", filename);
+    free(kmers);
+    return ok;
+}
+
+struct kmersnapshot *kmersnapshot_open(const char *filename) {
+    gzFile fp = gzopen(filename, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: The snapshot %s can not be opened. Please check the file path\n", filename);
+        return NULL;
+    }
+    unsigned char header[header_size];
+    if (gzread(fp, header, header_size) != header_size || memcmp(header, snapshot_magic, strlen(snapshot_magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not a kmer snapshot\n", filename);
+        gzclose(fp);
+        return NULL;
+    }
+    if (get_le(header + 8, 4) != snapshot_version) {
+        fprintf(stderr, "ERROR: %s is a version %d snapshot, but we can only read version %d\n",
+                filename, (int) get_le(header + 8, 4), snapshot_version);
+        gzclose(fp);
+        return NULL;
+    }
+
+    struct kmersnapshot *snap = malloc(sizeof(*snap));
+    if (snap == NULL) {
+        gzclose(fp);
+        return NULL;
+    }
+    snap->fp = fp;
+    snap->filename = strdup(filename);
+    snap->kmerlen = (int) get_le(header + 12, 4);
+    snap->three_prime = get_le(header + 16, 4) != 0;
+    snap->numseqs = (long) get_le(header + 20, 8);
+    snap->nkmers = (long) get_le(header + 28, 8);
+    snap->read = 0;
+    snap->truncated = false;
+    return snap;
+}
+
+bool kmersnapshot_next(struct kmersnapshot *snap, char *kmer, int *count) {
+    if (snap->read == snap->nkmers)
+        return false;
+    unsigned char c[4];
+    if (gzread(snap->fp, kmer, snap->kmerlen) != snap->kmerlen || gzread(snap->fp, c, 4) != 4) {
+        fprintf(stderr, "ERROR: The snapshot %s is truncated. We only read %ld of %ld kmers\n",
+                snap->filename, snap->read, snap->nkmers);
+        snap->truncated = true;
+        return false;
+    }
+    kmer[snap->kmerlen] = 0;
+    *count = (int) get_le(c, 4);
+    snap->read++;
+    return true;
+}
+
+bool kmersnapshot_close(struct kmersnapshot *snap) {
+    bool ok = !snap->truncated;
+    gzclose(snap->fp);
+    free(snap->filename);
+    free(snap);
+    return ok;
+}
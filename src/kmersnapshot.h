@@ -0,0 +1,52 @@
+#ifndef KMER_SNAPSHOT_H
+#define KMER_SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "kmertable.h"
+
+/*
+ * Snapshots of the kmer counts from primer-predictions, so that we can add new sequence files to a
+ * prediction without reading the old ones again.
+ *
+ * A snapshot is a gzip compressed binary file. It starts with a header (the magic "PTKMERS", a version,
+ * the kmer length, whether these are 3' counts, the number of sequences and the number of kmers) and then
+ * has one record per kmer, sorted by kmer: the kmer itself (kmerlen bytes) and its count (a little
+ * endian uint32).
+ */
+
+struct kmersnapshot {
+    gzFile fp;
+    char *filename;
+    int kmerlen;
+    bool three_prime;
+    long numseqs;   // the number of sequences that were counted
+    long nkmers;    // the number of kmers in the snapshot
+    long read;      // the number of kmers we have read so far
+    bool truncated; // we ran out of file before we read nkmers kmers
+};
+
+/*
+ * Write all the kmers in kt to a new snapshot called filename. numseqs is the number of sequences they
+ * came from. Returns false if we could not write the file.
+ */
+bool kmersnapshot_write(const char *filename, const struct kmertable *kt, long numseqs, bool three_prime);
+
+/*
+ * Open a snapshot and read its header. Returns NULL (and prints why) if it is not a snapshot we can read.
+ */
+struct kmersnapshot *kmersnapshot_open(const char *filename);
+
+/*
+ * Read the next kmer from the snapshot into kmer (which must have space for kmerlen + 1 characters)
+ * and its count into count. Returns false at the end of the snapshot, or if it is truncated.
+ */
+bool kmersnapshot_next(struct kmersnapshot *snap, char *kmer, int *count);
+
+/*
+ * Close the snapshot. Returns false if it was truncated.
+ */
+bool kmersnapshot_close(struct kmersnapshot *snap);
+
+#endif //KMER_SNAPSHOT_H
@@ -0,0 +1,333 @@
+/*
+ * Count kmers exactly in bounded memory by spilling sorted runs to disk. See kmerspill.h
+ *
+ * Each record on disk is the kmer (kmerlen bytes, no null) followed by its count as an int.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "kmerspill.h"
+#include "kmertable.h"
+
+// we use the top bits of the hash to choose the partition
+#define partition_bits 6
+#define npartitions (1 << partition_bits)
+// the smallest read buffer for each run while we merge
+#define min_run_buffer 4096
+
+static unsigned int partition_of(const char *s, int kmerlen) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < kmerlen; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 16777619u;
+    }
+    return h >> (32 - partition_bits);
+}
+
+static size_t record_size(int kmerlen) {
+    return kmerlen + sizeof(int);
+}
+
+struct kmerspill *kmerspill_init(int kmerlen, size_t max_memory) {
+    struct kmerspill *ks = calloc(1, sizeof(*ks));
+    if (ks == NULL)
+        return NULL;
+    ks->kmerlen = kmerlen;
+    ks->max_memory = max_memory;
+    ks->kt = kmertable_init(kmerlen);
+    ks->files = calloc(npartitions, sizeof(*ks->files));
+    ks->runs = calloc(npartitions, sizeof(*ks->runs));
+    ks->nruns = calloc(npartitions, sizeof(*ks->nruns));
+    ks->maxruns = calloc(npartitions, sizeof(*ks->maxruns));
+    if (!ks->kt || !ks->files || !ks->runs || !ks->nruns || !ks->maxruns) {
+        kmertable_free(ks->kt);
+        free(ks->files);
+        free(ks->runs);
+        free(ks->nruns);
+        free(ks->maxruns);
+        free(ks);
+        return NULL;
+    }
+    return ks;
+}
+
+void kmerspill_free(struct kmerspill *ks) {
+    for (int p = 0; p < npartitions; p++) {
+        if (ks->files[p])
+            fclose(ks->files[p]);
+        free(ks->runs[p]);
+    }
+    kmertable_free(ks->kt);
+    free(ks->files);
+    free(ks->runs);
+    free(ks->nruns);
+    free(ks->maxruns);
+    free(ks);
+}
+
+/*
+ * Open an anonymous temporary file in $TMPDIR
+ */
+static FILE *spill_file() {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == 0)
+        dir = "/tmp";
+    char path[strlen(dir) + 32];
+    sprintf(path, "%s/primer-kmers-XXXXXX", dir);
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        fprintf(stderr, "ERROR: We could not make a temporary file in %s\n", dir);
+        return NULL;
+    }
+    unlink(path);
+    return fdopen(fd, "w+");
+}
+
+/*
+ * A kmer in the table we are spilling, and the partition it goes to
+ */
+struct spillentry {
+    unsigned int partition;
+    int count;
+    const char *kmer;
+};
+
+static int spill_comparator(const void *p, const void *q) {
+    const struct spillentry *a = p, *b = q;
+    if (a->partition != b->partition)
+        return a->partition < b->partition ? -1 : 1;
+    return strcmp(a->kmer, b->kmer);
+}
+
+/*
+ * Write everything in the in-memory table to the partition files as sorted runs, and start a new table.
+ */
+static bool kmerspill_spill(struct kmerspill *ks) {
+    struct kmertable *kt = ks->kt;
+    struct spillentry *entries = malloc(sizeof(*entries) * (kt->n > 0 ? kt->n : 1));
+    if (entries == NULL)
+        return false;
+    for (int i = 0; i < kt->n; i++) {
+        entries[i].kmer = kmertable_key(kt, i);
+        entries[i].count = kt->counts[i];
+        entries[i].partition = partition_of(entries[i].kmer, ks->kmerlen);
+    }
+    qsort(entries, kt->n, sizeof(*entries), spill_comparator);
+
+    int i = 0;
+    while (i < kt->n) {
+        unsigned int p = entries[i].partition;
+        if (ks->files[p] == NULL && (ks->files[p] = spill_file()) == NULL) {
+            free(entries);
+            return false;
+        }
+        if (ks->nruns[p] == ks->maxruns[p]) {
+            ks->maxruns[p] = ks->maxruns[p] ? ks->maxruns[p] * 2 : 8;
+            ks->runs[p] = realloc(ks->runs[p], sizeof(*ks->runs[p]) * ks->maxruns[p]);
+            if (ks->runs[p] == NULL) {
+                free(entries);
+                return false;
+            }
+        }
+        struct spillrun *run = &ks->runs[p][ks->nruns[p]++];
+        fseeko(ks->files[p], 0, SEEK_END);
+        run->offset = ftello(ks->files[p]);
+        run->n = 0;
+        for (; i < kt->n && entries[i].partition == p; i++) {
+            if (fwrite(entries[i].kmer, 1, ks->kmerlen, ks->files[p]) != (size_t) ks->kmerlen ||
+                fwrite(&entries[i].count, sizeof(int), 1, ks->files[p]) != 1) {
+                fprintf(stderr, "ERROR: We could not write kmers to the temporary file\n");
+                free(entries);
+                return false;
+            }
+            run->n++;
+        }
+    }
+    free(entries);
+
+    kmertable_free(ks->kt);
+    ks->kt = kmertable_init(ks->kmerlen);
+    ks->nspills++;
+    return ks->kt != NULL;
+}
+
+bool kmerspill_add(struct kmerspill *ks, const char *kmer, int count) {
+    struct kmertable *kt = ks->kt;
+    // spill before the table doubles past our budget (including the space we need to sort it for spilling)
+    if (kt->n == kt->capacity && kt->n > 0 &&
+        kmertable_memory(ks->kmerlen, kt->capacity * 2) + sizeof(struct spillentry) * kt->capacity * 2 > ks->max_memory) {
+        if (!kmerspill_spill(ks))
+            return false;
+    }
+    return kmertable_add(ks->kt, kmer, count) >= 0;
+}
+
+/*
+ * A buffered reader over one sorted run
+ */
+struct runcursor {
+    int fd;
+    off_t offset;   // where the next read from the file starts
+    long remaining; // records in the file that we have not read into the buffer
+    char *buf;
+    long nbuf;      // records in the buffer
+    long next;      // the next record in the buffer
+    size_t bufrecords;
+    bool failed;    // we could not read the run back
+};
+
+static inline const char *cursor_kmer(const struct runcursor *c, int kmerlen) {
+    return c->buf + c->next * record_size(kmerlen);
+}
+
+static inline int cursor_count(const struct runcursor *c, int kmerlen) {
+    int count;
+    memcpy(&count, cursor_kmer(c, kmerlen) + kmerlen, sizeof(count));
+    return count;
+}
+
+/*
+ * Make sure there is a record at c->next. Returns false at the end of the run.
+ */
+static bool cursor_fill(struct runcursor *c, int kmerlen) {
+    if (c->next < c->nbuf)
+        return true;
+    if (c->remaining == 0)
+        return false;
+    long n = c->remaining < (long) c->bufrecords ? c->remaining : (long) c->bufrecords;
+    size_t bytes = n * record_size(kmerlen);
+    if (pread(c->fd, c->buf, bytes, c->offset) != (ssize_t) bytes) {
+        fprintf(stderr, "ERROR: We could not read kmers back from the temporary file\n");
+        c->remaining = 0;
+        c->failed = true;
+        return false;
+    }
+    c->offset += bytes;
+    c->remaining -= n;
+    c->nbuf = n;
+    c->next = 0;
+    return true;
+}
+
+/*
+ * Keep the heap of cursors ordered by their current kmer
+ */
+static void cursor_sift_down(struct runcursor **heap, int n, int p, int kmerlen) {
+    while (1) {
+        int smallest = p;
+        int l = 2 * p + 1, r = 2 * p + 2;
+        if (l < n && memcmp(cursor_kmer(heap[l], kmerlen), cursor_kmer(heap[smallest], kmerlen), kmerlen) < 0)
+            smallest = l;
+        if (r < n && memcmp(cursor_kmer(heap[r], kmerlen), cursor_kmer(heap[smallest], kmerlen), kmerlen) < 0)
+            smallest = r;
+        if (smallest == p)
+            return;
+        struct runcursor *t = heap[p];
+        heap[p] = heap[smallest];
+        heap[smallest] = t;
+        p = smallest;
+    }
+}
+
+/*
+ * Merge all the runs in partition p into out, keeping kmers with at least mincount occurrences
+ */
+static bool merge_partition(struct kmerspill *ks, int p, int mincount, struct kmertable *out) {
+    int nruns = ks->nruns[p];
+    int kmerlen = ks->kmerlen;
+    if (nruns == 0)
+        return true;
+    if (fflush(ks->files[p]) != 0)
+        return false;
+
+    size_t bufbytes = ks->max_memory / 2 / nruns;
+    if (bufbytes < min_run_buffer)
+        bufbytes = min_run_buffer;
+    size_t bufrecords = bufbytes / record_size(kmerlen);
+    if (bufrecords == 0)
+        bufrecords = 1;
+
+    struct runcursor *cursors = calloc(nruns, sizeof(*cursors));
+    struct runcursor **heap = malloc(sizeof(*heap) * nruns);
+    if (cursors == NULL || heap == NULL) {
+        free(cursors);
+        free(heap);
+        return false;
+    }
+    bool ok = true;
+    int n = 0;
+    for (int r = 0; r < nruns; r++) {
+        cursors[r].fd = fileno(ks->files[p]);
+        cursors[r].offset = ks->runs[p][r].offset;
+        cursors[r].remaining = ks->runs[p][r].n;
+        cursors[r].bufrecords = bufrecords;
+        cursors[r].buf = malloc(bufrecords * record_size(kmerlen));
+        if (cursors[r].buf == NULL) {
+            ok = false;
+            continue;
+        }
+        if (cursor_fill(&cursors[r], kmerlen))
+            heap[n++] = &cursors[r];
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        cursor_sift_down(heap, n, i, kmerlen);
+
+    char kmer[kmerlen + 1];
+    while (ok && n > 0) {
+        memcpy(kmer, cursor_kmer(heap[0], kmerlen), kmerlen);
+        long count = 0;
+        while (n > 0 && memcmp(cursor_kmer(heap[0], kmerlen), kmer, kmerlen) == 0) {
+            count += cursor_count(heap[0], kmerlen);
+            heap[0]->next++;
+            if (!cursor_fill(heap[0], kmerlen))
+                heap[0] = heap[--n];
+            cursor_sift_down(heap, n, 0, kmerlen);
+        }
+        if (count >= mincount && kmertable_insert(out, kmer, (int) count) < 0)
+            ok = false;
+    }
+
+    for (int r = 0; r < nruns; r++) {
+        if (cursors[r].failed)
+            ok = false;
+        free(cursors[r].buf);
+    }
+    free(cursors);
+    free(heap);
+    return ok;
+}
+
+struct kmertable *kmerspill_finish(struct kmerspill *ks, int mincount) {
+    // if we never ran out of memory, the table we have is the answer
+    if (ks->nspills == 0) {
+        struct kmertable *kt = ks->kt;
+        ks->kt = NULL;
+        kmerspill_free(ks);
+        return kt;
+    }
+
+    if (!kmerspill_spill(ks)) {
+        kmerspill_free(ks);
+        return NULL;
+    }
+    kmertable_free(ks->kt);
+    ks->kt = NULL;
+
+    struct kmertable *out = kmertable_init(ks->kmerlen);
+    for (int p = 0; out != NULL && p < npartitions; p++) {
+        if (!merge_partition(ks, p, mincount, out)) {
+            kmertable_free(out);
+            out = NULL;
+        }
+        // we are done with this partition so we can release the disk space now
+        if (ks->files[p]) {
+            fclose(ks->files[p]);
+            ks->files[p] = NULL;
+        }
+    }
+    kmerspill_free(ks);
+    return out;
+}
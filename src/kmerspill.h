@@ -0,0 +1,60 @@
+#ifndef KMER_SPILL_H
+#define KMER_SPILL_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "kmertable.h"
+
+/*
+ * Exact kmer counting in a fixed amount of memory.
+ *
+ * We count into an ordinary kmertable until it would grow past max_memory. Then we split the kmers into
+ * partitions by the top bits of their hash, sort each partition by kmer, and append it to that partition's
+ * temporary file as a sorted run. At the end, we merge the runs of one partition at a time, adding up the
+ * counts for each kmer, so the answer is exactly what we would have got by counting everything in memory.
+ *
+ * The temporary files are made in $TMPDIR (or /tmp) and are unlinked as soon as they are opened.
+ */
+
+struct spillrun {
+    off_t offset;   // where the run starts in the partition file
+    long n;         // the number of records in the run
+};
+
+struct kmerspill {
+    int kmerlen;
+    size_t max_memory;
+    struct kmertable *kt;       // the kmers we are counting in memory
+    FILE **files;               // one temporary file per partition (NULL until we spill)
+    struct spillrun **runs;     // the sorted runs in each partition
+    int *nruns;
+    int *maxruns;
+    int nspills;                // how many times we have written the table to disk
+};
+
+/*
+ * Start counting kmers of length kmerlen, using at most about max_memory bytes for the counts.
+ * Returns NULL if we can't allocate the memory.
+ */
+struct kmerspill *kmerspill_init(int kmerlen, size_t max_memory);
+
+/*
+ * Count count occurrences of the kmerlen bases at kmer (which does not need to be null terminated)
+ * Returns false if we could not write to the temporary files.
+ */
+bool kmerspill_add(struct kmerspill *ks, const char *kmer, int count);
+
+/*
+ * Finish counting and return a table of every kmer that appears at least mincount times (with exact counts).
+ * This frees the kmerspill and its temporary files. Returns NULL if something went wrong.
+ */
+struct kmertable *kmerspill_finish(struct kmerspill *ks, int mincount);
+
+/*
+ * Stop counting without finishing, and free the kmerspill and its temporary files.
+ */
+void kmerspill_free(struct kmerspill *ks);
+
+#endif //KMER_SPILL_H
@@ -0,0 +1,208 @@
+/*
+ * A kmer counting table that keeps all of its records in contiguous arrays.
+ *
+ * While we count, the kmers are chained into a fixed number of hash buckets by index (not by pointer),
+ * and the keys, counts and used flags grow together by doubling. Once we have counted everything
+ * we sort the kmers by count and rewrite the arrays in that order, so that the merging step
+ * in predictprimers.c just walks through memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "kmertable.h"
+
+#define table_size 10000
+#define initial_capacity 1024
+
+/*
+ * The same hash as hash() in predictprimers.c, but on a fixed length kmer
+ */
+static unsigned int kmer_hash(const char *s, int kmerlen) {
+    unsigned int hashval = 0;
+    for (int i = 0; i < kmerlen; i++)
+        hashval = s[i] + 31 * hashval;
+    return hashval;
+}
+
+struct kmertable *kmertable_init(int kmerlen) {
+    struct kmertable *kt = malloc(sizeof(*kt));
+    if (kt == NULL)
+        return NULL;
+    kt->kmerlen = kmerlen;
+    kt->n = 0;
+    kt->capacity = initial_capacity;
+    kt->errors = NULL;
+    kt->keys = malloc((size_t) kt->capacity * (kmerlen + 1));
+    kt->counts = malloc(sizeof(*kt->counts) * kt->capacity);
+    kt->used = malloc(sizeof(*kt->used) * kt->capacity);
+    kt->next = malloc(sizeof(*kt->next) * kt->capacity);
+    kt->buckets = malloc(sizeof(*kt->buckets) * table_size);
+    if (!kt->keys || !kt->counts || !kt->used || !kt->next || !kt->buckets) {
+        kmertable_free(kt);
+        return NULL;
+    }
+    for (int i = 0; i < table_size; i++)
+        kt->buckets[i] = -1;
+    return kt;
+}
+
+void kmertable_free(struct kmertable *kt) {
+    if (kt == NULL)
+        return;
+    free(kt->keys);
+    free(kt->counts);
+    free(kt->used);
+    free(kt->errors);
+    free(kt->next);
+    free(kt->buckets);
+    free(kt);
+}
+
+/*
+ * Double the space for the kmers. Returns false if we can't.
+ */
+static bool kmertable_grow(struct kmertable *kt) {
+    int capacity = kt->capacity * 2;
+    char *keys = realloc(kt->keys, (size_t) capacity * (kt->kmerlen + 1));
+    if (keys == NULL)
+        return false;
+    kt->keys = keys;
+    int *counts = realloc(kt->counts, sizeof(*counts) * capacity);
+    if (counts == NULL)
+        return false;
+    kt->counts = counts;
+    bool *used = realloc(kt->used, sizeof(*used) * capacity);
+    if (used == NULL)
+        return false;
+    kt->used = used;
+    int *next = realloc(kt->next, sizeof(*next) * capacity);
+    if (next == NULL)
+        return false;
+    kt->next = next;
+    kt->capacity = capacity;
+    return true;
+}
+
+/*
+ * Put a new kmer at the start of hash bucket h
+ */
+static int kmertable_new(struct kmertable *kt, unsigned int h, const char *kmer, int count) {
+    if (kt->n == kt->capacity && !kmertable_grow(kt))
+        return -1;
+
+    int i = kt->n++;
+    char *key = kmertable_key(kt, i);
+    memcpy(key, kmer, kt->kmerlen);
+    key[kt->kmerlen] = 0;
+    kt->counts[i] = count;
+    kt->used[i] = false;
+    // add first for the kmer to the hash
+    kt->next[i] = kt->buckets[h];
+    kt->buckets[h] = i;
+    return i;
+}
+
+int kmertable_add(struct kmertable *kt, const char *kmer, int count) {
+    unsigned int h = kmer_hash(kmer, kt->kmerlen) % table_size;
+    for (int i = kt->buckets[h]; i != -1; i = kt->next[i]) {
+        if (memcmp(kmertable_key(kt, i), kmer, kt->kmerlen) == 0) {
+            kt->counts[i] += count;
+            return i;
+        }
+    }
+    return kmertable_new(kt, h, kmer, count);
+}
+
+int kmertable_insert(struct kmertable *kt, const char *kmer, int count) {
+    return kmertable_new(kt, kmer_hash(kmer, kt->kmerlen) % table_size, kmer, count);
+}
+
+size_t kmertable_memory(int kmerlen, int capacity) {
+    return sizeof(struct kmertable) + sizeof(int) * table_size +
+           (size_t) capacity * (kmerlen + 1 + sizeof(int) + sizeof(bool) + sizeof(int));
+}
+
+/*
+ * A kmer count and where it is in the unsorted table. This is all we need to move around while sorting.
+ */
+struct countindex {
+    int count;
+    int index;
+};
+
+static int count_comparator(const void *p, const void *q) {
+    return ((const struct countindex *)q)->count - ((const struct countindex *)p)->count;
+}
+
+bool kmertable_sort(struct kmertable *kt) {
+    if (kt->buckets == NULL)
+        return true;
+
+    struct countindex *order = malloc(sizeof(*order) * (kt->n > 0 ? kt->n : 1));
+    char *keys = malloc((size_t) (kt->n > 0 ? kt->n : 1) * (kt->kmerlen + 1));
+    if (order == NULL || keys == NULL) {
+        fprintf(stderr, "We cannot allocate the memory to sort %d kmers\n", kt->n);
+        free(order);
+        free(keys);
+        return false;
+    }
+
+    // walk the hash in bucket order so ties keep the order they have always had
+    int p = 0;
+    for (int h = 0; h < table_size; h++) {
+        for (int i = kt->buckets[h]; i != -1; i = kt->next[i]) {
+            order[p].count = kt->counts[i];
+            order[p].index = i;
+            p++;
+        }
+    }
+
+    qsort(order, kt->n, sizeof(*order), count_comparator);
+
+    size_t width = kt->kmerlen + 1;
+    for (int i = 0; i < kt->n; i++) {
+        memcpy(keys + i * width, kmertable_key(kt, order[i].index), width);
+        kt->counts[i] = order[i].count;
+        kt->used[i] = false;
+    }
+    if (kt->errors != NULL) {
+        int *errors = malloc(sizeof(*errors) * (kt->n > 0 ? kt->n : 1));
+        if (errors == NULL) {
+            fprintf(stderr, "We cannot allocate the memory to sort %d kmers\n", kt->n);
+            free(order);
+            free(keys);
+            return false;
+        }
+        for (int i = 0; i < kt->n; i++)
+            errors[i] = kt->errors[order[i].index];
+        free(kt->errors);
+        kt->errors = errors;
+    }
+    free(kt->keys);
+    kt->keys = keys;
+    kt->capacity = kt->n;
+
+    free(order);
+    free(kt->next);
+    free(kt->buckets);
+    kt->next = NULL;
+    kt->buckets = NULL;
+    return true;
+}
+
+void kmer_window(size_t seqlen, int kmerlen, bool three_prime, int *first, int *last) {
+    int len = (int) seqlen;
+    if (three_prime) {
+        *first = len - 20 - kmerlen;
+        *last = len - kmerlen;
+    } else {
+        *first = 0;
+        *last = 21;
+    }
+    if (*first < 0)
+        *first = 0;
+    if (*last > len - kmerlen)
+        *last = len - kmerlen;
+}
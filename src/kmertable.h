@@ -0,0 +1,85 @@
+#ifndef KMER_TABLE_H
+#define KMER_TABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * A table of kmers and their counts.
+ *
+ * All the records live in a handful of contiguous arrays (a structure of arrays) rather than
+ * one malloc per kmer: keys is a packed block of null terminated kmers, each kmerlen+1 bytes wide,
+ * and counts, used (and errors, for approximate counts) are parallel arrays indexed by the same
+ * kmer number. next and buckets are only needed while we are counting (they chain the kmers in each
+ * hash bucket) and are released by kmertable_sort.
+ *
+ * Everything is freed with a single call to kmertable_free.
+ */
+struct kmertable {
+    int kmerlen;
+    int n;          // the number of distinct kmers
+    int capacity;   // the number of kmers we have allocated space for
+    char *keys;     // n * (kmerlen + 1) bytes of null terminated kmers
+    int *counts;
+    bool *used;
+    int *errors;    // how much each count may be overestimated by, NULL if the counts are exact
+    int *next;      // the next kmer in this hash bucket (-1 at the end of the chain)
+    int *buckets;   // the first kmer in each hash bucket (-1 if empty)
+};
+
+/*
+ * Allocate a new, empty, kmer table for kmers of length kmerlen.
+ * Returns NULL if we can't allocate the memory.
+ */
+struct kmertable *kmertable_init(int kmerlen);
+
+/*
+ * Free the table and all of its kmers.
+ */
+void kmertable_free(struct kmertable *kt);
+
+/*
+ * Add count occurrences of the kmerlen bases starting at kmer (which does not need to be null terminated)
+ * to the table.
+ * Returns the index of the kmer, or -1 if we could not allocate more memory.
+ */
+int kmertable_add(struct kmertable *kt, const char *kmer, int count);
+
+/*
+ * Add a kmer that we know is not already in the table (e.g. when copying from another table), without
+ * searching for it first.
+ * Returns the index of the kmer, or -1 if we could not allocate more memory.
+ */
+int kmertable_insert(struct kmertable *kt, const char *kmer, int count);
+
+/*
+ * Return a pointer to the i'th (null terminated) kmer in the table
+ */
+static inline char *kmertable_key(const struct kmertable *kt, int i) {
+    return kt->keys + (size_t) i * (kt->kmerlen + 1);
+}
+
+/*
+ * How much memory a table of kmers of length kmerlen uses when it has space for capacity kmers
+ * (while we are still counting)
+ */
+size_t kmertable_memory(int kmerlen, int capacity);
+
+/*
+ * Sort the kmers in the table by count (highest count first) and drop the hash.
+ *
+ * Ties stay in the order that they are in the hash. After this, you can not add any more kmers.
+ * Returns false (and leaves the table as it was) if we can't allocate the memory to sort it.
+ */
+bool kmertable_sort(struct kmertable *kt);
+
+/*
+ * The positions of the kmers we count in a sequence of length seqlen. We look at the first 20 or so
+ * bases for 5' primers and the last 20 or so bases for 3' adapters.
+ *
+ * Sets first and last to the first and last (inclusive) kmer start positions. If the sequence is shorter
+ * than the kmer, last will be less than first.
+ */
+void kmer_window(size_t seqlen, int kmerlen, bool three_prime, int *first, int *last);
+
+#endif //KMER_TABLE_H
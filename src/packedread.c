@@ -0,0 +1,182 @@
+/*
+ * Pack reads into two bits per base (see packedread.h). With SSE2 we pack 16 bases at a time,
+ * otherwise we look up one base at a time.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "packedread.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// the code for every character (A: 0, C: 1, G: 2, T: 3) with 4 set for anything that is not a base. Lower
+// case bases are not bases either, unless we fold them to upper case first.
+static const uint8_t base_codes[256] = {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+};
+
+void packedread_init(struct packedread *pr) {
+    memset(pr, 0, sizeof(*pr));
+}
+
+void packedread_free(struct packedread *pr) {
+    free(pr->bases);
+    free(pr->nmask);
+    for (int b = 0; b < 4; b++)
+        free(pr->allow[b]);
+    packedread_init(pr);
+}
+
+int iupac_mask(char c) {
+    switch (c) {
+        case 'A': case 'a': return 1;
+        case 'C': case 'c': return 2;
+        case 'G': case 'g': return 4;
+        case 'T': case 't': case 'U': case 'u': return 8;
+        case 'R': case 'r': return 1 | 4;
+        case 'Y': case 'y': return 2 | 8;
+        case 'S': case 's': return 2 | 4;
+        case 'W': case 'w': return 1 | 8;
+        case 'K': case 'k': return 4 | 8;
+        case 'M': case 'm': return 1 | 2;
+        case 'B': case 'b': return 2 | 4 | 8;
+        case 'D': case 'd': return 1 | 4 | 8;
+        case 'H': case 'h': return 1 | 2 | 8;
+        case 'V': case 'v': return 1 | 2 | 4;
+        case 'N': case 'n': return 1 | 2 | 4 | 8;
+        default: return 0;
+    }
+}
+
+bool packedread_pack_iupac(struct packedread *pr, const char *seq, size_t len) {
+    if (!packedread_pack(pr, seq, len))
+        return false;
+    bool degenerate = false;
+    for (size_t i = 0; i < len && !degenerate; i++) {
+        int mask = iupac_mask(seq[i]);
+        degenerate = mask != 0 && mask != 1 && mask != 2 && mask != 4 && mask != 8;
+    }
+    for (int b = 0; b < 4; b++) {
+        free(pr->allow[b]);
+        pr->allow[b] = NULL;
+    }
+    pr->degenerate = degenerate;
+    if (!degenerate)
+        return true;
+
+    for (int b = 0; b < 4; b++) {
+        pr->allow[b] = calloc(pr->nwords > 0 ? pr->nwords : 1, sizeof(*pr->allow[b]));
+        if (pr->allow[b] == NULL)
+            return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        int mask = iupac_mask(seq[i]);
+        for (int b = 0; b < 4; b++)
+            if (mask & (1 << b))
+                pr->allow[b][i / 32] |= 1ULL << (2 * (i % 32));
+        // the allow masks decide what matches, so only things that are not IUPAC codes are Ns here
+        if (mask)
+            pr->nmask[i / 32] &= ~(1ULL << (2 * (i % 32)));
+    }
+    return true;
+}
+
+#ifdef __SSE2__
+/*
+ * Squeeze 16 bytes that each hold a 2-bit value into 32 bits
+ */
+static inline uint32_t squeeze(__m128i v) {
+    v = _mm_or_si128(v, _mm_srli_epi16(v, 6));
+    v = _mm_and_si128(v, _mm_set1_epi16(0x0F));
+    v = _mm_or_si128(v, _mm_srli_epi32(v, 12));
+    v = _mm_and_si128(v, _mm_set1_epi32(0xFF));
+    v = _mm_packs_epi32(v, v);
+    v = _mm_packus_epi16(v, v);
+    return (uint32_t) _mm_cvtsi128_si32(v);
+}
+
+static inline void pack16(const char *s, uint8_t fold, uint32_t *bases, uint32_t *nmask) {
+    __m128i v = _mm_loadu_si128((const __m128i *) s);
+    __m128i up = _mm_and_si128(v, _mm_set1_epi8((char) fold));
+    __m128i valid = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(up, _mm_set1_epi8('A')), _mm_cmpeq_epi8(up, _mm_set1_epi8('C'))),
+            _mm_or_si128(_mm_cmpeq_epi8(up, _mm_set1_epi8('G')), _mm_cmpeq_epi8(up, _mm_set1_epi8('T'))));
+    // bits 1 and 2 of the ASCII code are A: 0, C: 1, T: 2, G: 3, so swap G and T
+    __m128i code = _mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(3));
+    code = _mm_xor_si128(code, _mm_and_si128(_mm_srli_epi16(code, 1), _mm_set1_epi8(1)));
+    code = _mm_and_si128(code, valid);
+    *bases = squeeze(code);
+    *nmask = squeeze(_mm_andnot_si128(valid, _mm_set1_epi8(1)));
+}
+#endif
+
+/*
+ * Pack seq, with every character ANDed with fold first: 0xDF makes the lower case bases upper case, and
+ * 0xFF leaves them as they are
+ */
+static bool pack(struct packedread *pr, const char *seq, size_t len, uint8_t fold) {
+    size_t nwords = (len + 31) / 32;
+    if (nwords > pr->capacity) {
+        size_t capacity = nwords > 2 * pr->capacity ? nwords : 2 * pr->capacity;
+        uint64_t *bases = realloc(pr->bases, sizeof(*bases) * capacity);
+        if (bases == NULL)
+            return false;
+        pr->bases = bases;
+        uint64_t *nmask = realloc(pr->nmask, sizeof(*nmask) * capacity);
+        if (nmask == NULL)
+            return false;
+        pr->nmask = nmask;
+        pr->capacity = capacity;
+    }
+    pr->len = len;
+    pr->nwords = nwords;
+    pr->degenerate = false;
+
+    size_t w = 0;
+#ifdef __SSE2__
+    for (; 32 * (w + 1) <= len; w++) {
+        uint32_t b0, n0, b1, n1;
+        pack16(seq + 32 * w, fold, &b0, &n0);
+        pack16(seq + 32 * w + 16, fold, &b1, &n1);
+        pr->bases[w] = b0 | ((uint64_t) b1 << 32);
+        pr->nmask[w] = n0 | ((uint64_t) n1 << 32);
+    }
+#endif
+    for (; w < nwords; w++) {
+        uint64_t bases = 0, nmask = 0;
+        for (int j = 0; j < 32; j++) {
+            size_t i = 32 * w + j;
+            uint64_t code = i < len ? base_codes[(unsigned char) seq[i] & fold] : 4;
+            bases |= (code & 3) << (2 * j);
+            nmask |= (code >> 2) << (2 * j);
+        }
+        // an N has no base, so it does not matter what we put there
+        pr->bases[w] = bases & ~(nmask * 3);
+        pr->nmask[w] = nmask;
+    }
+    return true;
+}
+
+bool packedread_pack(struct packedread *pr, const char *seq, size_t len) {
+    return pack(pr, seq, len, 0xFF);
+}
+
+bool packedread_pack_nocase(struct packedread *pr, const char *seq, size_t len) {
+    return pack(pr, seq, len, 0xDF);
+}
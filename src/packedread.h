@@ -0,0 +1,142 @@
+#ifndef PACKED_READ_H
+#define PACKED_READ_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A read packed two bits per base, so that we can compare 32 bases at a time.
+ *
+ * Base i is in bits 2(i%32) and 2(i%32)+1 of word i/32, encoded as A: 0, C: 1, G: 2, T: 3 (the same as
+ * kmer_encoding). Anything else (e.g. an N) sets bit 2(i%32) of the N mask, and never matches anything,
+ * not even another N. Every position past the end of the read is also an N.
+ *
+ * Primers can also have IUPAC codes (R, Y, N, ...) if they are packed with packedread_pack_iupac. Then
+ * allow[b] has bit 2(i%32) set if base b (A: 0, C: 1, G: 2, T: 3) can be at position i, so an R sets
+ * allow[0] and allow[2], and an N sets all four. Comparing a read with a degenerate primer is a few more
+ * ANDs per word, but costs the same however many degenerate bases there are.
+ */
+struct packedread {
+    size_t len;
+    size_t nwords;
+    size_t capacity;
+    uint64_t *bases;
+    uint64_t *nmask;
+    bool degenerate;        // allow is only set if there is an IUPAC code that is not A, C, G, or T
+    uint64_t *allow[4];
+};
+
+// bit 0 of every base
+#define packed_low_bits 0x5555555555555555ULL
+
+/*
+ * Start with an empty read
+ */
+void packedread_init(struct packedread *pr);
+
+/*
+ * Pack len bases of seq into pr, reusing its memory. Returns false if we can't allocate memory.
+ *
+ * Like comparing the characters, a lower case base is not the same as an upper case one, so lower case
+ * bases are Ns. packedread_pack_nocase packs them as the upper case bases.
+ */
+bool packedread_pack(struct packedread *pr, const char *seq, size_t len);
+bool packedread_pack_nocase(struct packedread *pr, const char *seq, size_t len);
+
+/*
+ * Pack a primer that may have IUPAC codes. Anything that is not an IUPAC code never matches.
+ * Returns false if we can't allocate memory.
+ */
+bool packedread_pack_iupac(struct packedread *pr, const char *seq, size_t len);
+
+/*
+ * The IUPAC mask for a character: bit 0 for A, 1 for C, 2 for G, 3 for T, or 0 if it is not an IUPAC code
+ */
+int iupac_mask(char c);
+
+/*
+ * Free the memory (but not pr itself)
+ */
+void packedread_free(struct packedread *pr);
+
+/*
+ * The 64 bits starting at bit 2*pos of words, which has nwords words, or fill past the end.
+ */
+static inline uint64_t packed_window(const uint64_t *words, size_t nwords, size_t pos, uint64_t fill) {
+    size_t w = pos / 32;
+    int shift = 2 * (int) (pos % 32);
+    uint64_t lo = w < nwords ? words[w] : fill;
+    if (shift == 0)
+        return lo;
+    uint64_t hi = w + 1 < nwords ? words[w + 1] : fill;
+    return (lo >> shift) | (hi << (64 - shift));
+}
+
+/*
+ * The 32 bases starting at pos
+ */
+static inline uint64_t packedread_bases(const struct packedread *pr, size_t pos) {
+    return packed_window(pr->bases, pr->nwords, pos, 0);
+}
+
+/*
+ * The N mask of the 32 bases starting at pos
+ */
+static inline uint64_t packedread_nmask(const struct packedread *pr, size_t pos) {
+    return packed_window(pr->nmask, pr->nwords, pos, packed_low_bits);
+}
+
+/*
+ * The mismatches between 32 read bases and 32 bases of a degenerate primer, given as the four allow masks
+ */
+static inline uint64_t packed_iupac_mismatch_word(uint64_t rbases, uint64_t rnmask, const uint64_t allow[4], uint64_t pnmask) {
+    uint64_t hi = rbases >> 1;
+    uint64_t match = (~rbases & ~hi & allow[0]) | (rbases & ~hi & allow[1]) | (~rbases & hi & allow[2]) | (rbases & hi & allow[3]);
+    return (~match & packed_low_bits) | rnmask | pnmask;
+}
+
+/*
+ * The four allow masks of the 32 bases of a degenerate primer from pos
+ */
+static inline void packedread_allow(const struct packedread *pr, size_t pos, uint64_t allow[4]) {
+    for (int b = 0; b < 4; b++)
+        allow[b] = packed_window(pr->allow[b], pr->nwords, pos, 0);
+}
+
+/*
+ * Compare the 32 bases of a from apos with the 32 bases of b from bpos. Bit 2j is set if the j'th bases
+ * don't match (or either one is an N). Either a or b (but not both) can be a degenerate primer.
+ */
+static inline uint64_t packed_mismatch_bits(const struct packedread *a, size_t apos, const struct packedread *b, size_t bpos) {
+    if (b->degenerate || a->degenerate) {
+        const struct packedread *read = b->degenerate ? a : b, *primer = b->degenerate ? b : a;
+        size_t rpos = b->degenerate ? apos : bpos, ppos = b->degenerate ? bpos : apos;
+        uint64_t allow[4];
+        packedread_allow(primer, ppos, allow);
+        return packed_iupac_mismatch_word(packedread_bases(read, rpos), packedread_nmask(read, rpos), allow,
+                packedread_nmask(primer, ppos));
+    }
+    uint64_t x = packedread_bases(a, apos) ^ packedread_bases(b, bpos);
+    return ((x | (x >> 1)) & packed_low_bits) | packedread_nmask(a, apos) | packedread_nmask(b, bpos);
+}
+
+/*
+ * The mask for the first n (<= 32) bases of a word
+ */
+static inline uint64_t packed_mask(int n) {
+    return n >= 32 ? UINT64_MAX : (1ULL << (2 * n)) - 1;
+}
+
+/*
+ * Count the mismatches in len bases of a from apos and b from bpos, stopping once there are more than max
+ */
+static inline int packed_mismatches(const struct packedread *a, size_t apos, const struct packedread *b, size_t bpos,
+        int len, int max) {
+    int mm = 0;
+    for (int j = 0; j < len && mm <= max; j += 32)
+        mm += __builtin_popcountll(packed_mismatch_bits(a, apos + j, b, bpos + j) & packed_mask(len - j));
+    return mm;
+}
+
+#endif //PACKED_READ_H
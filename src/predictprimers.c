@@ -17,11 +17,17 @@
 #include <unistd.h>
 #include "kseq.h"
 #include "predictprimers.h"
+#include "kmertable.h"
+#include "heavyhitters.h"
+#include "kmerspill.h"
+#include "kmersnapshot.h"
+#include "basecounts.h"
+#include "packedread.h"
+#include "gzshard.h"
+#include "readcache.h"
 #include "version.h"
 
-KSEQ_INIT(gzFile, gzread)
-
-#define table_size 10000
+KSEQ_INIT(struct gzshard *, gzshard_read)
 
 
 
@@ -32,20 +38,6 @@ void substr(char* seq, char * kmer, int start, int stop) {
     kmer[p] = 0;
 }
 
-/*
- * Method to compare two kmercount objects used in the qsort method
- */
-
-int comparator(const void *p, const void *q) {
-    /*
-     * Left this here to enable debugging the comparator
-     * struct kmercount *kc = *((struct kmercount **)q);
-     * struct kmercount *kp = *((struct kmercount **)p);
-     * printf("KMER: %s Count %d  KMER: %s Count %d\n", kc->kmer, kc->count, kp->kmer, kp->count);
-     */
-    return ((*(struct kmercount **)q)->count - (*(struct kmercount **)p)->count);
-}
-
 int sort_by_length(const void *p, const void *q) {
     /*
      * Left this here to enable debugging the comparator
@@ -58,147 +50,124 @@ int sort_by_length(const void *p, const void *q) {
 
 
 /*
- * The basic concept is that we don't know - a priori - how many kmers we will find, so we make a hash
- * of kmers and their counts. max is actually 4**kmerlength and with small kmers (<=10) and moderate
- * sized sequences we typically find all kmers, but this scales to larger k.
- *
- * Once we have all kmers we put them into an array so that we can sort by frequency (kcharray[i]->count)
- * so we can combine the most abundant kmers first. A hash can't be sorted.
- *
- * We use two steps for this - convert hash to array and then qsort, but we probably could have done an
- * insertion sort too. But since the data is unsorted, probably no speed up doing insertion sort.
- *
- * We iterate through the array and try and merge kmers - making a note of ones that we have used by setting
- * their boolean.
- *
- * We then have an optional step of looking back through the sequences to see if we can find those kmers. We
- * decided not to keep all the sequences in memory, but rather iterate through the file twice as this
- * would help with large sequence files.
- *
+ * How we count the kmers: exactly in memory (kt), approximately in a fixed amount of memory (hh),
+ * or exactly in a fixed amount of memory by spilling to disk (ks). Only one of these is set.
  */
+struct kmercounter {
+    struct kmertable *kt;
+    struct heavyhitters *hh;
+    struct kmerspill *ks;
+};
+
+static bool counter_init(struct kmercounter *kc, int kmerlen, int approximate, size_t max_memory) {
+    kc->kt = NULL;
+    kc->hh = NULL;
+    kc->ks = NULL;
+    if (approximate > 0)
+        kc->hh = heavyhitters_init(kmerlen, approximate);
+    else if (max_memory > 0)
+        kc->ks = kmerspill_init(kmerlen, max_memory);
+    else
+        kc->kt = kmertable_init(kmerlen);
+    return kc->kt || kc->hh || kc->ks;
+}
 
-int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_output, bool three_prime, bool print_kmer_counts, bool print_abundance,
-        bool print_short_primers, bool debug, char **allprimers, int *allprimerposition) {
+/*
+ * Free a counter we are not going to finish, because something went wrong
+ */
+static void counter_free(struct kmercounter *kc) {
+    heavyhitters_free(kc->hh);
+    if (kc->ks)
+        kmerspill_free(kc->ks);
+    kmertable_free(kc->kt);
+}
 
-    if( access( infile, R_OK ) == -1 ) {
-        // file doesn't exist
-        fprintf(stderr, "ERROR: The file %s can not be found. Please check the file path\n", infile);
-        return 1;
+/*
+ * Count one kmer. Returns false (and says why) if we can't, and then the counter can only be freed.
+ */
+static bool counter_add(struct kmercounter *kc, const char *kmer, int count) {
+    if (kc->hh)
+        heavyhitters_add(kc->hh, kmer, count);
+    else if (kc->ks) {
+        if (!kmerspill_add(kc->ks, kmer, count)) {
+            fprintf(stderr, "We cannot spill the kmers to disk. Please check there is space in $TMPDIR\n");
+            return false;
+        }
     }
-
-
-    // define our hash table to hold the kmers
-    struct kmercount **kchash;
-    kchash = malloc(sizeof(*kchash) * table_size);
-
-    // if we are not able to allocate the memory for this, there is no point continuing!
-    if (kchash == NULL) {
-        fprintf(stderr, "We cannot allocate the memory for a table size of %d. Please try a smaller value\n",
-                table_size);
-        exit(-1);
+    else if (kmertable_add(kc->kt, kmer, count) < 0) {
+        fprintf(stderr, "We cannot allocate the memory for %d kmers. Please try a smaller kmer or use -M\n", kc->kt->n);
+        return false;
     }
+    return true;
+}
 
-    // initilize the table to be empty
-    for (int i = 0; i<table_size; i++)
-        kchash[i] = NULL;
-
-    gzFile fp;
-    kseq_t *seq;
-    //struct my_struct *s;
-    int l;
+/*
+ * Count the kmers at one end of a sequence of length len
+ */
+static bool counter_add_window(struct kmercounter *kc, const char *seq, size_t len, int kmerlen, bool three_prime) {
+    int first, last;
+    kmer_window(len, kmerlen, three_prime, &first, &last);
+    for (int posn = first; posn <= last; posn++)
+        if (!counter_add(kc, seq + posn, 1))
+            return false;
+    return true;
+}
 
-    fp = gzopen(infile, "r");
-    seq = kseq_init(fp);
-    int maxoccurrence = 1; // the maximum value
-    int n = 0; // the number of kmers we find
-    int numseqs = 0;
-    if (debug)
-        fprintf(stderr, "Reading the sequences (first time)\n");
-    while ((l = kseq_read(seq)) >= 0) {
-        numseqs++;
-        double posn = 0;
-        if (three_prime) {
-            posn = strlen(seq->seq.s) - 20 - kmerlen;
-        }
-        bool moreseqs = true;
-        while (moreseqs) {
-            if (three_prime) {
-                if (posn + kmerlen == strlen(seq->seq.s))
-                    moreseqs = false;
-            }
-            else {
-                if (posn > 20)
-                    moreseqs = false;
-            }
-            char kmer[kmerlen + 1];
-            substr(seq->seq.s, kmer, posn, (posn + kmerlen));
-            // do we have this in our array?
-            unsigned int h = hash(kmer) % table_size;
-            struct kmercount *ptr = kchash[h];
-            int matched = 0;
-
-            while (ptr != NULL) {
-                if (strcmp(ptr->kmer, kmer) == 0) {
-                    matched = 1;
-                    ptr->count++;
-                    if (ptr->count > maxoccurrence) {
-                        maxoccurrence = ptr->count;
-                    }
-                }
-                ptr = ptr->next;
-            }
-            if (!matched) {
-                struct kmercount *newk;
-                newk = (struct kmercount *) malloc(sizeof(*newk));
-                newk->kmer = strdup(kmer);
-                //newk->kmer = malloc(strlen(kmer) + 1);
-                //strcpy(newk->kmer, kmer);
-
-                newk->count = 1;
-                newk->used = false;
-                // add first for the kmer to the hash
-                newk->next = kchash[h];
-                kchash[h] = newk;
-                n++;
-            }
-            posn++;
-        }
+/*
+ * Finish counting and return the table of kmers (which is not sorted yet), or NULL if we can't.
+ * This frees the counter either way. keep_all keeps every kmer, even if it is too rare to be part of a primer.
+ * verbose reports how accurate approximate counts are.
+ */
+static struct kmertable *counter_finish(struct kmercounter *kc, int numseqs, double minpercent, bool keep_all, bool verbose) {
+    struct kmertable *kt = kc->kt;
+    if (kc->hh) {
+        int maxerror = heavyhitters_max_error(kc->hh);
+        if (verbose)
+            fprintf(stderr, "Approximate counts of %ld kmers using %d counters. Counts are overestimated by at most %d\n",
+                    kc->hh->total, kc->hh->capacity, maxerror);
+        // every kmer that appears more than maxerror times is in the sketch, so we only miss
+        // seeds if the minimum count is no more than that
+        if (maxerror > 0 && (minpercent * numseqs / 100) <= maxerror)
+            fprintf(stderr, "WARNING: With %d counters, kmers in fewer than %f%% of the sequences may be missed. Try increasing -a\n",
+                    kc->hh->capacity, (double) maxerror / numseqs * 100);
+        kt = heavyhitters_to_kmertable(kc->hh);
+        heavyhitters_free(kc->hh);
     }
-    kseq_destroy(seq);
-    gzclose(fp);
-
-    // now we know how many kmers we have, we can convert our hash to an
-    // array of elements
-
-    if (debug)
-        fprintf(stderr, "Converting hash to array\n");
-
-    struct kmercount **kcarray;
-    kcarray = malloc(sizeof(*kcarray) * n);
-
-    int p = 0;
-    for (int i = 0; i < table_size; i++) {
-        struct kmercount *ptr = kchash[i];
-        while (ptr != NULL) {
-            kcarray[p++] = ptr;
-            ptr = ptr->next;
-        }
+    else if (kc->ks) {
+        // a kmer can only be part of a primer if it is at least 90% as abundant as a seed, and seeds are
+        // at least minpercent of the sequences, so we don't need to keep anything rarer than that
+        int mincount = (int) (0.9 * minpercent * numseqs / 100) - 1;
+        if (mincount < 1 || keep_all)
+            mincount = 1;
+        if (verbose && kc->ks->nspills > 0)
+            fprintf(stderr, "Spilled the kmers to disk %d times. Keeping kmers that appear at least %d times\n",
+                    kc->ks->nspills, mincount);
+        kt = kmerspill_finish(kc->ks, mincount);
     }
-    // remove the hash now we don't need it
-    free(kchash);
+    if (kt == NULL)
+        fprintf(stderr, "We cannot allocate the memory for the kmer table. Please try a smaller kmer\n");
+    return kt;
+}
 
-    if (debug)
-        fprintf(stderr, "Quick sorting\n");
 
-    qsort(kcarray, n, sizeof(*kcarray), comparator);
+/*
+ * Free the first n primers in a list, and the list
+ */
+static void free_primer_list(char **primers, int n) {
+    for (int i = 0; i < n; i++)
+        free(primers[i]);
+    free(primers);
+}
 
-    if (print_kmer_counts) {
-        for (int i = 0; i < n; i++) {
-            printf("Kmer: %s Count: %d\n", kcarray[i]->kmer, kcarray[i]->count);
-        }
-    }
-    if (debug)
-        fprintf(stderr, "There are %d kmers and the most appears %d times\n", n, kcarray[0]->count);
+/*
+ * Combine overlapping kmers from a sorted kmertable into primers, and add them to allprimers.
+ *
+ * allprimers has space for maxprimerposition primers and we realloc it if we need more, so use the
+ * pointer we return. If we can't, we free allprimers and return NULL.
+ */
+static char **merge_kmers(struct kmertable *kt, int kmerlen, int numseqs, double minpercent, bool print_short_primers,
+        bool debug, char **allprimers, int *allprimerposition, int *maxprimerposition) {
+    int n = kt->n;
 
     // now we can combine adjacent kmers into longer strings
     // start with the most abundant kmer that hasn't been used
@@ -206,9 +175,6 @@ int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_ou
     // this is an array of char *'s primers that we match
     // we initially set it to save 100 strings, but will keep track and realloc that if required
 
-    int maxprimerposition = 1000;
-    //allprimers = malloc(sizeof(*allprimers) * maxprimerposition);
-    //allprimers = (char **) realloc(allprimers, sizeof(*allprimers) * maxprimerposition);
     *allprimerposition = 0;
 
     bool testanother = true;
@@ -222,15 +188,19 @@ int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_ou
         iteration++;
         int thiscount = 0;
         testanother = false;
+        free(primer);
+        primer = NULL;
         for (int i = 0; i < n; i++) {
-            if (!kcarray[i]->used) {
-                if (((double) kcarray[i]->count/numseqs) * 100 < minpercent) {
-                    kcarray[i]->used = true;
+            if (!kt->used[i]) {
+                // approximate counts may be overestimated, so only seed with kmers we know are abundant enough
+                int mincount = kt->errors ? kt->counts[i] - kt->errors[i] : kt->counts[i];
+                if (((double) mincount/numseqs) * 100 < minpercent) {
+                    kt->used[i] = true;
                     continue;
                 }
-                kcarray[i]->used = true;
-                primer = strdup(kcarray[i]->kmer);
-                thiscount = kcarray[i]->count;
+                kt->used[i] = true;
+                primer = strdup(kmertable_key(kt, i));
+                thiscount = kt->counts[i];
                 testanother = true;
                 break;
             }
@@ -250,50 +220,40 @@ int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_ou
         while (matched) {
             matched = false;
             for (int i = 0; i < n; i++) {
-                //printf("Iteration: %d I: %d primer: %s kmer: %s Used: %d\n", iteration, i, primer, kcarray[i]->kmer, kcarray[i]->used);
-                if (kcarray[i]->used)
+                //printf("Iteration: %d I: %d primer: %s kmer: %s Used: %d\n", iteration, i, primer, kmertable_key(kt, i), kt->used[i]);
+                if (kt->used[i])
                     continue;
-                if (((float) kcarray[i]->count / thiscount) < 0.9)
+                if (((float) kt->counts[i] / thiscount) < 0.9)
                     continue;
+                char *kmer = kmertable_key(kt, i);
                 // check to see if the strings match at the beginning
-                char kbeg[kmerlen + 1];
-                char pbeg[kmerlen + 1];
-                substr(kcarray[i]->kmer, kbeg, 1, kmerlen);
-                substr(primer, pbeg, 0, kmerlen - 1);
-
-                if (strcmp(kbeg, pbeg) == 0) {
-                    // char tmp[strlen(primer) + 1];
-                    char tmp[strlen(primer) + 1];
-                    tmp[0] = kcarray[i]->kmer[0];
+                if (memcmp(kmer + 1, primer, kmerlen - 1) == 0) {
+                    char tmp[strlen(primer) + 2];
+                    tmp[0] = kmer[0];
                     for (unsigned long j = 0; j <= strlen(primer); j++)
                         tmp[j + 1] = primer[j];
                     primer = (char *) realloc(primer, strlen(tmp)+1);
                     strcpy(primer, tmp);
-                    kcarray[i]->used = true;
+                    kt->used[i] = true;
 
                     matched = true;
                     continue;
                 }
 
                 // check for matches at the end
-                char kend[kmerlen + 1];
-                char pend[kmerlen + 1];
-                substr(kcarray[i]->kmer, kend, 0, kmerlen - 1);
                 int pstartpos = (strlen(primer) - kmerlen) + 1;
-                substr(primer, pend, pstartpos, strlen(primer));
-
-                if (strcmp(kend, pend) == 0) {
+                if (memcmp(kmer, primer + pstartpos, kmerlen - 1) == 0) {
                     char tmp[strlen(primer) + 10];
                     unsigned long j = 0;
                     while (j < strlen(primer)) {
                         tmp[j] = primer[j];
                         j++;
                     }
-                    tmp[j] = kcarray[i]->kmer[strlen(kcarray[i]->kmer) - 1];
+                    tmp[j] = kmer[kmerlen - 1];
                     tmp[j + 1] = 0;
                     primer = (char *) realloc(primer, strlen(tmp)+1);
                     strcpy(primer, tmp);
-                    kcarray[i]->used = true;
+                    kt->used[i] = true;
                     matched = true;
                     continue;
                 }
@@ -313,12 +273,20 @@ int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_ou
                     addthis = false;
             }
             if (addthis) {
-                if (*allprimerposition == maxprimerposition) {
+                if (*allprimerposition == *maxprimerposition) {
                     // realloc all primers
-                    maxprimerposition *= 2;
+                    *maxprimerposition *= 2;
                     if (debug)
-                        fprintf(stderr, "Reallocating memory for all kmers (new size: %d)\n", maxprimerposition);
-                    allprimers = (char **) realloc(allprimers, sizeof(*allprimers) * maxprimerposition);
+                        fprintf(stderr, "Reallocating memory for all kmers (new size: %d)\n", *maxprimerposition);
+                    char **more = (char **) realloc(allprimers, sizeof(*allprimers) * (*maxprimerposition));
+                    if (more == NULL) {
+                        fprintf(stderr, "We cannot allocate the memory for the primers\n");
+                        free_primer_list(allprimers, *allprimerposition);
+                        *allprimerposition = 0;
+                        free(primer);
+                        return NULL;
+                    }
+                    allprimers = more;
                 }
                 allprimers[(*allprimerposition)++] = strdup(primer);
             }
@@ -328,18 +296,271 @@ int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_ou
 
     }
     free(primer);
+    return allprimers;
+}
 
-    if (*allprimerposition == 0) {
-        printf("No primers could be found. It is probably because minpercent (%f) is too high. Try adding -m 0 to the command line\n", minpercent);
-        return 0;
+static void free_all(struct packedread *packed, int nprimers) {
+    for (int i = 0; i < nprimers; i++)
+        packedread_free(&packed[i]);
+    free(packed);
+}
+
+/*
+ * Pack each of the nprimers primers once, for find_exact. Free them with free_all.
+ * Returns NULL if we can't.
+ */
+static struct packedread *pack_all(char **primers, int nprimers) {
+    struct packedread *packed = malloc(sizeof(*packed) * (nprimers > 0 ? nprimers : 1));
+    if (packed == NULL) {
+        fprintf(stderr, "We cannot allocate the memory for the primers\n");
+        return NULL;
+    }
+    for (int i = 0; i < nprimers; i++)
+        packedread_init(&packed[i]);
+    for (int i = 0; i < nprimers; i++) {
+        if (!packedread_pack(&packed[i], primers[i], strlen(primers[i]))) {
+            fprintf(stderr, "We cannot allocate the memory for the primers\n");
+            free_all(packed, nprimers);
+            return NULL;
+        }
+    }
+    return packed;
+}
+
+/*
+ * Find the first exact copy of the primer in the read, 32 bases at a time. A primer with an N (or a lower
+ * case base) in it can't match a packed read (an N never matches), so we look for those the old way.
+ */
+static char *find_exact(const struct packedread *read, char *seq, const struct packedread *primer, char *primerseq) {
+    for (size_t w = 0; w < primer->nwords; w++)
+        if (primer->nmask[w])
+            return strstr(seq, primerseq);
+    for (size_t pos = 0; pos + primer->len <= read->len; pos++)
+        if (packed_mismatches(read, pos, primer, 0, (int) primer->len, 0) == 0)
+            return seq + pos;
+    return NULL;
+}
+
+/*
+ * Count the first primer that is near the start (or the end, for three_prime) of one sequence, for print_abundance.
+ * The read and the primers are packed (packedread.h) so each read is only encoded once.
+ */
+static void count_abundance(const struct packedread *read, char *seq, char *name, char **primers,
+        const struct packedread *packedprimers, int nprimers, int *counts, int kmerlen, bool three_prime, bool debug) {
+    for (int i=0; i<nprimers; i++) {
+        char *offset = find_exact(read, seq, &packedprimers[i], primers[i]);
+        if (offset) {
+            unsigned long pos = (offset - seq) + 1;
+            if (three_prime) {
+                if (debug)
+                    fprintf(stderr, "For %s in %s pos %ld but strlen %ld and maxoffset %ld\n", primers[i], name, pos, strlen(seq), strlen(primers[i]) + 10);
+                if (strlen(seq) - pos < (unsigned long) (20 + kmerlen)) {
+                    counts[i]++;
+                    break;
+                }
+            } else {
+                if (pos < strlen(primers[i]) + 20) {
+                    counts[i]++;
+                    break;
+                }
+            }
+            if (debug)
+                fprintf(stderr, "For %s in %s pos %ld but maxoffset %ld\n", primers[i], name, pos, strlen(primers[i]) + 10);
+        }
+    }
+}
+
+/*
+ * The basic concept is that we don't know - a priori - how many kmers we will find, so we make a hash
+ * of kmers and their counts. max is actually 4**kmerlength and with small kmers (<=10) and moderate
+ * sized sequences we typically find all kmers, but this scales to larger k.
+ *
+ * The kmers, their counts, and whether we have used them are stored in contiguous arrays in a kmertable
+ * (see kmertable.c) rather than as a struct per kmer, so once we have all kmers we sort those arrays by
+ * frequency (kt->counts[i]) so we can combine the most abundant kmers first. The table is freed before
+ * we return, which matters when we are called over and over again from Python.
+ *
+ * We iterate through the array and try and merge kmers - making a note of ones that we have used by setting
+ * their boolean.
+ *
+ * If we are given a number of counters to approximate with, we use a Space-Saving sketch (heavyhitters.c)
+ * instead, so the memory is fixed no matter how many different kmers there are. Only the most abundant kmers
+ * can seed a primer, and those are the ones the sketch keeps.
+ *
+ * If we are given a memory limit instead, we still count exactly but spill sorted runs of kmers to temporary
+ * files whenever the table gets too big, and merge them at the end (kmerspill.c).
+ *
+ * The counts can be saved to a snapshot (kmersnapshot.c), and any number of snapshots can be added to the
+ * counts before we start, so new sequence files can be added to a prediction without recounting the old ones.
+ *
+ * We then have an optional step of looking back through the sequences to see if we can find those kmers. We
+ * decided not to keep all the sequences in memory, but rather iterate through the file twice as this
+ * would help with large sequence files.
+ *
+ */
+
+int predict_primers(char * infile, int shard, int nshards, char *cache, int kmerlen, double minpercent, bool fasta_output, bool three_prime, int approximate,
+        size_t max_memory, char *save_snapshot, char **snapshots, int nsnapshots, bool print_kmer_counts, bool print_abundance,
+        bool print_short_primers, bool debug, char ***primers, int *allprimerposition) {
+
+    *primers = NULL;
+    *allprimerposition = 0;
+
+    if( infile && access( infile, R_OK ) == -1 ) {
+        // file doesn't exist
+        fprintf(stderr, "ERROR: The file %s can not be found. Please check the file path\n", infile);
+        return 1;
+    }
+    if (!infile && nsnapshots == 0) {
+        fprintf(stderr, "ERROR: We need either a sequence file or a snapshot to predict primers from\n");
+        return 1;
+    }
+    if (cache && nshards > 1) {
+        fprintf(stderr, "ERROR: A cache is for the whole file, so we can not use it with a shard\n");
+        return 1;
+    }
+    if (save_snapshot && approximate > 0) {
+        fprintf(stderr, "ERROR: We can only save a snapshot of exact kmer counts. Please do not use -a\n");
+        return 1;
+    }
+
+    // open all the snapshots first, so we don't count anything if one of them doesn't match
+    struct kmersnapshot *snaps[nsnapshots > 0 ? nsnapshots : 1];
+    for (int i = 0; i < nsnapshots; i++) {
+        snaps[i] = kmersnapshot_open(snapshots[i]);
+        if (snaps[i] && (snaps[i]->kmerlen != kmerlen || snaps[i]->three_prime != three_prime)) {
+            fprintf(stderr, "ERROR: The snapshot %s has %d-mers from the %s end, but we are looking for %d-mers from the %s end\n",
+                    snapshots[i], snaps[i]->kmerlen, snaps[i]->three_prime ? "3'" : "5'", kmerlen, three_prime ? "3'" : "5'");
+            kmersnapshot_close(snaps[i]);
+            snaps[i] = NULL;
+        }
+        if (!snaps[i]) {
+            for (int j = 0; j < i; j++)
+                kmersnapshot_close(snaps[j]);
+            return 1;
+        }
+    }
+
+    // define our counter to hold the kmers
+    struct kmercounter kc;
+    if (!counter_init(&kc, kmerlen, approximate, max_memory)) {
+        // if we are not able to allocate the memory for this, there is no point continuing!
+        fprintf(stderr, "We cannot allocate the memory for the kmer table. Please try a smaller kmer\n");
+        for (int i = 0; i < nsnapshots; i++)
+            kmersnapshot_close(snaps[i]);
+        return 1;
+    }
+
+    // counted is false once we couldn't count a kmer (or read a snapshot), and then we stop
+    int numseqs = 0;
+    bool counted = true;
+    for (int i = 0; i < nsnapshots; i++) {
+        if (debug && counted)
+            fprintf(stderr, "Reading %ld kmers from %ld sequences in the snapshot %s\n", snaps[i]->nkmers, snaps[i]->numseqs, snapshots[i]);
+        char kmer[kmerlen + 1];
+        int count;
+        while (counted && kmersnapshot_next(snaps[i], kmer, &count))
+            counted = counter_add(&kc, kmer, count);
+        numseqs += snaps[i]->numseqs;
+        if (!kmersnapshot_close(snaps[i]))
+            counted = false;
+    }
+    if (!counted) {
+        counter_free(&kc);
+        return 1;
     }
 
+    if (infile) {
+        struct gzshard *fp;
+        kseq_t *seq;
+        //struct my_struct *s;
+        int l;
+
+        fp = gzshard_open(infile, shard, nshards);
+        if (fp == NULL) {
+            fprintf(stderr, "ERROR: Can not open %s\n", infile);
+            counter_free(&kc);
+            return 1;
+        }
+        seq = kseq_init(fp);
+        struct readcache *rc = cache ? readcache_open(cache, infile) : NULL;
+        if (debug)
+            fprintf(stderr, "Reading the sequences (first time)%s\n", rc && readcache_mapped(rc) ? " from the cache" : "");
+        while (counted && (l = readcache_kseq_read(rc, seq)) >= 0) {
+            numseqs++;
+            counted = counter_add_window(&kc, seq->seq.s, seq->seq.l, kmerlen, three_prime);
+        }
+        readcache_close(rc);
+        kseq_destroy(seq);
+        gzshard_close(fp);
+        if (!counted) {
+            counter_free(&kc);
+            return 1;
+        }
+    }
+
+    // a snapshot needs every kmer, so we can't drop the rare ones if we spilled to disk
+    struct kmertable *kt = counter_finish(&kc, numseqs, minpercent, save_snapshot != NULL, debug || print_kmer_counts);
+    if (kt == NULL)
+        return 1;
+
+    if (save_snapshot) {
+        if (debug)
+            fprintf(stderr, "Saving %d kmers from %d sequences to %s\n", kt->n, numseqs, save_snapshot);
+        if (!kmersnapshot_write(save_snapshot, kt, numseqs, three_prime)) {
+            kmertable_free(kt);
+            return 1;
+        }
+    }
+
+
+    // now we know how many kmers we have, we can sort the table by abundance
+
+    if (debug)
+        fprintf(stderr, "Quick sorting\n");
+
+    if (!kmertable_sort(kt)) {
+        kmertable_free(kt);
+        return 1;
+    }
+    int n = kt->n;
+
+    if (print_kmer_counts) {
+        for (int i = 0; i < n; i++) {
+            if (kt->errors)
+                printf("Kmer: %s Count: %d Error: %d\n", kmertable_key(kt, i), kt->counts[i], kt->errors[i]);
+            else
+                printf("Kmer: %s Count: %d\n", kmertable_key(kt, i), kt->counts[i]);
+        }
+    }
+    if (debug && n > 0)
+        fprintf(stderr, "There are %d kmers and the most appears %d times\n", n, kt->counts[0]);
+
+    // merge_kmers reallocs the primers if there are more than this, so we only hand them back at the end
+    int maxprimerposition = 1000;
+    char **allprimers = malloc(sizeof(*allprimers) * maxprimerposition);
+    if (allprimers == NULL) {
+        fprintf(stderr, "We cannot allocate the memory for the primers\n");
+        kmertable_free(kt);
+        return 1;
+    }
+    allprimers = merge_kmers(kt, kmerlen, numseqs, minpercent, print_short_primers, debug, allprimers, allprimerposition, &maxprimerposition);
+    kmertable_free(kt);
+    if (allprimers == NULL)
+        return 1;
+    *primers = allprimers;
+
+    if (*allprimerposition == 0)
+        return 0;
+
     // sort the final primers by length
     if (debug)
         fprintf(stderr, "Sorting primers\n");
     qsort(allprimers, (*allprimerposition)-1, sizeof(*allprimers), sort_by_length);
 
-    if (print_abundance) {
+    if (print_abundance && !infile)
+        fprintf(stderr, "We can only print the abundance of the primers when we have a sequence file\n");
+    if (print_abundance && infile) {
         // we are going to re-read the sequence file. I know this means two iterations, but the alternative is
         // to store the sequences as we read them, which we could do but is a pita.
         if (debug)
@@ -347,36 +568,45 @@ int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_ou
         int counts[*allprimerposition];
         for (int i = 0; i<*allprimerposition; i++)
             counts[i] = 0;
-        gzFile fp;
+        struct gzshard *fp;
         kseq_t *seq;
         //struct my_struct *s;
         int l;
 
-        fp = gzopen(infile, "r");
+        struct packedread *packed = pack_all(allprimers, *allprimerposition);
+        if (packed == NULL) {
+            free_primer_list(allprimers, *allprimerposition);
+            *primers = NULL;
+            *allprimerposition = 0;
+            return 1;
+        }
+        struct packedread read;
+        packedread_init(&read);
+        fp = gzshard_open(infile, shard, nshards);
+        if (fp == NULL) {
+            fprintf(stderr, "ERROR: Can not open %s\n", infile);
+            free_all(packed, *allprimerposition);
+            free_primer_list(allprimers, *allprimerposition);
+            *primers = NULL;
+            *allprimerposition = 0;
+            return 1;
+        }
         seq = kseq_init(fp);
-        while ((l = kseq_read(seq)) >= 0) {
-            for (int i=0; i<*allprimerposition; i++) {
-                char *offset = strstr(seq->seq.s, allprimers[i]);
-                if (offset) {
-                    unsigned long pos = (offset - seq->seq.s) + 1;
-                    if (three_prime) {
-                        if (debug)
-                            fprintf(stderr, "For %s in %s pos %ld but strlen %ld and maxoffset %ld\n", allprimers[i], seq->name.s, pos, strlen(seq->seq.s), strlen(allprimers[i]) + 10);
-                        if (strlen(seq->seq.s) - pos < (unsigned long) (20 + kmerlen)) {
-                            counts[i]++;
-                            break;
-                        }
-                    } else {
-                        if (pos < strlen(allprimers[i]) + 20) {
-                            counts[i]++;
-                            break;
-                        }
-                    }
-                    if (debug)
-                        fprintf(stderr, "For %s in %s pos %ld but maxoffset %ld\n", allprimers[i], seq->name.s, pos, strlen(allprimers[i]) + 10);
-                }
+        // the first pass wrote the cache (if it wasn't there already), so this time we can map it
+        struct readcache *rc = cache ? readcache_open(cache, infile) : NULL;
+        while ((l = readcache_kseq_read(rc, seq)) >= 0) {
+            if (!packedread_pack(&read, seq->seq.s, seq->seq.l)) {
+                fprintf(stderr, "ERROR: We cannot allocate memory for %s\n", seq->name.s);
+                exit(-1);
             }
+            count_abundance(&read, seq->seq.s, seq->name.s, allprimers, packed, *allprimerposition, counts, kmerlen,
+                    three_prime, debug);
         }
+        readcache_close(rc);
+        kseq_destroy(seq);
+        gzshard_close(fp);
+        packedread_free(&read);
+        free_all(packed, *allprimerposition);
         int total = 0;
         printf("Primer\tAbundance\n");
         for (int i=0; i < *allprimerposition; i++) {
@@ -394,6 +624,198 @@ int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_ou
 }
 
 
+/*
+ * Print the primers for one end of the sequences, and their abundance if we counted it.
+ */
+static void print_profile_primers(const char *title, const char *name, char **primers, int nprimers, int *counts,
+        int numseqs, bool fasta_output) {
+    if (fasta_output) {
+        for (int i = 0; i < nprimers; i++)
+            printf(">%s_%d\n%s\n", name, i, primers[i]);
+        return;
+    }
+    printf("%s\n", title);
+    if (nprimers == 0)
+        printf("None found\n");
+    int total = 0;
+    for (int i = 0; i < nprimers; i++) {
+        if (counts) {
+            printf("%s\t%d\n", primers[i], counts[i]);
+            total += counts[i];
+        }
+        else
+            printf("Primer %d: %s\n", i, primers[i]);
+    }
+    if (counts && nprimers > 0)
+        printf("Total primer occurrences: %d in %d sequences (%f%%)\n", total, numseqs, (float)total/numseqs*100);
+    printf("\n");
+}
+
+/*
+ * Print the base composition table for one end of the sequences
+ */
+static void print_composition(const char *title, const struct basecounts *bc, bool right) {
+    char consensus[bc->length + 1];
+    basecounts_consensus(bc, right, 0.5, consensus);
+    printf("%s: %s\n", title, consensus);
+    printf("Position\tA\tG\tC\tT\tN\n");
+    for (int i = 0; i < bc->length; i++) {
+        // number the 3' positions back from the end of the sequence
+        long *counts = right ? bc->right[bc->length - 1 - i] : bc->left[i];
+        printf("%d", right ? i - bc->length : i + 1);
+        for (int j = 0; j < 5; j++)
+            printf("\t%ld", counts[j]);
+        printf("\n");
+    }
+    printf("\n");
+}
+
+int profile_primers(char *infile, char *cache, int kmerlen, double minpercent, int approximate, size_t max_memory,
+        bool fasta_output, bool print_abundance, bool print_short_primers, bool debug) {
+
+    if( access( infile, R_OK ) == -1 ) {
+        // file doesn't exist
+        fprintf(stderr, "ERROR: The file %s can not be found. Please check the file path\n", infile);
+        return 1;
+    }
+
+    struct kmercounter left, right;
+    struct basecounts *bc = basecounts_init(20);
+    bool leftok = counter_init(&left, kmerlen, approximate, max_memory);
+    bool rightok = leftok && counter_init(&right, kmerlen, approximate, max_memory);
+    if (!rightok || !bc) {
+        fprintf(stderr, "We cannot allocate the memory for the kmer table. Please try a smaller kmer\n");
+        if (leftok)
+            counter_free(&left);
+        if (rightok)
+            counter_free(&right);
+        basecounts_free(bc);
+        return 1;
+    }
+    bool counted = true;
+
+    // one pass through the file for everything
+    struct gzshard *fp;
+    kseq_t *seq;
+    int l;
+
+    fp = gzshard_open(infile, 0, 1);
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Can not open %s\n", infile);
+        counter_free(&left);
+        counter_free(&right);
+        basecounts_free(bc);
+        return 1;
+    }
+    seq = kseq_init(fp);
+    struct readcache *rc = cache ? readcache_open(cache, infile) : NULL;
+    int numseqs = 0;
+    if (debug)
+        fprintf(stderr, "Reading the sequences and counting both ends%s\n", rc && readcache_mapped(rc) ? " from the cache" : "");
+    while (counted && (l = readcache_kseq_read(rc, seq)) >= 0) {
+        numseqs++;
+        counted = counter_add_window(&left, seq->seq.s, seq->seq.l, kmerlen, false) &&
+                counter_add_window(&right, seq->seq.s, seq->seq.l, kmerlen, true);
+        basecounts_add(bc, seq->seq.s, NULL, seq->seq.l);
+    }
+    readcache_close(rc);
+    kseq_destroy(seq);
+    gzshard_close(fp);
+    if (!counted) {
+        counter_free(&left);
+        counter_free(&right);
+        basecounts_free(bc);
+        return 1;
+    }
+
+    // now extend the kmers at each end into primers
+    struct kmercounter *counters[2] = {&left, &right};
+    char **primers[2] = {NULL, NULL};
+    int nprimers[2] = {0, 0};
+    // ok is false once something went wrong, and then we only tidy up
+    bool ok = true;
+    for (int end = 0; end < 2; end++) {
+        if (!ok) {
+            counter_free(counters[end]);
+            continue;
+        }
+        if (debug)
+            fprintf(stderr, "Merging the kmers from the %s end\n", end ? "3'" : "5'");
+        struct kmertable *kt = counter_finish(counters[end], numseqs, minpercent, false, debug);
+        int maxprimers = 100;
+        if (kt && kmertable_sort(kt))
+            primers[end] = malloc(sizeof(*primers[end]) * maxprimers);
+        if (primers[end])
+            primers[end] = merge_kmers(kt, kmerlen, numseqs, minpercent, print_short_primers, debug,
+                    primers[end], &nprimers[end], &maxprimers);
+        kmertable_free(kt);
+        if (primers[end] == NULL)
+            ok = false;
+        else if (nprimers[end] > 0)
+            qsort(primers[end], nprimers[end], sizeof(*primers[end]), sort_by_length);
+    }
+
+    // the abundance needs one more pass, but it is one pass for both ends
+    int *counts[2] = {NULL, NULL};
+    struct packedread *packed[2] = {NULL, NULL};
+    if (ok && print_abundance) {
+        packed[0] = pack_all(primers[0], nprimers[0]);
+        packed[1] = pack_all(primers[1], nprimers[1]);
+        ok = packed[0] && packed[1];
+    }
+    if (ok && print_abundance) {
+        if (debug)
+            fprintf(stderr, "Counting the abundance of the primers\n");
+        for (int end = 0; end < 2; end++)
+            counts[end] = calloc(nprimers[end] > 0 ? nprimers[end] : 1, sizeof(*counts[end]));
+        fp = gzshard_open(infile, 0, 1);
+        if (fp == NULL) {
+            fprintf(stderr, "ERROR: Can not open %s\n", infile);
+            ok = false;
+        }
+    }
+    if (ok && print_abundance) {
+        struct packedread read;
+        packedread_init(&read);
+        seq = kseq_init(fp);
+        rc = cache ? readcache_open(cache, infile) : NULL;
+        while ((l = readcache_kseq_read(rc, seq)) >= 0) {
+            if (!packedread_pack(&read, seq->seq.s, seq->seq.l)) {
+                fprintf(stderr, "ERROR: We cannot allocate memory for %s\n", seq->name.s);
+                exit(-1);
+            }
+            count_abundance(&read, seq->seq.s, seq->name.s, primers[0], packed[0], nprimers[0], counts[0], kmerlen, false, debug);
+            count_abundance(&read, seq->seq.s, seq->name.s, primers[1], packed[1], nprimers[1], counts[1], kmerlen, true, debug);
+        }
+        readcache_close(rc);
+        kseq_destroy(seq);
+        gzshard_close(fp);
+        packedread_free(&read);
+    }
+
+    if (ok && !fasta_output)
+        printf("Sequences: %d\n\n", numseqs);
+    if (ok) {
+        print_profile_primers("5' primers", "primer", primers[0], nprimers[0], counts[0], numseqs, fasta_output);
+        print_profile_primers("3' adapters", "adapter", primers[1], nprimers[1], counts[1], numseqs, fasta_output);
+    }
+    if (ok && !fasta_output) {
+        print_composition("Left primer", bc, false);
+        print_composition("Right primer", bc, true);
+    }
+
+    for (int end = 0; end < 2; end++) {
+        if (packed[end])
+            free_all(packed[end], nprimers[end]);
+        if (primers[end])
+            free_primer_list(primers[end], nprimers[end]);
+        free(counts[end]);
+    }
+    basecounts_free(bc);
+    return ok ? 0 : 1;
+}
+
+
 unsigned int hash (char *s) {
     unsigned int hashval;
 
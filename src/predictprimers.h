@@ -3,34 +3,44 @@
 #define PRIMER_PREDICTIONS_H
 
 #include <stdbool.h>
-
-/*
- * idloc is a struct with the kmer and the count of its occurence,
- * the id string for the sequence, and whether or not we've printed it out.
- * used is a boolean to determine if we have used this element in the final strings
- * next is a pointer to the next idloc element in the hash.
- */
-struct kmercount {
-    int count;
-    char *kmer;
-    bool used;
-    struct kmercount *next;
-};
-
+#include <stddef.h>
 
 /*
  * The method to do the running!
  *
- * Takes a char* for the file name of the fastq file, an int of the kmer length to use, a double for the minimum
- * percent of sequences that all reads should be in.
- * bool for fasta output for the primer sequences.
+ * Takes a char* for the file name of the fastq file, two ints for the shard of the file to count (and the number
+ * of shards, less than 2 to count the whole file, see gzshard.h), a char* for a cache of the file to read or
+ * write (or NULL, see readcache.h), an int of the kmer length to use, a double for
+ * the minimum percent of sequences that all reads should be in.
+ * bool for fasta output for the primer sequences, and a bool to look at the 3' end of the sequences.
+ * int for the number of counters to use to approximate the kmer counts in fixed memory (0 to count exactly).
+ * size_t for the most memory (in bytes) to use counting kmers exactly before spilling them to disk (0 for no limit).
+ * char* for a snapshot file to save the kmer counts to (or NULL), and an array of nsnapshots snapshot files to
+ * add to the counts (infile can be NULL if there are snapshots).
  * bool to print the kmer counts, and a bool to re-search through the sequences to list occurrences.
  * bool to print the short primer sequences, and a bool for debugging output
+ *
+ * The primers we find are put in a new array in *primers (free each primer and then the array), and
+ * the number of them in *allprimerposition. Nothing is printed to stdout unless one of the print options
+ * (or fasta_output) is set.
+ *
+ * Returns 0 if it worked. If it didn't (including running out of memory or disk space counting the
+ * kmers) it says why on stderr and returns 1, with no primers in *primers.
  */
 
-int predict_primers(char * infile, int kmerlen, double minpercent, bool fasta_output, bool three_prime,
-        bool print_kmer_counts, bool print_abundance, bool print_short_primers, bool debug,
-        char **allprimers, int *allprimerposition);
+int predict_primers(char * infile, int shard, int nshards, char *cache, int kmerlen, double minpercent, bool fasta_output, bool three_prime,
+        int approximate, size_t max_memory, char *save_snapshot, char **snapshots, int nsnapshots, bool print_kmer_counts, bool print_abundance, bool print_short_primers, bool debug,
+        char ***primers, int *allprimerposition);
+
+/*
+ * Profile both ends of the sequences in one pass through the file.
+ *
+ * We count the 5' kmers, the 3' kmers, and the base composition of the first and last 20 positions at the same
+ * time, merge the kmers at each end into primers, and print one report. With print_abundance we read the file
+ * one more time to count the primers at both ends. The other options are the same as predict_primers.
+ */
+int profile_primers(char *infile, char *cache, int kmerlen, double minpercent, int approximate, size_t max_memory,
+        bool fasta_output, bool print_abundance, bool print_short_primers, bool debug);
 
 /*
  * calculate the hash for a fastq sequence
@@ -50,13 +60,6 @@ unsigned int hash (char *);
  */
 void substr(char* seq, char * kmer, int start, int stop);
 
-/*
- * Compare two struct kmercount objects and return the one with the most counts first
- * Used by qsort to sort an array of kmercount objects by count (highest count first)
- */
-
-int comparator(const void *p, const void *q);
-
 /*
  * Compare two strings and return the longest one first
  * Used in quick sort to sort an array of sequences by length (longest first)
@@ -4,6 +4,11 @@
  *
  * This is fast, and simple, and is a quick way to assess whether there are primers in a sequence that should
  * be removed. We do not try any heuristics to identify multiple primers (e.g. tags or indexes).
+ *
+ * You can change the window (or use 0 to profile every position in the reads), and print the counts and the
+ * quality scores at every position. With more than one thread, one thread reads the file and hands batches of
+ * sequences to the others, which each keep their own counts that we add together at the end. With a cache we
+ * save the reads we have parsed, so that primer-predictions and primer-trimming don't have to read the file again.
  */
 
 
@@ -12,155 +17,367 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "kseq.h"
 #include "version.h"
+#include "basecounts.h"
+#include "readcache.h"
 
 
 
 
 KSEQ_INIT(gzFile, gzread)
 
-// how long a primer do we want to look for
-#define kmer 20
-// minimum fraction of sequences to be reported
-#define cutoff 0.5
-
-// we have five slots: 0: A; 1: G; 2: C; 3 T; 4: everything else
-int leftCounts[kmer][5];
-int numSeqs = 0;
-int rightCounts[kmer][5];
-
-void initialize_arrays() {
-	for (int i=0; i<kmer; i++) {
-		for (int j=0; j<5; j++) {
-			leftCounts[i][j] = 0;
-			rightCounts[i][j] = 0;
-		}
-	}
+// how many sequences we give a thread at once
+#define batch_size 4096
+
+/*
+ * A batch of sequences (and their qualities, if they have them) copied out of kseq
+ */
+struct batch {
+	int n;
+	size_t *offsets;
+	size_t *lengths;
+	bool *hasqual;
+	char *seqs;
+	char *quals;
+	size_t used;
+	size_t capacity;
+};
+
+/*
+ * A queue of batches shared between the reader and the counting threads
+ */
+struct queue {
+	struct batch **batches;
+	int size;
+	int head;
+	int n;
+	bool done;
+	pthread_mutex_t lock;
+	pthread_cond_t notempty;
+	pthread_cond_t notfull;
+};
+
+struct worker {
+	pthread_t thread;
+	struct queue *full;
+	struct queue *empty;
+	struct basecounts *bc;
+	bool ok;
+};
+
+
+void print_usage() {
+	printf("Usage: primer-basecounting [OPTIONS] INFILE\n");
+	printf("\t-w window: the number of positions to count at each end of the sequences (default 20, 0 for the whole read)\n");
+	printf("\t-c cutoff: the fraction of sequences a base must be in to be reported (default 0.5)\n");
+	printf("\t-p print the base counts and quality scores at every position\n");
+	printf("\t-t threads to count with (default 1)\n");
+	printf("\t-C cache: read the sequences from this cache of INFILE, or write it if it is not there\n");
+	printf("\t-v print the version and exit\n");
+	printf("\nCount the abundance of each base in the first and last 20 positions in a sequence file and print the most abundant base if it is more than the cutoff\n\n");
 }
 
+void print_possible_primer(const char *title, struct basecounts *bc, bool right, double cutoff) {
+	char *consensus = malloc(sizeof(char) * (bc->length + 1));
+	basecounts_consensus(bc, right, cutoff, consensus);
+	printf("%s: %s\n", title, consensus);
+	free(consensus);
+}
 
-void countseq(char* seq) {
-	// read left side primers
-	for (int i=0; i<kmer; i++) {
-		if (seq[i] == 65 || seq[i] == 97)
-			leftCounts[i][0]++;
-		else if (seq[i] == 71 || seq[i] == 103)
-			leftCounts[i][1]++;
-		else if (seq[i] == 67 || seq[i] == 99)
-			leftCounts[i][2]++;
-		else if (seq[i] == 84 || seq[i] == 116)
-			leftCounts[i][3]++;
-		else {
-            leftCounts[i][4]++;
-            printf("Adding %c to N's\n", seq[i]);
-        }
-	}
-
-	// read right side primers
-	int posn = kmer;
-	for (int i=strlen(seq)-1; i > strlen(seq)-kmer; i--) {
-		posn--;
-		if (seq[i] == 65 || seq[i] == 97)
-			rightCounts[posn][0]++;
-		else if (seq[i] == 71 || seq[i] == 103)
-			rightCounts[posn][1]++;
-		else if (seq[i] == 67 || seq[i] == 99)
-			rightCounts[posn][2]++;
-		else if (seq[i] == 84 || seq[i] == 116)
-			rightCounts[posn][3]++;
-        else {
-            rightCounts[posn][4]++;
-            printf("Adding %c to N's\n", seq[i]);
-        }
+void print_profile(const char *title, struct basecounts *bc, bool right) {
+	/*
+	 * Print the counts of each base, the mean quality score, and the percent of scores below 20 at each position.
+	 * The 3' positions are numbered back from the end of the sequence.
+	 */
+	printf("\n%s\nPosition\tA\tG\tC\tT\tN\tMean quality\t%% below Q20\n", title);
+	for (int i = 0; i < bc->length; i++) {
+		int idx = right ? bc->length - 1 - i : i;
+		long *counts = right ? bc->right[idx] : bc->left[idx];
+		struct qualstats *q = right ? &bc->rightqual[idx] : &bc->leftqual[idx];
+		printf("%d", right ? i - bc->length : i + 1);
+		for (int j = 0; j < 5; j++)
+			printf("\t%ld", counts[j]);
+		if (q->n > 0)
+			printf("\t%.2f\t%.2f\n", (double) q->sum / q->n, 100.0 * q->low / q->n);
+		else
+			printf("\t-\t-\n");
 	}
 }
 
-void print_array(int counts[kmer][5]) {
-    for (int i=0; i<kmer; i++) {
-        printf("%d: ", i);
-        for (int j=0; j<5; j++)
-            printf(" %d", counts[i][j]);
-        printf("\n");
-    }
+struct batch *batch_init() {
+	struct batch *b = calloc(1, sizeof(*b));
+	if (b == NULL)
+		return NULL;
+	b->offsets = malloc(sizeof(*b->offsets) * batch_size);
+	b->lengths = malloc(sizeof(*b->lengths) * batch_size);
+	b->hasqual = malloc(sizeof(*b->hasqual) * batch_size);
+	b->capacity = 1 << 20;
+	b->seqs = malloc(b->capacity);
+	b->quals = malloc(b->capacity);
+	if (!b->offsets || !b->lengths || !b->hasqual || !b->seqs || !b->quals) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the sequences\n");
+		exit(-1);
+	}
+	return b;
 }
 
-void print_possible_primer(int counts[kmer][5]) {
-
-	for (int i = 0; i < kmer; i++) {
-		// find the maximum element in the array
-		int idx = 0;
-		int maximum = counts[i][0];
+void batch_free(struct batch *b) {
+	free(b->offsets);
+	free(b->lengths);
+	free(b->hasqual);
+	free(b->seqs);
+	free(b->quals);
+	free(b);
+}
 
-		for (int j = 1; j < 5; j++) {
-			if (counts[i][j] > maximum) {
-				idx = j;
-				maximum = counts[i][j];
-			}
+void batch_add(struct batch *b, kseq_t *seq) {
+	if (b->used + seq->seq.l > b->capacity) {
+		while (b->used + seq->seq.l > b->capacity)
+			b->capacity *= 2;
+		b->seqs = realloc(b->seqs, b->capacity);
+		b->quals = realloc(b->quals, b->capacity);
+		if (!b->seqs || !b->quals) {
+			fprintf(stderr, "ERROR: We cannot allocate memory for the sequences\n");
+			exit(-1);
 		}
+	}
+	b->offsets[b->n] = b->used;
+	b->lengths[b->n] = seq->seq.l;
+	b->hasqual[b->n] = seq->qual.l == seq->seq.l;
+	memcpy(b->seqs + b->used, seq->seq.s, seq->seq.l);
+	if (b->hasqual[b->n])
+		memcpy(b->quals + b->used, seq->qual.s, seq->seq.l);
+	b->used += seq->seq.l;
+	b->n++;
+}
 
-		if ((float) maximum / numSeqs > cutoff) {
-			if (idx == 0)
-				putchar('A');
-			else if (idx == 1)
-				putchar('G');
-			else if (idx == 2)
-				putchar('C');
-			else if (idx == 3)
-				putchar('T');
-			else {
-                putchar('N');
-            }
-		} else {
-			putchar('-');
-		}
+void queue_init(struct queue *q, int size) {
+	q->batches = malloc(sizeof(*q->batches) * size);
+	q->size = size;
+	q->head = 0;
+	q->n = 0;
+	q->done = false;
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->notempty, NULL);
+	pthread_cond_init(&q->notfull, NULL);
+}
+
+void queue_destroy(struct queue *q) {
+	free(q->batches);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->notempty);
+	pthread_cond_destroy(&q->notfull);
+}
+
+void queue_push(struct queue *q, struct batch *b) {
+	pthread_mutex_lock(&q->lock);
+	while (q->n == q->size)
+		pthread_cond_wait(&q->notfull, &q->lock);
+	q->batches[(q->head + q->n++) % q->size] = b;
+	pthread_cond_signal(&q->notempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * Take the next batch off the queue, or return NULL once the queue is empty and finished
+ */
+struct batch *queue_pop(struct queue *q) {
+	pthread_mutex_lock(&q->lock);
+	while (q->n == 0 && !q->done)
+		pthread_cond_wait(&q->notempty, &q->lock);
+	struct batch *b = NULL;
+	if (q->n > 0) {
+		b = q->batches[q->head];
+		q->head = (q->head + 1) % q->size;
+		q->n--;
+		pthread_cond_signal(&q->notfull);
 	}
-	putchar('\n');
+	pthread_mutex_unlock(&q->lock);
+	return b;
 }
 
+void queue_finish(struct queue *q) {
+	pthread_mutex_lock(&q->lock);
+	q->done = true;
+	pthread_cond_broadcast(&q->notempty);
+	pthread_mutex_unlock(&q->lock);
+}
 
-void print_usage() {
-	printf("Usage: primer-counting INFILE\n\n");
-	printf("Count the abundance of each base in the first and last 20 positions in a sequence file and print if their abundance is >0.25\n\n");
+bool count_batch(struct basecounts *bc, struct batch *b) {
+	for (int i = 0; i < b->n; i++)
+		if (!basecounts_add(bc, b->seqs + b->offsets[i], b->hasqual[i] ? b->quals + b->offsets[i] : NULL, b->lengths[i]))
+			return false;
+	return true;
 }
 
-int main(int argc, char *argv[]){
+void *count_batches(void *arg) {
+	struct worker *w = arg;
+	struct batch *b;
+	while ((b = queue_pop(w->full)) != NULL) {
+		if (w->ok)
+			w->ok = count_batch(w->bc, b);
+		b->n = 0;
+		b->used = 0;
+		queue_push(w->empty, b);
+	}
+	return NULL;
+}
+
+struct basecounts *count_file(char *infile, char *cachefile, int window, int threads) {
+	/*
+	 * Count the bases in every sequence in infile (through cachefile if it is not NULL). Returns NULL if we
+	 * run out of memory.
+	 */
 	gzFile fp;
 	kseq_t *seq;
+	int l;
 
-	if (argc < 2) {
-		print_usage();
-		return 1;
+	fp = gzopen(infile, "r");
+	seq = kseq_init(fp);
+	struct readcache *cache = cachefile ? readcache_open(cachefile, infile) : NULL;
+	struct basecounts *bc = basecounts_init(window);
+	if (bc == NULL) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the counts\n");
+		exit(-1);
 	}
-	if (strcmp(argv[1], "-v") == 0) {
-		printf("Version: %f\n", __version__);
-		return 0;
+
+	if (threads <= 1) {
+		bool ok = true;
+		while (ok && (l = readcache_kseq_read(cache, seq)) >= 0)
+			ok = basecounts_add(bc, seq->seq.s, seq->qual.l == seq->seq.l ? seq->qual.s : NULL, seq->seq.l);
+		readcache_close(cache);
+		kseq_destroy(seq);
+		gzclose(fp);
+		if (!ok) {
+			basecounts_free(bc);
+			return NULL;
+		}
+		return bc;
 	}
 
-	initialize_arrays(); // set all the counts to 0
+	// two batches per thread, so one can be filled while the other is counted
+	int nbatches = 2 * threads;
+	struct queue full, empty;
+	queue_init(&full, nbatches);
+	queue_init(&empty, nbatches);
+	for (int i = 0; i < nbatches; i++)
+		queue_push(&empty, batch_init());
 
-	fp = gzopen(argv[1], "r");
-	seq = kseq_init(fp);
-	int l;
-	while ((l = kseq_read(seq)) >= 0) {
-		countseq(seq->seq.s);
-		numSeqs++;
+	struct worker *workers = malloc(sizeof(*workers) * threads);
+	for (int i = 0; i < threads; i++) {
+		workers[i].full = &full;
+		workers[i].empty = &empty;
+		workers[i].bc = basecounts_init(window);
+		workers[i].ok = workers[i].bc != NULL;
+		pthread_create(&workers[i].thread, NULL, count_batches, &workers[i]);
+	}
+
+	struct batch *b = queue_pop(&empty);
+	while ((l = readcache_kseq_read(cache, seq)) >= 0) {
+		batch_add(b, seq);
+		if (b->n == batch_size) {
+			queue_push(&full, b);
+			b = queue_pop(&empty);
+		}
+	}
+	queue_push(&full, b);
+	queue_finish(&full);
+	readcache_close(cache);
+
+	bool ok = true;
+	for (int i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ok = ok && workers[i].ok && basecounts_merge(bc, workers[i].bc);
+		basecounts_free(workers[i].bc);
 	}
+	free(workers);
+
+	// all the batches are back on the empty queue now
+	queue_finish(&empty);
+	while ((b = queue_pop(&empty)) != NULL)
+		batch_free(b);
+	queue_destroy(&full);
+	queue_destroy(&empty);
 	kseq_destroy(seq);
 	gzclose(fp);
+	if (!ok) {
+		basecounts_free(bc);
+		return NULL;
+	}
+	return bc;
+}
+
+int main(int argc, char *argv[]){
+	int window = 20;
+	double cutoff = 0.5;
+	int threads = 1;
+	bool print_counts = false;
+	char *cachefile = NULL;
+	int opt = 0;
+	static struct option long_options[] = {
+			{"window",   required_argument, 0, 'w'},
+			{"cutoff",   required_argument, 0, 'c'},
+			{"threads",  required_argument, 0, 't'},
+			{"print_counts", no_argument,   0, 'p'},
+			{"cache",    required_argument, 0, 'C'},
+			{"version",  no_argument,       0, 'v'},
+			{0,          0,                 0, 0}
+	};
+	int option_index = 0;
+	while ((opt = getopt_long(argc, argv, "w:c:t:C:pv", long_options, &option_index)) != -1) {
+		switch (opt) {
+			case 'w' :
+				window = atoi(optarg);
+				break;
+			case 'c' :
+				cutoff = strtod(optarg, NULL);
+				break;
+			case 't' :
+				threads = atoi(optarg);
+				break;
+			case 'p' :
+				print_counts = true;
+				break;
+			case 'C' :
+				cachefile = optarg;
+				break;
+			case 'v':
+				printf("Version: %f\n", __version__);
+				return 0;
+			default:
+				print_usage();
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind >= argc || window < 0) {
+		print_usage();
+		return 1;
+	}
+	char *infile = argv[optind];
+	if( access( infile, R_OK ) == -1 ) {
+		// file doesn't exist
+		fprintf(stderr, "ERROR: The file %s can not be found. Please check the file path\n", infile);
+		return 1;
+	}
+
+	struct basecounts *bc = count_file(infile, cachefile, window, threads);
+	if (bc == NULL) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the counts\n");
+		exit(-1);
+	}
 
-	printf("Left primer: ");
-	print_possible_primer(leftCounts);
-	printf("Right primer: ");
-	print_possible_primer(rightCounts);
+	print_possible_primer("Left primer", bc, false, cutoff);
+	print_possible_primer("Right primer", bc, true, cutoff);
 
-	/*
-	printf("Left counts\n");
-	print_array(leftCounts);
-	printf("\nRight counts\n");
-	print_array(rightCounts);
-    */
+	if (print_counts) {
+		print_profile("Left counts", bc, false);
+		print_profile("Right counts", bc, true);
+	}
 
+	basecounts_free(bc);
 	return 0;
 }
-
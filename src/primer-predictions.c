@@ -14,13 +14,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include "predictprimers.h"
+#include "gzshard.h"
 #include "version.h"
 
 void print_usage() {
     printf("Usage: primer-predictions [OPTIONS] Sequence File (fasta or fastq)\n");
+    printf("       primer-predictions [OPTIONS] -i snapshot [-i snapshot ...] [Sequence File]\n");
     printf("\t-k kmer length (default 8)\n");
     printf("\t-m minimum percent of the sequences that a kmer must appear in (default: 1%%)\n");
     printf("\t-t predict adapter sequences on the 3' end of the reads\n");
+    printf("\t-b profile both ends (5' primers, 3' adapters and base composition) in one pass\n");
+    printf("\t-a approximate the kmer counts using this many counters (fixed memory for very large or diverse files)\n");
+    printf("\t-o save the kmer counts to this snapshot file\n");
+    printf("\t-i add the kmer counts from this snapshot file (use -i more than once to merge several snapshots)\n");
+    printf("\t-S i/N only count the kmers in shard i of N of the sequence file, and save them with -o so the shards can be merged with -i\n");
+    printf("\t-C read the sequences from this cache of the sequence file (it is written the first time)\n");
+    printf("\t-M maximum memory for exact kmer counting, e.g. 500M or 4G (spills to $TMPDIR when it is full)\n");
     printf("\t-f fasta output of the primer sequences\n");
     printf("\t-p print abundance of each kmer\n");
     printf("\t-v print the version and exit\n");
@@ -29,13 +38,38 @@ void print_usage() {
     printf("Predict the primer sequences in a fasta/fastq file\n\n");
 }
 
+/*
+ * Convert a memory size like 512M or 2G (or just a number of bytes) to bytes. Returns 0 if we can't.
+ */
+size_t parse_memory(char *size) {
+    char *end;
+    double value = strtod(size, &end);
+    if (end == size || value <= 0)
+        return 0;
+    switch (*end) {
+        case 'k': case 'K': value *= 1024; break;
+        case 'm': case 'M': value *= 1024 * 1024; break;
+        case 'g': case 'G': value *= 1024 * 1024 * 1024; break;
+        case 0: break;
+        default: return 0;
+    }
+    return (size_t) value;
+}
+
 int main(int argc, char *argv[]) {
 
     // COMMAND LINE OPTIONS
-    char infile[255];
+    char infile[255] = "";
+    char *save_snapshot = NULL;
+    char *cache = NULL;
+    char **snapshots = NULL;
+    int nsnapshots = 0;
     bool print_abundance = false, print_kmer_counts = false, print_short = false, debug=false, fasta_output=false;
-    bool three_prime = false;
+    bool three_prime = false, both_ends = false;
     int kmerlen = 8;
+    int approximate = 0;
+    int shard = 0, nshards = 0;
+    size_t max_memory = 0;
     double minpercent = 1;
     int opt = 0;
     static struct option long_options[] = {
@@ -46,12 +80,20 @@ int main(int argc, char *argv[]) {
             {"print_short_primers",  no_argument, 0, 's'},
             {"fasta_output", no_argument, 0, 'f'},
             {"three_prime", no_argument, 0, 't'},
+            {"both_ends", no_argument, 0, 'b'},
+            {"approximate", required_argument, 0, 'a'},
+            {"save_snapshot", required_argument, 0, 'o'},
+            {"snapshot", required_argument, 0, 'i'},
+            {"shard", required_argument, 0, 'S'},
+            {"cache", required_argument, 0, 'C'},
+            {"max_memory", required_argument, 0, 'M'},
+            {"max-memory", required_argument, 0, 'M'},
             {"debug", no_argument, 0, 'd'},
             {"version", no_argument, 0, 'v'},
             {0, 0, 0, 0}
     };
     int option_index = 0;
-    while ((opt = getopt_long(argc, argv, "k:m:pcsdftv", long_options, &option_index )) != -1) {
+    while ((opt = getopt_long(argc, argv, "k:m:a:M:o:i:S:C:pcsdftbv", long_options, &option_index )) != -1) {
         switch (opt) {
             case 'k' :
                 kmerlen = atoi(optarg);
@@ -59,6 +101,32 @@ int main(int argc, char *argv[]) {
             case 'm':
                 minpercent = atof(optarg);
                 break;
+            case 'a':
+                approximate = atoi(optarg);
+                break;
+            case 'o':
+                save_snapshot = optarg;
+                break;
+            case 'i':
+                snapshots = realloc(snapshots, sizeof(*snapshots) * (nsnapshots + 1));
+                snapshots[nsnapshots++] = optarg;
+                break;
+            case 'S':
+                if (!gzshard_parse(optarg, &shard, &nshards)) {
+                    fprintf(stderr, "ERROR: The shard should be i/N, e.g. 3/10 (not %s)\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                cache = optarg;
+                break;
+            case 'M':
+                max_memory = parse_memory(optarg);
+                if (max_memory == 0) {
+                    fprintf(stderr, "ERROR: Can not understand the memory size %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'c' : print_kmer_counts = true;
                 break;
             case 'p' : print_abundance = true;
@@ -69,6 +137,8 @@ int main(int argc, char *argv[]) {
                 break;
             case 't': three_prime = true;
                 break;
+            case 'b': both_ends = true;
+                break;
             case 'd': debug = true;
                 break;
             case 'v':
@@ -87,7 +157,7 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    if (!*infile) {
+    if (!*infile && nsnapshots == 0) {
         print_usage();
         return 0;
     }
@@ -98,26 +168,59 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Minimum abundance percent: %f\n", minpercent);
         fprintf(stderr, "fasta output: %d\n", fasta_output);
         fprintf(stderr, "identify adapters on the 3' end: %d\n", three_prime);
+        fprintf(stderr, "Approximate counters: %d\n", approximate);
+        fprintf(stderr, "Maximum memory: %zu\n", max_memory);
+        fprintf(stderr, "Snapshots to merge: %d\n", nsnapshots);
+        if (save_snapshot)
+            fprintf(stderr, "Save snapshot to: %s\n", save_snapshot);
+        if (cache)
+            fprintf(stderr, "Cache: %s\n", cache);
         fprintf(stderr, "Print kmer counts: %d\n", print_kmer_counts);
         fprintf(stderr, "Print abundance: %i\n", print_abundance);
         fprintf(stderr, "Print short primers: %d\n\n", print_short);
     }
 
-    // for the results
-    char **allprimers;
-    allprimers = malloc(sizeof(*allprimers) * 1000); // initializing with max 1000 primer sequences.
+    if (nshards > 1 && (!*infile || !save_snapshot || both_ends)) {
+        fprintf(stderr, "ERROR: -S needs a sequence file and -o (so the shards can be merged with -i), and can not be used with -b\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cache && (!*infile || nshards > 1)) {
+        fprintf(stderr, "ERROR: -C needs a sequence file, and can not be used with -S\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (both_ends) {
+        if (!*infile || three_prime || save_snapshot || nsnapshots > 0 || print_kmer_counts) {
+            fprintf(stderr, "ERROR: -b needs a sequence file, and can not be used with -t, -o, -i or -c\n");
+            exit(EXIT_FAILURE);
+        }
+        int ro = profile_primers(infile, cache, kmerlen, minpercent, approximate, max_memory, fasta_output,
+                print_abundance, print_short, debug);
+        free(snapshots);
+        return ro;
+    }
+
+    // for the results, which predict_primers allocates
+    char **allprimers = NULL;
     int allprimerposition = 0;
 
 
-    int ro = predict_primers(infile, kmerlen, minpercent, fasta_output, three_prime, print_kmer_counts,
-            print_abundance, print_short, debug, allprimers, &allprimerposition);
+    int ro = predict_primers(*infile ? infile : NULL, shard, nshards, cache, kmerlen, minpercent, fasta_output, three_prime, approximate, max_memory,
+            save_snapshot, snapshots, nsnapshots, print_kmer_counts,
+            print_abundance, print_short, debug, &allprimers, &allprimerposition);
 
-    if (!print_abundance && !fasta_output) {
+    if (ro == 0 && allprimerposition == 0)
+        printf("No primers could be found. It is probably because minpercent (%f) is too high. Try adding -m 0 to the command line\n", minpercent);
+    else if (ro == 0 && !print_abundance && !fasta_output) {
         printf("Primers found\n");
         for (int i = 0; i < allprimerposition; i++)
             printf("Primer %d: %s\n", i, allprimers[i]);
     }
 
+    for (int i = 0; i < allprimerposition; i++)
+        free(allprimers[i]);
     free(allprimers);
+    free(snapshots);
     return ro;
 }
\ No newline at end of file
@@ -9,27 +9,79 @@
 #include <stdio.h>
 #include "version.h"
 #include "trimprimers.h"
+#include "trimmanifest.h"
+#include "trimserver.h"
+#include "gzshard.h"
 
 
 void print_usage() {
-    printf("Usage: primer-trimming --left_primers PRIMER_FILE1 --right_primers PRIMER_FILE2 INFILE\n\n");
+    printf("Usage: primer-trimming --left_primers PRIMER_FILE1 --right_primers PRIMER_FILE2 INFILE [INFILE ...]\n");
+    printf("       primer-trimming --left_primers PRIMER_FILE1 --right_primers PRIMER_FILE2 --manifest MANIFEST [--threads N]\n");
+    printf("       primer-trimming --left_primers PRIMER_FILE1 --right_primers PRIMER_FILE2 --serve SOCKET [--threads N]\n");
+    printf("       primer-trimming client SOCKET COMMAND (run primer-trimming client for the commands)\n");
+    printf("       primer-trimming --build_index INFILE [INFILE ...]\n");
+    printf("       primer-trimming --apply COORDINATES INFILE [INFILE ...]\n\n");
     printf("Primer trimming explanation...\n\n");
+    printf("\t--probe N try every trimming step on the first N reads, and skip the steps that don't trim enough of them\n");
+    printf("\t--probe_threshold F skip a step if it trims less than this fraction of the probe reads (default 0.001)\n");
+    printf("\t--probe_sample N while a step is skipped, still try it on every Nth read to see if it is needed (default 1000)\n");
+    printf("\t--report FILE write the probe decisions to this file (default: stderr)\n");
+    printf("\t--max_edits N allow up to N mismatches, insertions, and deletions in the primers (default: only mismatches)\n");
+    printf("\t--manifest FILE trim every sample in this file (an input and an output file on each line, separated by a tab) in --threads threads\n");
+    printf("\t--serve SOCKET keep the primers loaded, and trim the jobs that clients send to this Unix socket in --threads threads\n");
+    printf("\t--shard i/N only trim shard i of N of each file, so N processes can trim one big file (cat the outputs in order)\n");
+    printf("\t--build_index build the index that --shard needs for each file, once before you start the shards\n");
+    printf("\t--coordinates FILE write where to trim each read to this file (gzipped if it ends .gz) instead of writing the reads\n");
+    printf("\t--apply FILE trim the reads with the coordinates in this file, without looking for the primers again\n");
+    printf("\t--cache FILE read the reads from this cache of INFILE (e.g. from primer-basecounting --cache), or write it if it is not there\n");
+    printf("\nLong reads:\n");
+    printf("\t--end_window N only look for the right primers in the last N bases of each read (default: the whole read)\n");
+    printf("\t--chimeras FILE also look for the primers inside the reads, and write where they are to this file\n");
+    printf("\t--chunk_size N search the inside of each read in chunks of N bases (default 10000)\n");
+    printf("\t--threads N search the chunks of each read in up to N threads (default 1)\n\n");
 }
 
 int main(int argc, char *argv[]) {
 	// COMMAND LINE OPTIONS
-	char infile[255];
 	char **primersL = NULL;
 	char **primersR = NULL;
+	struct trimprobe probe = {0, 0.001, 1000, stderr};
+	char *report = NULL;
+	struct trimoptions options;
+	trimoptions_default(&options);
+	char *chimeras = NULL;
+	char *manifest = NULL;
+	char *serve = NULL;
+	bool build_index = false;
+	char *coordinates = NULL;
+	char *apply = NULL;
 	int opt = 0;
 	static struct option long_options[] = {
 			{"left_primers",  required_argument, 0, 'l'},
 			{"right_primers", required_argument, 0, 'r'},
+			{"probe",         required_argument, 0, 'p'},
+			{"probe_threshold", required_argument, 0, 't'},
+			{"probe_sample",  required_argument, 0, 's'},
+			{"report",        required_argument, 0, 'R'},
+			{"max_edits",     required_argument, 0, 'e'},
+			{"end_window",    required_argument, 0, 'w'},
+			{"chimeras",      required_argument, 0, 'c'},
+			{"chunk_size",    required_argument, 0, 'k'},
+			{"threads",       required_argument, 0, 'T'},
+			{"manifest",      required_argument, 0, 'm'},
+			{"serve",         required_argument, 0, 'S'},
+			{"shard",         required_argument, 0, 'i'},
+			{"build_index",   no_argument,       0, 'B'},
+			{"coordinates",   required_argument, 0, 'C'},
+			{"apply",         required_argument, 0, 'A'},
+			{"cache",         required_argument, 0, 'K'},
 			{"version",       no_argument,       0, 'v'},
 			{0,               0,                 0, 0}
 	};
 	int option_index = 0;
-	while ((opt = getopt_long(argc, argv, "l:r:v", long_options, &option_index)) != -1) {
+	if (argc > 1 && strcmp(argv[1], "client") == 0)
+		return trim_client(argc - 1, argv + 1);
+	while ((opt = getopt_long(argc, argv, "l:r:p:t:s:R:e:w:c:k:T:m:S:i:BC:A:K:v", long_options, &option_index)) != -1) {
 		switch (opt) {
 			case 'l' :
 				primersL = load_primers(optarg);
@@ -37,6 +89,61 @@ int main(int argc, char *argv[]) {
 			case 'r' :
 				primersR = load_primers(optarg);
 				break;
+			case 'p' :
+				probe.reads = atol(optarg);
+				break;
+			case 't' :
+				probe.threshold = strtod(optarg, NULL);
+				break;
+			case 's' :
+				probe.sample_every = atol(optarg);
+				break;
+			case 'R' :
+				report = optarg;
+				break;
+			case 'e' :
+				options.maxedits = atoi(optarg);
+				if (options.maxedits < 0) {
+					fprintf(stderr, "ERROR: --max_edits must be 0 or more\n");
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'w' :
+				options.end_window = atoi(optarg);
+				break;
+			case 'c' :
+				chimeras = optarg;
+				break;
+			case 'k' :
+				options.chunk_size = atoi(optarg);
+				break;
+			case 'T' :
+				options.threads = atoi(optarg);
+				break;
+			case 'm' :
+				manifest = optarg;
+				break;
+			case 'S' :
+				serve = optarg;
+				break;
+			case 'i' :
+				if (!gzshard_parse(optarg, &options.shard, &options.nshards)) {
+					fprintf(stderr, "ERROR: The shard should be i/N, e.g. 3/10 (not %s)\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'B' :
+				build_index = true;
+				break;
+			case 'C' :
+				coordinates = optarg;
+				break;
+			case 'A' :
+				apply = optarg;
+				break;
+			case 'K' :
+				options.cache = optarg;
+				break;
 			case 'v':
 				printf("Version: %f\n", __version__);
 				return 0;
@@ -45,17 +152,96 @@ int main(int argc, char *argv[]) {
 				exit(EXIT_FAILURE);
 		}
 	}
-	/* remaining command line arguments (not options). */
-	if (optind < argc) {
-		while (optind < argc) {
-			strcpy(infile, argv[optind++]);
-			break;
+	if (build_index) {
+		if (optind == argc) {
+			print_usage();
+			exit(EXIT_FAILURE);
+		}
+		while (optind < argc)
+			if (!gzshard_build_index(argv[optind++]))
+				return 1;
+		return 0;
+	}
+	// the cache is for one whole file
+	if (options.cache && (options.nshards > 1 || argc - optind > 1)) {
+		fprintf(stderr, "ERROR: --cache can only be used with one file, and not with --shard\n");
+		exit(EXIT_FAILURE);
+	}
+	if (apply) {
+		if (optind == argc || coordinates) {
+			print_usage();
+			exit(EXIT_FAILURE);
 		}
+		gzFile fp = gzopen(apply, "r");
+		if (fp == NULL) {
+			fprintf(stderr, "ERROR: Can not open %s\n", apply);
+			exit(EXIT_FAILURE);
+		}
+		int ro = apply_coordinates(argv + optind, argc - optind, fp, &options);
+		gzclose(fp);
+		return ro;
 	}
-	if ((primersL == NULL) & (primersR == NULL)) {
+	/* remaining command line arguments (not options) are the files to trim, unless we have a manifest */
+	if ((primersL == NULL) & (primersR == NULL) || (optind == argc) == (manifest == NULL && serve == NULL) || (manifest && serve)) {
 		print_usage();
 		exit(EXIT_FAILURE);
 	}
 
-	return trim_primers(infile, primersL, primersR);
+	if (options.chunk_size < 1 || options.threads < 1) {
+		fprintf(stderr, "ERROR: --chunk_size and --threads must be at least 1\n");
+		exit(EXIT_FAILURE);
+	}
+	if (manifest || serve) {
+		if (chimeras || probe.reads > 0 || options.nshards > 1 || coordinates || options.cache) {
+			fprintf(stderr, "ERROR: --chimeras, --probe, --shard, --coordinates and --cache can not be used with --manifest or --serve\n");
+			exit(EXIT_FAILURE);
+		}
+		int ro;
+		if (manifest)
+			ro = trim_manifest(manifest, primersL, primersR, &options, options.threads);
+		else
+			ro = trim_serve(serve, primersL, primersR, &options, options.threads);
+		free_primers(primersL);
+		free_primers(primersR);
+		return ro;
+	}
+	if (chimeras) {
+		options.chimeras = fopen(chimeras, "w");
+		if (options.chimeras == NULL) {
+			fprintf(stderr, "ERROR: Can not write the chimeras to %s\n", chimeras);
+			exit(EXIT_FAILURE);
+		}
+		fprintf(options.chimeras, "#read\tprimers\tprimer\tend\tedits\n");
+	}
+
+	if (coordinates) {
+		size_t len = strlen(coordinates);
+		options.coordinates = gzopen(coordinates, len > 3 && strcmp(coordinates + len - 3, ".gz") == 0 ? "wb" : "wT");
+		if (options.coordinates == NULL) {
+			fprintf(stderr, "ERROR: Can not write the coordinates to %s\n", coordinates);
+			exit(EXIT_FAILURE);
+		}
+		gzprintf(options.coordinates, "#read\tlength\tstart\tend\tleft_primer\tleft_edits\tright_primer\tright_edits\n");
+	}
+
+	if (report && probe.reads > 0) {
+		probe.report = fopen(report, "w");
+		if (probe.report == NULL) {
+			fprintf(stderr, "ERROR: Can not write the report to %s\n", report);
+			exit(EXIT_FAILURE);
+		}
+	}
+	// each file is trimmed (and probed) on its own, one after the other
+	int ro = 0;
+	while (optind < argc && ro == 0)
+		ro = trim_primers_probe(argv[optind++], primersL, primersR, probe.reads > 0 ? &probe : NULL, &options);
+	if (report && probe.reads > 0)
+		fclose(probe.report);
+	if (options.chimeras)
+		fclose(options.chimeras);
+	if (options.coordinates && gzclose(options.coordinates) != Z_OK) {
+		fprintf(stderr, "ERROR: We could not write all the coordinates to %s\n", coordinates);
+		ro = 1;
+	}
+	return ro;
 }
\ No newline at end of file
@@ -0,0 +1,194 @@
+/*
+ * The libprimertrim contexts (see primertrim.h). These are thin wrappers around the code the command
+ * line tools use, so the library trims and predicts exactly the same way they do.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "primertrim.h"
+#include "trimprimers.h"
+#include "predictprimers.h"
+#include "packedread.h"
+
+struct primertrim_primers {
+    char **primers;                 // NULL terminated, as from load_primers
+    int n;
+    struct packedprimers *packed;
+};
+
+struct primertrim_trimmer {
+    const struct packedprimers *left;
+    const struct packedprimers *right;
+    struct trimoptions options;
+    struct packedread read;
+};
+
+struct primertrim_predictor {
+    struct primertrim_predict_options options;
+};
+
+/*
+ * Take the primers (a NULL terminated list we now own) and pack them
+ */
+static struct primertrim_primers *make_primers(char **list) {
+    struct primertrim_primers *primers = malloc(sizeof(*primers));
+    if (primers == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+        free_primers(list);
+        return NULL;
+    }
+    primers->primers = list;
+    primers->n = 0;
+    while (list[primers->n] != NULL)
+        primers->n++;
+    primers->packed = pack_primers(list);
+    return primers;
+}
+
+struct primertrim_primers *primertrim_primers_load(const char *filename) {
+    // load_primers exits if it can't open the file, so we check first
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Can not open the primer file %s\n", filename);
+        return NULL;
+    }
+    fclose(fp);
+    return make_primers(load_primers((char *) filename));
+}
+
+struct primertrim_primers *primertrim_primers_new(const char * const *sequences, int n) {
+    char **list = calloc(n > 0 ? n + 1 : 1, sizeof(*list));
+    if (list == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+        return NULL;
+    }
+    for (int i = 0; i < n; i++) {
+        if ((list[i] = strdup(sequences[i])) == NULL) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+            free_primers(list);
+            return NULL;
+        }
+    }
+    return make_primers(list);
+}
+
+int primertrim_primers_count(const struct primertrim_primers *primers) {
+    return primers->n;
+}
+
+const char *primertrim_primers_get(const struct primertrim_primers *primers, int i) {
+    if (i < 0 || i >= primers->n)
+        return NULL;
+    return primers->primers[i];
+}
+
+void primertrim_primers_free(struct primertrim_primers *primers) {
+    if (primers == NULL)
+        return;
+    free_packed_primers(primers->packed);
+    free_primers(primers->primers);
+    free(primers);
+}
+
+void primertrim_options_default(struct primertrim_options *options) {
+    options->max_edits = -1;
+    options->end_window = 0;
+}
+
+struct primertrim_trimmer *primertrim_trimmer_new(const struct primertrim_primers *left,
+        const struct primertrim_primers *right, const struct primertrim_options *options) {
+    if (left == NULL && right == NULL) {
+        fprintf(stderr, "ERROR: Either left or right primers must be given\n");
+        return NULL;
+    }
+    struct primertrim_trimmer *trimmer = malloc(sizeof(*trimmer));
+    if (trimmer == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the trimmer\n");
+        return NULL;
+    }
+    struct primertrim_options defaults;
+    primertrim_options_default(&defaults);
+    if (options == NULL)
+        options = &defaults;
+    trimmer->left = left ? left->packed : NULL;
+    trimmer->right = right ? right->packed : NULL;
+    trimoptions_default(&trimmer->options);
+    trimmer->options.maxedits = options->max_edits;
+    trimmer->options.end_window = options->end_window;
+    packedread_init(&trimmer->read);
+    return trimmer;
+}
+
+int primertrim_trim(struct primertrim_trimmer *trimmer, const char *sequence, size_t length,
+        struct primertrim_result *result) {
+    struct trimresult trimmed;
+    if (!packedread_pack(&trimmer->read, sequence, length))
+        return -1;
+    trim_read(trimmer->left, trimmer->right, sequence, &trimmer->read, &trimmer->options, &trimmed);
+    result->start = trimmed.start;
+    result->end = trimmed.end;
+    result->left_primer = trimmed.left_primer;
+    result->right_primer = trimmed.right_primer;
+    result->left_edits = trimmed.left_edits;
+    result->right_edits = trimmed.right_edits;
+    return 0;
+}
+
+void primertrim_trimmer_free(struct primertrim_trimmer *trimmer) {
+    if (trimmer == NULL)
+        return;
+    packedread_free(&trimmer->read);
+    free(trimmer);
+}
+
+void primertrim_predict_options_default(struct primertrim_predict_options *options) {
+    // the same defaults as primer-predictions
+    options->kmer_length = 8;
+    options->min_percent = 1.0;
+    options->three_prime = false;
+    options->approximate = 0;
+    options->max_memory = 0;
+}
+
+struct primertrim_predictor *primertrim_predictor_new(const struct primertrim_predict_options *options) {
+    struct primertrim_predictor *predictor = malloc(sizeof(*predictor));
+    if (predictor == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the predictor\n");
+        return NULL;
+    }
+    if (options)
+        predictor->options = *options;
+    else
+        primertrim_predict_options_default(&predictor->options);
+    return predictor;
+}
+
+int primertrim_predict(struct primertrim_predictor *predictor, const char *filename,
+        struct primertrim_primers **primers) {
+    const struct primertrim_predict_options *o = &predictor->options;
+    char **found = NULL;
+    int nfound = 0;
+    *primers = NULL;
+    int ro = predict_primers((char *) filename, 0, 1, NULL, o->kmer_length, o->min_percent, false, o->three_prime, o->approximate,
+            o->max_memory, NULL, NULL, 0, false, false, false, false, &found, &nfound);
+    if (ro != 0)
+        return ro;
+
+    // the primers need to be NULL terminated for a primer set
+    char **list = realloc(found, sizeof(*list) * (nfound + 1));
+    if (list == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+        for (int i = 0; i < nfound; i++)
+            free(found[i]);
+        free(found);
+        return -1;
+    }
+    list[nfound] = NULL;
+    *primers = make_primers(list);
+    return *primers ? 0 : -1;
+}
+
+void primertrim_predictor_free(struct primertrim_predictor *predictor) {
+    free(predictor);
+}
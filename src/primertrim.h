@@ -0,0 +1,119 @@
+/*
+ * libprimertrim: primer prediction and trimming as a C library.
+ *
+ * Everything is in a context object, and nothing is global, so any number of threads can use the
+ * library at once. A primer set is read only once it is made, so one set can be shared by every thread.
+ * A trimmer has its own scratch space, so each thread needs its own trimmer (they are cheap). Nothing
+ * here writes to stdout.
+ *
+ * Functions that make something return NULL if they can't (and say why on stderr), and functions that
+ * do something return 0 if it worked. Like the command line tools, the library still ends the process
+ * (with exit(-1)) if malloc fails for the few bytes it needs to pack a primer set or to read a sequence
+ * file, but running out of memory or disk space counting kmers is returned as an error.
+ *
+ * Build it with make lib, and link with -lprimertrim -lz -lm -pthread.
+ */
+
+#ifndef PRIMERTRIM_H
+#define PRIMERTRIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PRIMERTRIM_API_VERSION 1
+
+// the library is built with -fvisibility=hidden, so only these functions are exported
+#if defined(__GNUC__)
+#define PRIMERTRIM_EXPORT __attribute__((visibility("default")))
+#else
+#define PRIMERTRIM_EXPORT
+#endif
+
+struct primertrim_primers;
+struct primertrim_trimmer;
+struct primertrim_predictor;
+
+/*
+ * A set of primers from a fasta file (one primer per line), or from n sequences. The sequences can
+ * have IUPAC codes in them.
+ */
+PRIMERTRIM_EXPORT struct primertrim_primers * primertrim_primers_load(const char *filename);
+PRIMERTRIM_EXPORT struct primertrim_primers * primertrim_primers_new(const char * const *sequences, int n);
+PRIMERTRIM_EXPORT int primertrim_primers_count(const struct primertrim_primers *primers);
+PRIMERTRIM_EXPORT const char * primertrim_primers_get(const struct primertrim_primers *primers, int i);
+PRIMERTRIM_EXPORT void primertrim_primers_free(struct primertrim_primers *primers);
+
+/*
+ * How to trim:
+ *  - max_edits: if 0 or more, allow up to this many mismatches, insertions, and deletions in the
+ *    primers. If less than 0 (the default) we only allow mismatches.
+ *  - end_window: if more than 0, only look for the right primers in the last end_window bases.
+ */
+struct primertrim_options {
+    int max_edits;
+    int end_window;
+};
+
+PRIMERTRIM_EXPORT void primertrim_options_default(struct primertrim_options *options);
+
+/*
+ * Where to trim one sequence. The part to keep is [start, end). The primers are numbered from 0 in the
+ * order they are in the set, and they (and the edits) are -1 if we didn't find one.
+ */
+struct primertrim_result {
+    int start;
+    int end;
+    int left_primer;
+    int right_primer;
+    int left_edits;
+    int right_edits;
+};
+
+/*
+ * A trimmer for the left and/or right primers (either can be NULL, but not both). The trimmer only
+ * points to the primer sets, so keep them until the trimmer is freed. options can be NULL for the defaults.
+ */
+PRIMERTRIM_EXPORT struct primertrim_trimmer * primertrim_trimmer_new(const struct primertrim_primers *left,
+        const struct primertrim_primers *right, const struct primertrim_options *options);
+PRIMERTRIM_EXPORT int primertrim_trim(struct primertrim_trimmer *trimmer, const char *sequence, size_t length,
+        struct primertrim_result *result);
+PRIMERTRIM_EXPORT void primertrim_trimmer_free(struct primertrim_trimmer *trimmer);
+
+/*
+ * Predict the primers at the 5' (or 3') end of the sequences in a fastq or fasta file:
+ *  - kmer_length: the length of the kmers we count and join into primers.
+ *  - min_percent: the percent of the sequences a kmer has to be in to start a primer.
+ *  - three_prime: look at the 3' end instead.
+ *  - approximate: if more than 0, count the kmers approximately with this many counters.
+ *  - max_memory: if more than 0, the most memory (in bytes) to use counting kmers exactly.
+ */
+struct primertrim_predict_options {
+    int kmer_length;
+    double min_percent;
+    bool three_prime;
+    int approximate;
+    size_t max_memory;
+};
+
+PRIMERTRIM_EXPORT void primertrim_predict_options_default(struct primertrim_predict_options *options);
+
+PRIMERTRIM_EXPORT struct primertrim_predictor * primertrim_predictor_new(const struct primertrim_predict_options *options);
+
+/*
+ * Predict the primers in filename, and make them into a new primer set in *primers (which may have
+ * no primers in it). Returns non-zero, and leaves *primers NULL, if we can't read the file or can't
+ * count its kmers.
+ */
+PRIMERTRIM_EXPORT int primertrim_predict(struct primertrim_predictor *predictor, const char *filename,
+        struct primertrim_primers **primers);
+PRIMERTRIM_EXPORT void primertrim_predictor_free(struct primertrim_predictor *predictor);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //PRIMERTRIM_H
@@ -7,6 +7,8 @@
 #include <stdbool.h>
 #include "predictprimers.h"
 #include "pyprimer-predictions.h"
+#include "pyprimerset.h"
+#include "pytrimresults.h"
 #include "pyprinseq.h"
 
 
@@ -16,6 +18,8 @@ primer_predictions(PyObject *self, PyObject *args) {
     char * infile = NULL;
     int kmerlen = 0;
     double minpercent = 20.0;
+    int approximate = 0;
+    Py_ssize_t max_memory = 0;
 
     bool three_prime = false;
     bool fasta_output = false, print_kmer_counts = false, print_abundance = false;
@@ -23,29 +27,29 @@ primer_predictions(PyObject *self, PyObject *args) {
 
     /* Parse arguments */
     // , , &fasta_output, &print_kmer_counts, &print_abundance, &print_short, &debug
-    if(!PyArg_ParseTuple(args, "sidb", &infile, &kmerlen, &minpercent, &three_prime)) {
+    if(!PyArg_ParseTuple(args, "sidb|in", &infile, &kmerlen, &minpercent, &three_prime, &approximate, &max_memory)) {
             PyErr_SetString(PyExc_RuntimeError, "Could not parse the arguments to python_input");
         return NULL;
     }
 
     // for the results
-    char **allprimers;
-    allprimers = malloc(sizeof(*allprimers) * 1); // initializing with 1 member, but will realloc later
+    char **allprimers = NULL;
     int allprimerposition=0;
 
-    int ro = predict_primers(infile, kmerlen, minpercent, fasta_output, three_prime, print_kmer_counts, print_abundance, print_short, debug, allprimers, &allprimerposition);
+    int ro = predict_primers(infile, 0, 1, NULL, kmerlen, minpercent, fasta_output, three_prime, approximate, (size_t) max_memory, NULL, NULL, 0, print_kmer_counts, print_abundance, print_short, debug, &allprimers, &allprimerposition);
     if (ro != 0) {
-        fprintf(stderr, "Error: Running the primer search returned %d\n", ro);
+        PyErr_Format(PyExc_RuntimeError, "Running the primer search returned %d", ro);
         return NULL;
     }
 
-    // convert our list of primers to a python object
+    // convert our list of primers to a python object. There are only ever a handful of primers, so a list of
+    // strings is fine here (unlike the trimming results, see pytrimresults.c)
     PyObject *result = PyList_New(0);
 
     for (int i=0; i < allprimerposition; i++) {
         PyObject *item = Py_BuildValue("s", allprimers[i]);
-        fprintf(stderr, "Appended %s\n", allprimers[i]);
         PyList_Append(result, item);
+        Py_XDECREF(item);
     }
 
     // CRITICAL: We need to reset the repeats before we
@@ -59,5 +63,23 @@ primer_predictions(PyObject *self, PyObject *args) {
 
 
 PyMODINIT_FUNC PyInit_PyPrinseq(void) {
-    return PyModule_Create(&PyPrinseqModule);
+    if (PyType_Ready(&PrimerSetType) < 0 || PyType_Ready(&TrimResultsType) < 0 || PyType_Ready(&TrimColumnType) < 0 ||
+        PyType_Ready(&ReaderType) < 0)
+        return NULL;
+    PyObject *module = PyModule_Create(&PyPrinseqModule);
+    if (module == NULL)
+        return NULL;
+    Py_INCREF(&PrimerSetType);
+    if (PyModule_AddObject(module, "PrimerSet", (PyObject *) &PrimerSetType) < 0) {
+        Py_DECREF(&PrimerSetType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&TrimResultsType);
+    if (PyModule_AddObject(module, "TrimResults", (PyObject *) &TrimResultsType) < 0) {
+        Py_DECREF(&TrimResultsType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
 }
@@ -1,43 +1,215 @@
 //
 // Created by redwards on 8/4/20.
 //
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <stdbool.h>
 #include "pyprimer-trimming.h"
 #include "trimprimers.h"
+#include "packedread.h"
+#include "pyprimerset.h"
+#include "pytrimresults.h"
 #include "pyprinseq.h"
 
 PyObject *
 pyprimer_trimming(PyObject *self, PyObject *args) {
     // COMMAND LINE OPTIONS
     char *infile = NULL;
-    char **primersL = NULL;
-    char **primersR = NULL;
+    PyObject *leftPrimer = Py_None;
+    PyObject *rightPrimer = Py_None;
+    PrimerSetObject *primersL = NULL;
+    PrimerSetObject *primersR = NULL;
 
-    char *leftPrimer = NULL;
-    char *rightPrimer = NULL;
-
-    if(!PyArg_ParseTuple(args, "szz", &infile, &leftPrimer, &rightPrimer)) {
+    // the primers can be fasta files, lists of sequences, or PrimerSets
+    if(!PyArg_ParseTuple(args, "sOO", &infile, &leftPrimer, &rightPrimer)) {
         PyErr_SetString(PyExc_RuntimeError, "Could not parse the arguments to python_input");
         return NULL;
     }
 
-    if (0) {
-        fprintf(stderr, "infile: %s\n", infile);
-        fprintf(stderr, "left primer file: %s\n", leftPrimer);
-        fprintf(stderr, "right primer file: %s\n", rightPrimer);
+    if ((leftPrimer == Py_None) & (rightPrimer == Py_None)) {
+        PyErr_SetString(PyExc_ValueError, "Either left or right primers must be given");
+        return NULL;
     }
 
-    if (leftPrimer != NULL)
-        primersL = load_primers(leftPrimer);
-    if (rightPrimer != NULL)
-        primersR = load_primers(rightPrimer);
-
-    if ((primersL == NULL) & (primersR == NULL)) {
-        exit(EXIT_FAILURE);
+    if (leftPrimer != Py_None && (primersL = primerset_from_python(leftPrimer)) == NULL)
+        return NULL;
+    if (rightPrimer != Py_None && (primersR = primerset_from_python(rightPrimer)) == NULL) {
+        Py_XDECREF(primersL);
+        return NULL;
     }
 
-    int ro = trim_primers(infile, primersL, primersR);
+    int ro = trim_primers(infile, primersL ? primersL->primers : NULL, primersR ? primersR->primers : NULL);
+    Py_XDECREF(primersL);
+    Py_XDECREF(primersR);
 
     return PyLong_FromLong((long) ro);
 }
 
+/*
+ * A batch of sequences from Python. We keep a reference to every sequence (or the buffer they are in)
+ * so that they can't go away while we trim them without the GIL.
+ */
+struct pybatch {
+    Py_ssize_t n;
+    const char **seqs;
+    Py_ssize_t *lengths;
+    PyObject **refs;
+    Py_ssize_t nrefs;
+    Py_buffer buffer;
+    bool hasbuffer;
+};
+
+static void
+pybatch_free(struct pybatch *b) {
+    for (Py_ssize_t i = 0; i < b->nrefs; i++)
+        Py_DECREF(b->refs[i]);
+    if (b->hasbuffer)
+        PyBuffer_Release(&b->buffer);
+    free(b->seqs);
+    free(b->lengths);
+    free(b->refs);
+}
+
+static bool
+pybatch_grow(struct pybatch *b, Py_ssize_t n) {
+    b->seqs = malloc(sizeof(*b->seqs) * (n > 0 ? n : 1));
+    b->lengths = malloc(sizeof(*b->lengths) * (n > 0 ? n : 1));
+    if (b->seqs == NULL || b->lengths == NULL) {
+        PyErr_NoMemory();
+        return false;
+    }
+    return true;
+}
+
+/*
+ * The sequences are either a list of strings (or bytes), or one buffer (e.g. bytes or a memoryview)
+ * with a sequence on each line
+ */
+static bool
+pybatch_init(struct pybatch *b, PyObject *obj) {
+    memset(b, 0, sizeof(*b));
+    if (!PyUnicode_Check(obj) && PyObject_CheckBuffer(obj)) {
+        if (PyObject_GetBuffer(obj, &b->buffer, PyBUF_SIMPLE) < 0)
+            return false;
+        b->hasbuffer = true;
+        const char *data = b->buffer.buf;
+        Py_ssize_t len = b->buffer.len;
+        Py_ssize_t n = 0;
+        for (Py_ssize_t i = 0; i < len; i++)
+            n += data[i] == '\n';
+        if (len > 0 && data[len - 1] != '\n')
+            n++;
+        if (!pybatch_grow(b, n))
+            return false;
+        Py_ssize_t start = 0;
+        for (Py_ssize_t i = 0; i <= len && b->n < n; i++) {
+            if (i == len || data[i] == '\n') {
+                Py_ssize_t end = i > start && data[i - 1] == '\r' ? i - 1 : i;
+                b->seqs[b->n] = data + start;
+                b->lengths[b->n++] = end - start;
+                start = i + 1;
+            }
+        }
+        return true;
+    }
+
+    PyObject *seq = PySequence_Fast(obj, "The sequences must be a list of strings or a buffer");
+    if (seq == NULL)
+        return false;
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    b->refs = malloc(sizeof(*b->refs) * (n > 0 ? n : 1));
+    if (b->refs == NULL || !pybatch_grow(b, n)) {
+        if (b->refs == NULL)
+            PyErr_NoMemory();
+        Py_DECREF(seq);
+        return false;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        const char *s;
+        Py_ssize_t len;
+        if (PyBytes_Check(item)) {
+            s = PyBytes_AS_STRING(item);
+            len = PyBytes_GET_SIZE(item);
+        } else if ((s = PyUnicode_AsUTF8AndSize(item, &len)) == NULL) {
+            Py_DECREF(seq);
+            return false;
+        }
+        Py_INCREF(item);
+        b->refs[b->nrefs++] = item;
+        b->seqs[b->n] = s;
+        b->lengths[b->n++] = len;
+    }
+    Py_DECREF(seq);
+    return true;
+}
+
+/*
+ * Trim every sequence in the batch with the packed primers. This doesn't use any Python objects, so we
+ * can run it without the GIL. Returns false if we run out of memory.
+ */
+static bool
+trim_batch(const struct pybatch *b, const struct packedprimers *left, const struct packedprimers *right,
+           const struct trimoptions *options, TrimResultsObject *results) {
+    struct packedread read;
+    struct trimresult result;
+    packedread_init(&read);
+    bool ok = true;
+    for (Py_ssize_t i = 0; i < b->n && ok; i++) {
+        ok = packedread_pack(&read, b->seqs[i], b->lengths[i]);
+        if (ok) {
+            trim_read(left, right, b->seqs[i], &read, options, &result);
+            trimresults_set(results, i, &result);
+        }
+    }
+    packedread_free(&read);
+    return ok;
+}
+
+PyObject *
+pytrim_batch(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"sequences", "left_primers", "right_primers", "max_edits", "end_window", NULL};
+    PyObject *sequences = NULL, *left = Py_None, *right = Py_None;
+    struct trimoptions options;
+    trimoptions_default(&options);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOii", keywords, &sequences, &left, &right,
+                                     &options.maxedits, &options.end_window))
+        return NULL;
+    if (left == Py_None && right == Py_None) {
+        PyErr_SetString(PyExc_ValueError, "Either left or right primers must be given");
+        return NULL;
+    }
+
+    // the primers are packed once in a PrimerSet, so if we are given one we don't do anything to them
+    PrimerSetObject *primersL = NULL, *primersR = NULL;
+    if (left != Py_None && (primersL = primerset_from_python(left)) == NULL)
+        return NULL;
+    if (right != Py_None && (primersR = primerset_from_python(right)) == NULL) {
+        Py_XDECREF(primersL);
+        return NULL;
+    }
+
+    struct pybatch batch;
+    bool ok = pybatch_init(&batch, sequences);
+    TrimResultsObject *results = NULL;
+    if (ok)
+        ok = (results = trimresults_new(batch.n)) != NULL;
+    if (ok) {
+        const struct packedprimers *packedL = primersL ? primersL->packed : NULL;
+        const struct packedprimers *packedR = primersR ? primersR->packed : NULL;
+        Py_BEGIN_ALLOW_THREADS
+        ok = trim_batch(&batch, packedL, packedR, &options, results);
+        Py_END_ALLOW_THREADS
+        if (!ok)
+            PyErr_NoMemory();
+    }
+    pybatch_free(&batch);
+    Py_XDECREF(primersL);
+    Py_XDECREF(primersR);
+    if (!ok) {
+        Py_XDECREF(results);
+        return NULL;
+    }
+    return (PyObject *) results;
+}
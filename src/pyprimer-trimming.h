@@ -7,4 +7,9 @@
 
 PyObject * pyprimer_trimming(PyObject *self, PyObject *args);
 
+/*
+ * Trim a batch of sequences in memory, and return where to trim each of them
+ */
+PyObject * pytrim_batch(PyObject *self, PyObject *args, PyObject *kwargs);
+
 #endif //PRIMER_TRIMMING_PYPRIMER_TRIMMING_H
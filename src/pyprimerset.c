@@ -0,0 +1,138 @@
+//
+// The PrimerSet Python type. Loading and packing the primers is done once when the set is made, and
+// the memory is freed when Python has finished with it, so a loop over lots of samples doesn't load the
+// primers again (or leak them) every time.
+//
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdbool.h>
+#include "trimprimers.h"
+#include "pyprimerset.h"
+
+/*
+ * The primers from either the name of a fasta file, or a list of primer sequences. Returns a NULL
+ * terminated list (to free with free_primers), or NULL with a Python exception set.
+ */
+static char **
+load_python_primers(PyObject *obj) {
+    if (PyUnicode_Check(obj)) {
+        const char *filename = PyUnicode_AsUTF8(obj);
+        if (filename == NULL)
+            return NULL;
+        // load_primers exits if it can't open the file, so we check first
+        FILE *fp = fopen(filename, "r");
+        if (fp == NULL) {
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, filename);
+            return NULL;
+        }
+        fclose(fp);
+        return load_primers((char *) filename);
+    }
+
+    PyObject *seq = PySequence_Fast(obj, "The primers must be a file name or a list of sequences");
+    if (seq == NULL)
+        return NULL;
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    char **primers = calloc(n + 1, sizeof(*primers));
+    if (primers == NULL) {
+        Py_DECREF(seq);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        const char *primer = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+        if (primer == NULL || (primers[i] = strdup(primer)) == NULL) {
+            if (primer != NULL)
+                PyErr_NoMemory();
+            free_primers(primers);
+            Py_DECREF(seq);
+            return NULL;
+        }
+    }
+    Py_DECREF(seq);
+    return primers;
+}
+
+static int
+primerset_init(PrimerSetObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"primers", NULL};
+    PyObject *primers = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", keywords, &primers))
+        return -1;
+    if (self->primers != NULL) {
+        PyErr_SetString(PyExc_RuntimeError, "This PrimerSet has already been made");
+        return -1;
+    }
+    self->primers = load_python_primers(primers);
+    if (self->primers == NULL)
+        return -1;
+    self->n = 0;
+    while (self->primers[self->n] != NULL)
+        self->n++;
+    Py_BEGIN_ALLOW_THREADS
+    self->packed = pack_primers(self->primers);
+    Py_END_ALLOW_THREADS
+    return 0;
+}
+
+static void
+primerset_dealloc(PrimerSetObject *self) {
+    if (self->packed)
+        free_packed_primers(self->packed);
+    free_primers(self->primers);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static Py_ssize_t
+primerset_length(PrimerSetObject *self) {
+    return self->n;
+}
+
+static PyObject *
+primerset_item(PrimerSetObject *self, Py_ssize_t i) {
+    if (i < 0 || i >= self->n) {
+        PyErr_SetString(PyExc_IndexError, "PrimerSet index out of range");
+        return NULL;
+    }
+    return PyUnicode_FromString(self->primers[i]);
+}
+
+static PyObject *
+primerset_repr(PrimerSetObject *self) {
+    return PyUnicode_FromFormat("PrimerSet(%zd primers)", self->n);
+}
+
+static PySequenceMethods primerset_sequence = {
+        .sq_length = (lenfunc) primerset_length,
+        .sq_item = (ssizeargfunc) primerset_item,
+};
+
+PyTypeObject PrimerSetType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "PyPrinseq.PrimerSet",
+        .tp_doc = "PrimerSet(primers)\n"
+                  "A set of primers from a fasta file or a list of sequences, ready to use for trimming.\n"
+                  "Make it once and pass it to trimbatch or primertrimming as many times as you like.",
+        .tp_basicsize = sizeof(PrimerSetObject),
+        .tp_itemsize = 0,
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_new = PyType_GenericNew,
+        .tp_init = (initproc) primerset_init,
+        .tp_dealloc = (destructor) primerset_dealloc,
+        .tp_repr = (reprfunc) primerset_repr,
+        .tp_as_sequence = &primerset_sequence,
+};
+
+PrimerSetObject *
+primerset_from_python(PyObject *obj) {
+    if (PyObject_TypeCheck(obj, &PrimerSetType)) {
+        PrimerSetObject *set = (PrimerSetObject *) obj;
+        if (set->packed == NULL) {
+            PyErr_SetString(PyExc_ValueError, "This PrimerSet has no primers");
+            return NULL;
+        }
+        Py_INCREF(obj);
+        return set;
+    }
+    return (PrimerSetObject *) PyObject_CallOneArg((PyObject *) &PrimerSetType, obj);
+}
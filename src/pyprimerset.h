@@ -0,0 +1,25 @@
+//
+// A set of primers that is loaded and packed once, and can be used for any number of trimming calls
+//
+
+#ifndef PYPRIMERSET_H
+#define PYPRIMERSET_H
+
+#include <Python.h>
+
+typedef struct {
+    PyObject_HEAD
+    char **primers;                 // NULL terminated, as from load_primers
+    Py_ssize_t n;
+    struct packedprimers *packed;
+} PrimerSetObject;
+
+extern PyTypeObject PrimerSetType;
+
+/*
+ * A PrimerSet from a PrimerSet (which we just return), a fasta file name, or a list of primer sequences.
+ * Returns a new reference, or NULL with a Python exception set.
+ */
+PrimerSetObject * primerset_from_python(PyObject *obj);
+
+#endif //PYPRIMERSET_H
@@ -7,6 +7,16 @@
 PyMethodDef PyPrinseqMethods[] = {
         {"primerpredict", primer_predictions, METH_VARARGS, "Python interface for ANSI-C primer predictions"},
         {"primertrimming", pyprimer_trimming, METH_VARARGS, "Python interface for ANSI-C primer trimming"},
+        {"trimbatch", (PyCFunction)(void(*)(void)) pytrim_batch, METH_VARARGS | METH_KEYWORDS,
+                "trimbatch(sequences, left_primers=None, right_primers=None, max_edits=-1, end_window=0)\n"
+                "Trim a list of sequences (or a buffer with one sequence per line) and return a TrimResults with\n"
+                "where to trim each one. The primers can be a fasta file, a list of sequences, or a PrimerSet.\n"
+                "The GIL is released while we trim."},
+        {"open", (PyCFunction)(void(*)(void)) pyreader_open, METH_VARARGS | METH_KEYWORDS,
+                "open(path, left_primers=None, right_primers=None, batch_size=4096, max_edits=-1, end_window=0)\n"
+                "Iterate over a fastq or fasta file (which may be gzipped) in lists of up to batch_size\n"
+                "(header, sequence, quality) records. If primers are given the records are already trimmed.\n"
+                "The file is read and trimmed in a C thread while Python works on the previous batch."},
         {NULL, NULL, 0, NULL}
 };
 
@@ -8,11 +8,12 @@
 
 #include "pyprimer-predictions.h"
 #include "pyprimer-trimming.h"
+#include "pyreader.h"
 
 
 // PyMethodDef PyPrinseqMethods[];
 
-struct PyModuleDef PyPrinseqModule;
+extern struct PyModuleDef PyPrinseqModule;
 
 
 
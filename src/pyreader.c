@@ -0,0 +1,471 @@
+//
+// The Reader Python type, returned by PyPrinseq.open. A C thread reads the file with kseq (so gzip
+// is decompressed there too), trims each record, and hands whole batches to Python through a small
+// queue. Python only has to make the strings for each batch, and doesn't hold the GIL while it waits
+// for the next one.
+//
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "kseq.h"
+#include "trimprimers.h"
+#include "packedread.h"
+#include "pyprimerset.h"
+#include "pyreader.h"
+
+KSEQ_INIT(gzFile, gzread)
+
+// one batch is being read while one is ready for Python and one is being converted
+#define reader_batches 3
+// the status if we run out of memory (kseq_read uses -1 to -3)
+#define reader_nomemory -4
+
+/*
+ * Where one record is in the batch. The header is the name and comment, and the quality (if there
+ * is one) follows the sequence.
+ */
+struct record {
+    size_t header;
+    int headerlen;
+    size_t seq;
+    int len;
+    bool hasqual;
+    int start;
+    int end;
+};
+
+struct recordbatch {
+    int n;
+    struct record *records;
+    char *data;
+    size_t used;
+    size_t capacity;
+};
+
+/*
+ * Everything the reading thread uses. None of it is a Python object, so the thread never needs the GIL.
+ */
+struct recordreader {
+    gzFile fp;
+    kseq_t *seq;
+    const struct packedprimers *left;
+    const struct packedprimers *right;
+    struct trimoptions options;
+    int batch_size;
+
+    struct recordbatch *batches[reader_batches];
+    struct recordbatch *full[reader_batches];
+    int head;
+    int nfull;
+    struct recordbatch *empty[reader_batches];
+    int nempty;
+    bool done;                  // the thread has finished reading
+    bool stop;                  // Python has asked the thread to finish
+    int status;                 // from kseq_read, or reader_nomemory
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t space;
+};
+
+typedef struct {
+    PyObject_HEAD
+    struct recordreader *reader;
+    bool running;
+    int waiting;                // how many Python threads are waiting in next without the GIL
+    PyObject *path;
+    PrimerSetObject *left;
+    PrimerSetObject *right;
+} ReaderObject;
+
+static struct recordbatch *
+recordbatch_init(int size) {
+    struct recordbatch *b = calloc(1, sizeof(*b));
+    if (b == NULL)
+        return NULL;
+    b->records = malloc(sizeof(*b->records) * size);
+    b->capacity = 1 << 20;
+    b->data = malloc(b->capacity);
+    if (b->records == NULL || b->data == NULL) {
+        free(b->records);
+        free(b->data);
+        free(b);
+        return NULL;
+    }
+    return b;
+}
+
+static void
+recordbatch_free(struct recordbatch *b) {
+    if (b == NULL)
+        return;
+    free(b->records);
+    free(b->data);
+    free(b);
+}
+
+static bool
+recordbatch_append(struct recordbatch *b, const char *s, size_t len) {
+    if (b->used + len > b->capacity) {
+        size_t capacity = b->capacity;
+        while (b->used + len > capacity)
+            capacity *= 2;
+        char *data = realloc(b->data, capacity);
+        if (data == NULL)
+            return false;
+        b->data = data;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->used, s, len);
+    b->used += len;
+    return true;
+}
+
+static bool
+recordbatch_add(struct recordbatch *b, const kseq_t *seq) {
+    struct record *r = &b->records[b->n];
+    r->header = b->used;
+    if (!recordbatch_append(b, seq->name.s, seq->name.l))
+        return false;
+    if (seq->comment.l && (!recordbatch_append(b, " ", 1) || !recordbatch_append(b, seq->comment.s, seq->comment.l)))
+        return false;
+    r->headerlen = (int) (b->used - r->header);
+    r->seq = b->used;
+    r->len = (int) seq->seq.l;
+    r->hasqual = seq->qual.l == seq->seq.l;
+    if (!recordbatch_append(b, seq->seq.s, seq->seq.l))
+        return false;
+    if (r->hasqual && !recordbatch_append(b, seq->qual.s, seq->qual.l))
+        return false;
+    r->start = 0;
+    r->end = r->len;
+    b->n++;
+    return true;
+}
+
+/*
+ * Wait for an empty batch, or return NULL if Python has closed the reader
+ */
+static struct recordbatch *
+take_empty(struct recordreader *rr) {
+    pthread_mutex_lock(&rr->lock);
+    while (rr->nempty == 0 && !rr->stop)
+        pthread_cond_wait(&rr->space, &rr->lock);
+    struct recordbatch *b = rr->stop ? NULL : rr->empty[--rr->nempty];
+    pthread_mutex_unlock(&rr->lock);
+    return b;
+}
+
+static void
+give_empty(struct recordreader *rr, struct recordbatch *b) {
+    pthread_mutex_lock(&rr->lock);
+    rr->empty[rr->nempty++] = b;
+    pthread_cond_signal(&rr->space);
+    pthread_mutex_unlock(&rr->lock);
+}
+
+static void
+give_full(struct recordreader *rr, struct recordbatch *b) {
+    pthread_mutex_lock(&rr->lock);
+    rr->full[(rr->head + rr->nfull++) % reader_batches] = b;
+    pthread_cond_signal(&rr->ready);
+    pthread_mutex_unlock(&rr->lock);
+}
+
+/*
+ * Wait for the next full batch, or return NULL once the file is finished
+ */
+static struct recordbatch *
+take_full(struct recordreader *rr) {
+    pthread_mutex_lock(&rr->lock);
+    while (rr->nfull == 0 && !rr->done)
+        pthread_cond_wait(&rr->ready, &rr->lock);
+    struct recordbatch *b = NULL;
+    if (rr->nfull > 0) {
+        b = rr->full[rr->head];
+        rr->head = (rr->head + 1) % reader_batches;
+        rr->nfull--;
+    }
+    pthread_mutex_unlock(&rr->lock);
+    return b;
+}
+
+static void *
+read_records(void *arg) {
+    struct recordreader *rr = arg;
+    struct packedread read;
+    struct trimresult result;
+    struct recordbatch *b;
+    bool trim = rr->left != NULL || rr->right != NULL;
+    int l = 0;
+
+    packedread_init(&read);
+    while (l >= 0 && (b = take_empty(rr)) != NULL) {
+        b->n = 0;
+        b->used = 0;
+        while (b->n < rr->batch_size && (l = kseq_read(rr->seq)) >= 0) {
+            if (!recordbatch_add(b, rr->seq) || (trim && !packedread_pack(&read, rr->seq->seq.s, rr->seq->seq.l))) {
+                l = reader_nomemory;
+                break;
+            }
+            if (trim) {
+                trim_read(rr->left, rr->right, rr->seq->seq.s, &read, &rr->options, &result);
+                b->records[b->n - 1].start = result.start;
+                b->records[b->n - 1].end = result.end;
+            }
+        }
+        if (b->n > 0 && l != reader_nomemory)
+            give_full(rr, b);
+        else
+            give_empty(rr, b);
+    }
+    packedread_free(&read);
+
+    pthread_mutex_lock(&rr->lock);
+    rr->status = l;
+    rr->done = true;
+    pthread_cond_broadcast(&rr->ready);
+    pthread_mutex_unlock(&rr->lock);
+    return NULL;
+}
+
+static void
+recordreader_free(struct recordreader *rr) {
+    for (int i = 0; i < reader_batches; i++)
+        recordbatch_free(rr->batches[i]);
+    if (rr->seq)
+        kseq_destroy(rr->seq);
+    if (rr->fp)
+        gzclose(rr->fp);
+    pthread_mutex_destroy(&rr->lock);
+    pthread_cond_destroy(&rr->ready);
+    pthread_cond_destroy(&rr->space);
+    free(rr);
+}
+
+/*
+ * Stop the thread (if it is still reading) and free everything. This can be called more than once, but
+ * not while another thread is waiting in reader_next (see reader_closable).
+ */
+static void
+reader_close(ReaderObject *self) {
+    struct recordreader *rr = self->reader;
+    if (rr == NULL)
+        return;
+    if (self->running) {
+        pthread_mutex_lock(&rr->lock);
+        rr->stop = true;
+        pthread_cond_broadcast(&rr->space);
+        pthread_mutex_unlock(&rr->lock);
+        Py_BEGIN_ALLOW_THREADS
+        pthread_join(rr->thread, NULL);
+        Py_END_ALLOW_THREADS
+        self->running = false;
+    }
+    recordreader_free(rr);
+    self->reader = NULL;
+}
+
+static void
+reader_dealloc(ReaderObject *self) {
+    reader_close(self);
+    Py_XDECREF(self->path);
+    Py_XDECREF(self->left);
+    Py_XDECREF(self->right);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+/*
+ * The (header, sequence, quality) of each record in the batch. The quality is None for fasta.
+ */
+static PyObject *
+batch_to_list(const struct recordbatch *b) {
+    PyObject *list = PyList_New(b->n);
+    for (int i = 0; list != NULL && i < b->n; i++) {
+        const struct record *r = &b->records[i];
+        int keep = r->end - r->start;
+        PyObject *item;
+        if (r->hasqual)
+            item = Py_BuildValue("(s#s#s#)", b->data + r->header, (Py_ssize_t) r->headerlen,
+                                 b->data + r->seq + r->start, (Py_ssize_t) keep,
+                                 b->data + r->seq + r->len + r->start, (Py_ssize_t) keep);
+        else
+            item = Py_BuildValue("(s#s#O)", b->data + r->header, (Py_ssize_t) r->headerlen,
+                                 b->data + r->seq + r->start, (Py_ssize_t) keep, Py_None);
+        if (item == NULL) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+}
+
+static PyObject *
+reader_next(ReaderObject *self) {
+    struct recordreader *rr = self->reader;
+    if (rr == NULL)
+        return NULL;
+    struct recordbatch *b;
+    self->waiting++;
+    Py_BEGIN_ALLOW_THREADS
+    b = take_full(rr);
+    Py_END_ALLOW_THREADS
+    self->waiting--;
+
+    if (b == NULL) {
+        // the file is finished, so we tidy up now rather than waiting for Python to free us (unless another
+        // thread is still waiting, and then the last one to wake up does it)
+        int status = rr->status;
+        if (self->waiting == 0)
+            reader_close(self);
+        if (status == reader_nomemory)
+            PyErr_NoMemory();
+        else if (status == -2)
+            PyErr_Format(PyExc_ValueError, "%S: a quality string is truncated or a different length to its sequence", self->path);
+        else if (status == -3)
+            PyErr_Format(PyExc_OSError, "%S: error reading the file", self->path);
+        return NULL;
+    }
+    PyObject *list = batch_to_list(b);
+    give_empty(rr, b);
+    return list;
+}
+
+/*
+ * Another thread waiting for a batch is using the reader without the GIL, so we can't free it under them
+ */
+static bool
+reader_closable(ReaderObject *self) {
+    if (self->waiting == 0)
+        return true;
+    PyErr_SetString(PyExc_RuntimeError, "The reader can not be closed while another thread is waiting for its next batch");
+    return false;
+}
+
+static PyObject *
+reader_close_method(ReaderObject *self, PyObject *unused) {
+    if (!reader_closable(self))
+        return NULL;
+    reader_close(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+reader_enter(ReaderObject *self, PyObject *unused) {
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+static PyObject *
+reader_exit(ReaderObject *self, PyObject *args) {
+    if (!reader_closable(self))
+        return NULL;
+    reader_close(self);
+    Py_RETURN_FALSE;
+}
+
+static PyObject *
+reader_repr(ReaderObject *self) {
+    return PyUnicode_FromFormat("Reader(%R%s)", self->path, self->reader ? "" : ", closed");
+}
+
+static PyMethodDef reader_methods[] = {
+        {"close", (PyCFunction) reader_close_method, METH_NOARGS, "Stop reading and close the file"},
+        {"__enter__", (PyCFunction) reader_enter, METH_NOARGS, NULL},
+        {"__exit__", (PyCFunction) reader_exit, METH_VARARGS, NULL},
+        {NULL}
+};
+
+PyTypeObject ReaderType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "PyPrinseq.Reader",
+        .tp_doc = "An iterator over batches of (header, sequence, quality) records from PyPrinseq.open",
+        .tp_basicsize = sizeof(ReaderObject),
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_dealloc = (destructor) reader_dealloc,
+        .tp_repr = (reprfunc) reader_repr,
+        .tp_iter = PyObject_SelfIter,
+        .tp_iternext = (iternextfunc) reader_next,
+        .tp_methods = reader_methods,
+};
+
+PyObject *
+pyreader_open(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char *keywords[] = {"path", "left_primers", "right_primers", "batch_size", "max_edits", "end_window", NULL};
+    PyObject *path = NULL, *left = Py_None, *right = Py_None;
+    int batch_size = 4096;
+    struct trimoptions options;
+    trimoptions_default(&options);
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&|OOiii", keywords, PyUnicode_FSDecoder, &path, &left, &right,
+                                     &batch_size, &options.maxedits, &options.end_window))
+        return NULL;
+    if (batch_size < 1) {
+        Py_DECREF(path);
+        PyErr_SetString(PyExc_ValueError, "The batch size must be at least 1");
+        return NULL;
+    }
+
+    ReaderObject *reader = PyObject_New(ReaderObject, &ReaderType);
+    if (reader == NULL) {
+        Py_DECREF(path);
+        return NULL;
+    }
+    reader->reader = NULL;
+    reader->running = false;
+    reader->waiting = 0;
+    reader->path = path;
+    reader->left = reader->right = NULL;
+    if ((left != Py_None && (reader->left = primerset_from_python(left)) == NULL) ||
+        (right != Py_None && (reader->right = primerset_from_python(right)) == NULL)) {
+        Py_DECREF(reader);
+        return NULL;
+    }
+
+    struct recordreader *rr = calloc(1, sizeof(*rr));
+    if (rr == NULL) {
+        Py_DECREF(reader);
+        return PyErr_NoMemory();
+    }
+    pthread_mutex_init(&rr->lock, NULL);
+    pthread_cond_init(&rr->ready, NULL);
+    pthread_cond_init(&rr->space, NULL);
+    reader->reader = rr;
+    rr->left = reader->left ? reader->left->packed : NULL;
+    rr->right = reader->right ? reader->right->packed : NULL;
+    rr->options = options;
+    rr->batch_size = batch_size;
+    for (int i = 0; i < reader_batches; i++) {
+        if ((rr->batches[i] = recordbatch_init(batch_size)) == NULL) {
+            Py_DECREF(reader);
+            return PyErr_NoMemory();
+        }
+        rr->empty[rr->nempty++] = rr->batches[i];
+    }
+
+    // open the file here, so a missing file is an error from open() and not from the first batch
+    PyObject *filename = PyUnicode_EncodeFSDefault(path);
+    if (filename == NULL) {
+        Py_DECREF(reader);
+        return NULL;
+    }
+    rr->fp = gzopen(PyBytes_AS_STRING(filename), "r");
+    Py_DECREF(filename);
+    if (rr->fp == NULL) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        Py_DECREF(reader);
+        return NULL;
+    }
+    rr->seq = kseq_init(rr->fp);
+    if (pthread_create(&rr->thread, NULL, read_records, rr) != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "We could not start the reading thread");
+        Py_DECREF(reader);
+        return NULL;
+    }
+    reader->running = true;
+    return (PyObject *) reader;
+}
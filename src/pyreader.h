@@ -0,0 +1,18 @@
+//
+// Read (and trim) a fastq or fasta file in batches of records from Python. The file is read, and the
+// records trimmed, in a C thread while Python works on the batch before.
+//
+
+#ifndef PYREADER_H
+#define PYREADER_H
+
+#include <Python.h>
+
+extern PyTypeObject ReaderType;
+
+/*
+ * PyPrinseq.open(path, left_primers=None, right_primers=None, batch_size=4096, max_edits=-1, end_window=0)
+ */
+PyObject * pyreader_open(PyObject *self, PyObject *args, PyObject *kwargs);
+
+#endif //PYREADER_H
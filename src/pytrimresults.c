@@ -0,0 +1,193 @@
+//
+// The TrimResults Python type. Rather than a Python object for every number, each thing we report (e.g.
+// where the reads start) is one contiguous array of C ints, and each column is a read only memoryview
+// of that array. numpy.asarray (and so pandas) can use them without copying anything.
+//
+// TrimResults is also a sequence of (start, end, left primer, right primer) tuples, so it can be used
+// like a list for small batches.
+//
+// There is no orientation column: trimming only looks for the left and right primers as they are on the
+// forward strand of each read, so every hit would be the same.
+//
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stddef.h>
+#include "trimprimers.h"
+#include "pytrimresults.h"
+
+static const char *column_names[ncolumns] = {"start", "end", "left_primer", "right_primer", "left_edits", "right_edits"};
+
+/*
+ * One column of the results. This is what exports the buffer, and it keeps the results alive for as
+ * long as anything is using it.
+ */
+typedef struct {
+    PyObject_HEAD
+    TrimResultsObject *results;
+    int column;
+    Py_ssize_t itemsize;
+} TrimColumnObject;
+
+static int
+trimcolumn_getbuffer(TrimColumnObject *self, Py_buffer *view, int flags) {
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "The trimming results are read only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = (PyObject *) self;
+    Py_INCREF(self);
+    view->buf = self->results->columns[self->column];
+    view->len = self->results->n * self->itemsize;
+    view->readonly = 1;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? "i" : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->results->n : NULL;
+    view->strides = (flags & PyBUF_STRIDES) ? &self->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static void
+trimcolumn_dealloc(TrimColumnObject *self) {
+    Py_XDECREF(self->results);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyBufferProcs trimcolumn_buffer = {
+        .bf_getbuffer = (getbufferproc) trimcolumn_getbuffer,
+};
+
+PyTypeObject TrimColumnType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "PyPrinseq.TrimColumn",
+        .tp_doc = "One column of TrimResults",
+        .tp_basicsize = sizeof(TrimColumnObject),
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_dealloc = (destructor) trimcolumn_dealloc,
+        .tp_as_buffer = &trimcolumn_buffer,
+};
+
+TrimResultsObject *
+trimresults_new(Py_ssize_t n) {
+    TrimResultsObject *self = PyObject_New(TrimResultsObject, &TrimResultsType);
+    if (self == NULL)
+        return NULL;
+    self->n = n;
+    for (int c = 0; c < ncolumns; c++)
+        self->columns[c] = NULL;
+    for (int c = 0; c < ncolumns; c++) {
+        self->columns[c] = malloc(sizeof(int) * (n > 0 ? n : 1));
+        if (self->columns[c] == NULL) {
+            Py_DECREF(self);
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    return self;
+}
+
+void
+trimresults_set(TrimResultsObject *results, Py_ssize_t i, const struct trimresult *result) {
+    results->columns[column_start][i] = result->start;
+    results->columns[column_end][i] = result->end;
+    results->columns[column_left_primer][i] = result->left_primer;
+    results->columns[column_right_primer][i] = result->right_primer;
+    results->columns[column_left_edits][i] = result->left_edits;
+    results->columns[column_right_edits][i] = result->right_edits;
+}
+
+static void
+trimresults_dealloc(TrimResultsObject *self) {
+    for (int c = 0; c < ncolumns; c++)
+        free(self->columns[c]);
+    PyObject_Free(self);
+}
+
+/*
+ * A memoryview of one column
+ */
+static PyObject *
+trimresults_column(TrimResultsObject *self, void *closure) {
+    TrimColumnObject *column = PyObject_New(TrimColumnObject, &TrimColumnType);
+    if (column == NULL)
+        return NULL;
+    Py_INCREF(self);
+    column->results = self;
+    column->column = (int) (size_t) closure;
+    column->itemsize = sizeof(int);
+    PyObject *view = PyMemoryView_FromObject((PyObject *) column);
+    Py_DECREF(column);
+    return view;
+}
+
+/*
+ * All the columns, e.g. for pandas.DataFrame({k: numpy.asarray(v) for k, v in results.columns().items()})
+ */
+static PyObject *
+trimresults_columns(TrimResultsObject *self, PyObject *unused) {
+    PyObject *dict = PyDict_New();
+    for (int c = 0; dict != NULL && c < ncolumns; c++) {
+        PyObject *view = trimresults_column(self, (void *) (size_t) c);
+        if (view == NULL || PyDict_SetItemString(dict, column_names[c], view) < 0)
+            Py_CLEAR(dict);
+        Py_XDECREF(view);
+    }
+    return dict;
+}
+
+static Py_ssize_t
+trimresults_length(TrimResultsObject *self) {
+    return self->n;
+}
+
+static PyObject *
+trimresults_item(TrimResultsObject *self, Py_ssize_t i) {
+    if (i < 0 || i >= self->n) {
+        PyErr_SetString(PyExc_IndexError, "TrimResults index out of range");
+        return NULL;
+    }
+    return Py_BuildValue("(iiii)", self->columns[column_start][i], self->columns[column_end][i],
+                         self->columns[column_left_primer][i], self->columns[column_right_primer][i]);
+}
+
+static PyObject *
+trimresults_repr(TrimResultsObject *self) {
+    return PyUnicode_FromFormat("TrimResults(%zd sequences)", self->n);
+}
+
+static PyGetSetDef trimresults_getset[] = {
+        {"start", (getter) trimresults_column, NULL, "Where the trimmed sequences start", (void *) column_start},
+        {"end", (getter) trimresults_column, NULL, "Where the trimmed sequences end (not including this base)", (void *) column_end},
+        {"left_primer", (getter) trimresults_column, NULL, "The left primer we found, or -1", (void *) column_left_primer},
+        {"right_primer", (getter) trimresults_column, NULL, "The right primer we found, or -1", (void *) column_right_primer},
+        {"left_edits", (getter) trimresults_column, NULL, "The mismatches (or edits) in the left primer, or -1", (void *) column_left_edits},
+        {"right_edits", (getter) trimresults_column, NULL, "The mismatches (or edits) in the right primer, or -1", (void *) column_right_edits},
+        {NULL}
+};
+
+static PyMethodDef trimresults_methods[] = {
+        {"columns", (PyCFunction) trimresults_columns, METH_NOARGS, "A dict of all the columns"},
+        {NULL}
+};
+
+static PySequenceMethods trimresults_sequence = {
+        .sq_length = (lenfunc) trimresults_length,
+        .sq_item = (ssizeargfunc) trimresults_item,
+};
+
+PyTypeObject TrimResultsType = {
+        PyVarObject_HEAD_INIT(NULL, 0)
+        .tp_name = "PyPrinseq.TrimResults",
+        .tp_doc = "Where to trim a batch of sequences. Each column is a read only memoryview of C ints,\n"
+                  "and each item is (start, end, left primer, right primer).",
+        .tp_basicsize = sizeof(TrimResultsObject),
+        .tp_flags = Py_TPFLAGS_DEFAULT,
+        .tp_dealloc = (destructor) trimresults_dealloc,
+        .tp_repr = (reprfunc) trimresults_repr,
+        .tp_as_sequence = &trimresults_sequence,
+        .tp_getset = trimresults_getset,
+        .tp_methods = trimresults_methods,
+};
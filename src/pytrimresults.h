@@ -0,0 +1,42 @@
+//
+// The results of trimming a batch of sequences, as a column of C ints for each thing we report
+//
+
+#ifndef PYTRIMRESULTS_H
+#define PYTRIMRESULTS_H
+
+#include <Python.h>
+
+struct trimresult;
+
+enum trimcolumn {
+    column_start,
+    column_end,
+    column_left_primer,
+    column_right_primer,
+    column_left_edits,
+    column_right_edits,
+    ncolumns
+};
+
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t n;
+    int *columns[ncolumns];
+} TrimResultsObject;
+
+extern PyTypeObject TrimResultsType;
+extern PyTypeObject TrimColumnType;
+
+/*
+ * New results for n sequences (with the columns allocated but not filled in), or NULL with a
+ * Python exception set
+ */
+TrimResultsObject * trimresults_new(Py_ssize_t n);
+
+/*
+ * Put the result for sequence i into the columns. This doesn't need the GIL.
+ */
+void trimresults_set(TrimResultsObject *results, Py_ssize_t i, const struct trimresult *result);
+
+#endif //PYTRIMRESULTS_H
@@ -0,0 +1,317 @@
+/*
+ * Write and map read caches. See readcache.h for the format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "readcache.h"
+#include "packedread.h"
+
+#define cache_magic "PTCACHE"
+#define cache_version 2
+
+// the record has qualities, and the record has the sequence itself
+#define has_quality 1
+#define has_sequence 2
+
+struct cacheheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t unused;
+    uint64_t size;
+    int64_t mtime;
+    uint64_t nreads;
+    uint64_t table;
+    // cp -p keeps the size and modification time, but it is a different file
+    uint64_t device;
+    uint64_t inode;
+};
+
+struct cacherecord {
+    uint32_t len;
+    uint32_t namelen;
+    uint32_t commentlen;
+    uint32_t flags;
+};
+
+struct readcache {
+    // mapping a cache
+    const unsigned char *map;
+    size_t mapsize;
+    const uint64_t *offsets;
+    uint64_t nreads;
+    uint64_t next;
+    uint64_t end;           // where the records end (and the table starts)
+    // writing a new one
+    FILE *fp;
+    FILE *table;            // the record offsets, which we copy to the end of the cache when we finish
+    char *filename;
+    char *tmpname;
+    struct cacheheader header;
+    uint64_t pos;
+    struct packedread packed;
+    bool complete;          // we got to the end of the sequence file
+    bool ok;
+};
+
+static const char padding[8] = {0};
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~(size_t) 7;
+}
+
+bool readcache_mapped(const struct readcache *rc) {
+    return rc->map != NULL;
+}
+
+/*
+ * Map an existing cache if it is complete and for this version of infile
+ */
+static bool map_cache(struct readcache *rc, const char *cachefile, const struct stat *st) {
+    int fd = open(cachefile, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat cst;
+    if (fstat(fd, &cst) != 0 || cst.st_size < (off_t) sizeof(struct cacheheader)) {
+        close(fd);
+        return false;
+    }
+    void *map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const struct cacheheader *h = map;
+    if (memcmp(h->magic, cache_magic, sizeof(cache_magic)) != 0 || h->version != cache_version ||
+            h->size != (uint64_t) st->st_size || h->mtime != (int64_t) st->st_mtime ||
+            h->device != (uint64_t) st->st_dev || h->inode != (uint64_t) st->st_ino || h->table % 8 != 0 ||
+            h->table < sizeof(*h) || h->table > (uint64_t) cst.st_size || h->nreads > ((uint64_t) cst.st_size - h->table) / 8) {
+        munmap(map, cst.st_size);
+        return false;
+    }
+    madvise(map, cst.st_size, MADV_SEQUENTIAL);
+    rc->map = map;
+    rc->mapsize = cst.st_size;
+    rc->nreads = h->nreads;
+    rc->end = h->table;
+    rc->offsets = (const uint64_t *) (rc->map + h->table);
+    return true;
+}
+
+struct readcache *readcache_open(const char *cachefile, const char *infile) {
+    struct stat st;
+    if (stat(infile, &st) != 0)
+        return NULL;
+    struct readcache *rc = calloc(1, sizeof(*rc));
+    if (rc == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the cache %s\n", cachefile);
+        exit(-1);
+    }
+    rc->filename = strdup(cachefile);
+    if (rc->filename == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the cache %s\n", cachefile);
+        exit(-1);
+    }
+    if (map_cache(rc, cachefile, &st))
+        return rc;
+
+    // write a new cache next to the old one, and move it into place when it is finished
+    rc->tmpname = malloc(strlen(cachefile) + 32);
+    if (rc->tmpname == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the cache %s\n", cachefile);
+        exit(-1);
+    }
+    sprintf(rc->tmpname, "%s.%ld.tmp", cachefile, (long) getpid());
+    rc->fp = fopen(rc->tmpname, "wb");
+    rc->table = rc->fp ? tmpfile() : NULL;
+    if (rc->table == NULL) {
+        fprintf(stderr, "WARNING: We can not write the cache %s, so we will read %s without it\n", cachefile, infile);
+        if (rc->fp) {
+            fclose(rc->fp);
+            unlink(rc->tmpname);
+        }
+        free(rc->filename);
+        free(rc->tmpname);
+        free(rc);
+        return NULL;
+    }
+    memcpy(rc->header.magic, cache_magic, sizeof(cache_magic));
+    rc->header.version = cache_version;
+    rc->header.size = st.st_size;
+    rc->header.mtime = st.st_mtime;
+    rc->header.device = st.st_dev;
+    rc->header.inode = st.st_ino;
+    // the header is written again with the number of reads when we finish
+    rc->ok = fwrite(&rc->header, sizeof(rc->header), 1, rc->fp) == 1;
+    rc->pos = sizeof(rc->header);
+    packedread_init(&rc->packed);
+    return rc;
+}
+
+static void kstring_reserve(kstring_t *s, size_t len) {
+    if (s->m < len + 1) {
+        s->m = len + 1;
+        kroundup32(s->m);
+        s->s = realloc(s->s, s->m);
+        if (s->s == NULL) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for a read from the cache\n");
+            exit(-1);
+        }
+    }
+}
+
+static void kstring_set(kstring_t *s, const void *from, size_t len) {
+    kstring_reserve(s, len);
+    memcpy(s->s, from, len);
+    s->s[len] = 0;
+    s->l = len;
+}
+
+/*
+ * The size of the record at offset, or 0 if it isn't all in the records (which means the cache is damaged)
+ */
+static uint64_t record_size(const struct readcache *rc, uint64_t offset) {
+    if (offset % 8 != 0 || offset < sizeof(struct cacheheader) || offset > rc->end - sizeof(struct cacherecord))
+        return 0;
+    const struct cacherecord *r = (const struct cacherecord *) (rc->map + offset);
+    // we return the length as an int
+    if (r->flags & ~(has_quality | has_sequence) || r->len > INT32_MAX)
+        return 0;
+    // these are all 32 bit numbers, so the sum can't overflow
+    uint64_t size = sizeof(*r) + align8((uint64_t) r->namelen + r->commentlen) + 2 * (((uint64_t) r->len + 31) / 32) * sizeof(uint64_t);
+    if (r->flags & has_quality)
+        size += r->len;
+    if (r->flags & has_sequence)
+        size += r->len;
+    return size <= rc->end - offset ? size : 0;
+}
+
+int readcache_next(struct readcache *rc, kstring_t *name, kstring_t *comment, kstring_t *seq, kstring_t *qual) {
+    if (rc->next == rc->nreads)
+        return -1;
+    uint64_t offset = rc->offsets[rc->next];
+    if (record_size(rc, offset) == 0) {
+        fprintf(stderr, "ERROR: The cache %s is damaged at read %lu. Please delete it\n", rc->filename, (unsigned long) rc->next);
+        rc->next = rc->nreads;
+        return -3;
+    }
+    rc->next++;
+    const unsigned char *p = rc->map + offset;
+    const struct cacherecord *r = (const struct cacherecord *) p;
+    p += sizeof(*r);
+    kstring_set(name, p, r->namelen);
+    kstring_set(comment, p + r->namelen, r->commentlen);
+    p += align8(r->namelen + r->commentlen);
+    size_t nwords = (r->len + 31) / 32;
+    const uint64_t *bases = (const uint64_t *) p;
+    const uint64_t *nmask = bases + nwords;
+    p += 2 * nwords * sizeof(uint64_t);
+    if (r->flags & has_quality) {
+        kstring_set(qual, p, r->len);
+        p += r->len;
+    }
+    else
+        kstring_set(qual, p, 0);
+    if (r->flags & has_sequence)
+        kstring_set(seq, p, r->len);
+    else {
+        kstring_reserve(seq, r->len);
+        for (size_t i = 0; i < r->len; i++) {
+            int shift = 2 * (int) (i % 32);
+            seq->s[i] = (nmask[i / 32] >> shift) & 1 ? 'N' : "ACGT"[(bases[i / 32] >> shift) & 3];
+        }
+        seq->s[r->len] = 0;
+        seq->l = r->len;
+    }
+    return (int) r->len;
+}
+
+static void write_bytes(struct readcache *rc, const void *data, size_t len) {
+    if (rc->ok && len > 0)
+        rc->ok = fwrite(data, 1, len, rc->fp) == len;
+    rc->pos += len;
+}
+
+int readcache_add(struct readcache *rc, int l, const kstring_t *name, const kstring_t *comment,
+        const kstring_t *seq, const kstring_t *qual) {
+    if (rc == NULL || !rc->ok)
+        return l;
+    if (l == -1)
+        rc->complete = true;
+    if (l < 0)
+        return l;
+
+    struct cacherecord r = {(uint32_t) seq->l, (uint32_t) name->l, (uint32_t) comment->l, 0};
+    if (qual->l == seq->l && seq->l > 0)
+        r.flags |= has_quality;
+    // the packed bases only give us back upper case A, C, G, T and N
+    for (size_t i = 0; i < seq->l && !(r.flags & has_sequence); i++) {
+        char c = seq->s[i];
+        if (c != 'A' && c != 'C' && c != 'G' && c != 'T' && c != 'N')
+            r.flags |= has_sequence;
+    }
+    if (!packedread_pack(&rc->packed, seq->s, seq->l)) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for %s\n", name->s);
+        exit(-1);
+    }
+    rc->ok = fwrite(&rc->pos, sizeof(rc->pos), 1, rc->table) == 1;
+    rc->header.nreads++;
+    write_bytes(rc, &r, sizeof(r));
+    write_bytes(rc, name->s, name->l);
+    write_bytes(rc, comment->s, comment->l);
+    write_bytes(rc, padding, align8(name->l + comment->l) - (name->l + comment->l));
+    write_bytes(rc, rc->packed.bases, rc->packed.nwords * sizeof(uint64_t));
+    write_bytes(rc, rc->packed.nmask, rc->packed.nwords * sizeof(uint64_t));
+    if (r.flags & has_quality)
+        write_bytes(rc, qual->s, qual->l);
+    if (r.flags & has_sequence)
+        write_bytes(rc, seq->s, seq->l);
+    write_bytes(rc, padding, align8(rc->pos) - rc->pos);
+    return l;
+}
+
+bool readcache_close(struct readcache *rc) {
+    if (rc == NULL)
+        return true;
+    if (rc->map) {
+        munmap((void *) rc->map, rc->mapsize);
+        free(rc->filename);
+        free(rc);
+        return true;
+    }
+
+    // copy the record offsets to the end, and write the header again now we know how many reads there are
+    bool ok = rc->ok && rc->complete;
+    rc->header.table = rc->pos;
+    if (ok) {
+        rewind(rc->table);
+        uint64_t offsets[1024];
+        size_t n;
+        while (ok && (n = fread(offsets, sizeof(*offsets), 1024, rc->table)) > 0)
+            ok = fwrite(offsets, sizeof(*offsets), n, rc->fp) == n;
+        ok = ok && fseek(rc->fp, 0, SEEK_SET) == 0 && fwrite(&rc->header, sizeof(rc->header), 1, rc->fp) == 1;
+    }
+    if (fclose(rc->fp) != 0)
+        ok = false;
+    fclose(rc->table);
+    if (ok)
+        ok = rename(rc->tmpname, rc->filename) == 0;
+    if (!ok) {
+        unlink(rc->tmpname);
+        // it is only a problem if we read everything but still couldn't write it
+        if (rc->complete)
+            fprintf(stderr, "WARNING: We could not write the cache %s\n", rc->filename);
+    }
+    packedread_free(&rc->packed);
+    free(rc->filename);
+    free(rc->tmpname);
+    bool complete = rc->complete;
+    free(rc);
+    return ok || !complete;
+}
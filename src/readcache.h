@@ -0,0 +1,66 @@
+/*
+ * A cache of the reads in a sequence file that have already been decompressed and parsed, so that the
+ * tools we run after the first one don't have to do that again.
+ *
+ * The first tool that reads a sequence file with a cache writes the cache as it reads the sequences, and
+ * the tools after it memory map the cache instead of reading the sequence file. The cache remembers the
+ * size and modification time of the sequence file, and its device and inode (so a copy made with cp -p
+ * isn't the same file), and is written again if any of them change.
+ *
+ * The cache starts with a header (the magic "PTCACHE", a version, the size and modification time of the
+ * sequence file, the number of reads, where the table of record offsets is, and the device and inode of
+ * the sequence file), then has one record per read, and then the table with the offset of each record.
+ * Each record is 8 byte aligned: the length of the sequence, the name and the comment, and some flags
+ * (uint32s), the name and the comment, the bases and the N mask two bits a base in 64 bit words exactly
+ * like a packedread, then the qualities (if the read has them), and the sequence itself only if it has
+ * something other than A, C, G, T and N that we can't get back from the packed bases. The numbers are in
+ * the byte order of the computer that wrote the cache.
+ */
+
+#ifndef READCACHE_H
+#define READCACHE_H
+
+#include <stdbool.h>
+#include "kseq.h"
+
+struct readcache;
+
+/*
+ * Open cachefile for the sequences in infile. If it is up to date we map it and the reads come from the
+ * cache, otherwise we start a new cache and add the reads to it as they are read from infile. Returns NULL
+ * (with a warning) if we can't write a new cache, and then you can just read infile.
+ */
+struct readcache *readcache_open(const char *cachefile, const char *infile);
+
+/*
+ * True if the reads come from the cache
+ */
+bool readcache_mapped(const struct readcache *rc);
+
+/*
+ * Copy the next read in the cache into the strings, like kseq_read. Returns the length of the sequence,
+ * -1 at the end of the cache, or -3 (like a corrupt file) if the record isn't all in the cache.
+ */
+int readcache_next(struct readcache *rc, kstring_t *name, kstring_t *comment, kstring_t *seq, kstring_t *qual);
+
+/*
+ * Add a read that kseq_read returned l for to a new cache (rc can be NULL). Returns l.
+ */
+int readcache_add(struct readcache *rc, int l, const kstring_t *name, const kstring_t *comment,
+        const kstring_t *seq, const kstring_t *qual);
+
+/*
+ * Close the cache (rc can be NULL). A new cache is only kept if we read every read in the file into it.
+ * Returns false if we could not write it.
+ */
+bool readcache_close(struct readcache *rc);
+
+/*
+ * Use this instead of kseq_read(seq): it reads from the cache if there is one to read, and otherwise reads
+ * from the file and adds the read to the cache if we are writing one.
+ */
+#define readcache_kseq_read(cache, seq) ((cache) && readcache_mapped(cache) ? \
+        readcache_next((cache), &(seq)->name, &(seq)->comment, &(seq)->seq, &(seq)->qual) : \
+        readcache_add((cache), kseq_read(seq), &(seq)->name, &(seq)->comment, &(seq)->seq, &(seq)->qual))
+
+#endif //READCACHE_H
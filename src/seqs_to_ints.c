@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include "compare-seqs.h"
 #include "print-sequences.h"
 #include "colours.h"
 
@@ -92,7 +94,98 @@ uint64_t next_kmer_encoding(char* seq, int start_position, int k, uint64_t enc)
 	return enc;
 }
 
+/*
+ * The encoding of each base plus one, so that 0 means we can't encode it
+ */
+static const uint8_t base_codes[256] = {
+	['A'] = 1, ['a'] = 1,
+	['C'] = 2, ['c'] = 2,
+	['G'] = 3, ['g'] = 3,
+	['T'] = 4, ['t'] = 4,
+};
+
+kmer128_t kmer_encoding128(char * seq, int start_position, int k) {
+	/*
+	 * The same as kmer_encoding, but for k <= 64 using two 64-bit words.
+	 */
+
+	if (k > 64) {
+		fprintf(stderr, "%s We can only encode k<=64 strings in 128 bits. Please reduce k %s\n", PINK, ENDC);
+		exit(-1);
+	}
 
+	kmer128_t enc = {0, 0};
+	for (int i=start_position; i < start_position+k; i++) {
+		enc.hi = (enc.hi << 2) | (enc.lo >> 62);
+		enc.lo = (enc.lo << 2) + encode_base(seq[i]);
+	}
+	return enc;
+}
+
+void kmer_iterator_init(kmer_iterator_t* it, const char* seq, size_t len, int k) {
+	if (k > 64 || k < 1) {
+		fprintf(stderr, "%s We can only encode 0<k<=64 strings in 128 bits. Please change k %s\n", PINK, ENDC);
+		exit(-1);
+	}
+	it->seq = seq;
+	it->len = len;
+	it->k = k;
+	it->pos = 0;
+	it->valid = 0;
+	it->forward = (kmer128_t) {0, 0};
+	it->reverse = (kmer128_t) {0, 0};
+	int bits = k > 32 ? 2 * (k - 32) : 2 * k;
+	it->mask = bits == 64 ? UINT64_MAX : (1ULL << bits) - 1;
+}
 
+static inline bool kmer128_less(kmer128_t a, kmer128_t b) {
+	return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
 
+bool kmer_iterator_next128(kmer_iterator_t* it, kmer128_t* forward, kmer128_t* canonical, int* position) {
+	/*
+	 * Add bases until we have k good ones in a row. The reverse complement
+	 * is built from the other end: the complement of a base is 3 - base.
+	 * For k <= 32 everything stays in the lo words.
+	 */
+	bool wide = it->k > 32;
+	while (it->pos < it->len) {
+		uint8_t code = base_codes[(unsigned char) it->seq[it->pos++]];
+		if (code == 0) {
+			it->valid = 0;
+			continue;
+		}
+		uint64_t base = code - 1;
+		if (wide) {
+			it->forward.hi = ((it->forward.hi << 2) | (it->forward.lo >> 62)) & it->mask;
+			it->forward.lo = (it->forward.lo << 2) | base;
+			it->reverse.lo = (it->reverse.lo >> 2) | (it->reverse.hi << 62);
+			it->reverse.hi = (it->reverse.hi >> 2) | ((3 - base) << (2 * (it->k - 33)));
+		} else {
+			it->forward.lo = ((it->forward.lo << 2) | base) & it->mask;
+			it->reverse.lo = (it->reverse.lo >> 2) | ((3 - base) << (2 * (it->k - 1)));
+		}
+		if (it->valid < it->k)
+			it->valid++;
+		if (it->valid == it->k) {
+			*forward = it->forward;
+			*canonical = kmer128_less(it->forward, it->reverse) ? it->forward : it->reverse;
+			*position = (int) (it->pos - it->k);
+			return true;
+		}
+	}
+	return false;
+}
 
+bool kmer_iterator_next(kmer_iterator_t* it, uint64_t* forward, uint64_t* canonical, int* position) {
+	if (it->k > 32) {
+		fprintf(stderr, "%s We can only encode k<=32 strings in 64 bits. Use kmer_iterator_next128 %s\n", PINK, ENDC);
+		exit(-1);
+	}
+	kmer128_t f, c;
+	if (!kmer_iterator_next128(it, &f, &c, position))
+		return false;
+	*forward = f.lo;
+	*canonical = c.lo;
+	return true;
+}
@@ -6,46 +6,137 @@
 #include "compare-seqs.h"
 #include "print-sequences.h"
 
+// the most directory bits we will use (4 MB of directory)
+#define max_directory_bits 20
 
-void add_primer(uint64_t encoding, char* primerid, kmer_bst_t* ks) {
+primer_index_t* primer_index_init() {
 	/*
-	 * Add a new integer to the BST. Either at the current location, and
-	 * then set bigger/smaller to be new empty structs
-	 * else at bigger or smaller.
-	 *
-	 * We use bigger && smaller == NULL to indicate we are at a new
-	 * kmer_bst_t since the value is also not set
+	 * Make a new, empty, index. Add primers with add_primer and then
+	 * call primer_index_build before using find_primer
 	 */
-	
-	if (ks->bigger == NULL && ks->smaller == NULL) {
-		ks->value = encoding;
-		ks->id = (char *) malloc(sizeof(*primerid));
-		strcpy(ks->id, primerid);
-		ks->bigger = (kmer_bst_t *) malloc(sizeof(*ks->bigger));
-		ks->smaller = (kmer_bst_t *) malloc(sizeof(*ks->bigger));
-		return;
+	primer_index_t *pi = calloc(1, sizeof(*pi));
+	if (pi == NULL) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the primer index\n");
+		exit(-1);
 	}
-	if (encoding > ks->value)
-		return add_primer(encoding, primerid, ks->bigger);
-	
-	return add_primer(encoding, primerid, ks->smaller);
+	return pi;
 }
 
-kmer_bst_t* find_primer(uint64_t encoding, kmer_bst_t* ks) {
+void add_primer(uint64_t encoding, int primerid, primer_index_t* pi) {
 	/*
-	 * Find the int in the bst
-	 * Note, as above we use bigger && smaller == NULL to define
-	 * not set because value = 0 could be AAAAAAA
+	 * Remember an encoding and its primer id. We just append them
+	 * here and sort everything once in primer_index_build.
 	 */
+	if (pi->built) {
+		fprintf(stderr, "ERROR: Can not add primer %d to a primer index that has already been built\n", primerid);
+		return;
+	}
+	if (pi->n == pi->capacity) {
+		pi->capacity = pi->capacity ? pi->capacity * 2 : 64;
+		pi->pairs = realloc(pi->pairs, sizeof(*pi->pairs) * pi->capacity);
+		if (pi->pairs == NULL) {
+			fprintf(stderr, "ERROR: We cannot allocate memory for the primer index\n");
+			exit(-1);
+		}
+	}
+	pi->pairs[pi->n].value = encoding;
+	pi->pairs[pi->n].id = primerid;
+	pi->n++;
+}
 
-	if (ks->value == encoding)
-		return ks;
-	if (ks->bigger == NULL && ks->smaller == NULL) 
-		return NULL;
-	if (encoding > ks->value)
-		return find_primer(encoding, ks->bigger);
-	return find_primer(encoding, ks->smaller);
+static int compare_pairs(const void *p, const void *q) {
+	const struct primer_pair *a = p, *b = q;
+	if (a->value != b->value)
+		return a->value < b->value ? -1 : 1;
+	return a->id - b->id;
 }
 
+void primer_index_build(primer_index_t* pi) {
+	/*
+	 * Sort the encodings, collapse the duplicates so that one encoding
+	 * has all of its ids, and make the directory.
+	 *
+	 * The directory is indexed by the top bits of the encoding, so that
+	 * the encodings starting with bucket b are
+	 *   values[directory[b]] .. values[directory[b+1]-1]
+	 * We use about as many buckets as encodings, so a lookup is two
+	 * adjacent directory entries and then (usually) one value.
+	 */
+	qsort(pi->pairs, pi->n, sizeof(*pi->pairs), compare_pairs);
+
+	pi->values = malloc(sizeof(*pi->values) * (pi->n + 1));
+	pi->starts = malloc(sizeof(*pi->starts) * (pi->n + 1));
+	pi->ids = malloc(sizeof(*pi->ids) * (pi->n + 1));
+	if (pi->values == NULL || pi->starts == NULL || pi->ids == NULL) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the primer index\n");
+		exit(-1);
+	}
+	pi->nvalues = 0;
+	for (int i = 0; i < pi->n; i++) {
+		if (i == 0 || pi->pairs[i].value != pi->pairs[i-1].value) {
+			pi->values[pi->nvalues] = pi->pairs[i].value;
+			pi->starts[pi->nvalues++] = i;
+		}
+		pi->ids[i] = pi->pairs[i].id;
+	}
+	pi->starts[pi->nvalues] = pi->n;
+	free(pi->pairs);
+	pi->pairs = NULL;
 
+	// how many bits do the encodings use, and how many of those do we put in the directory
+	int valuebits = 0;
+	if (pi->nvalues > 0)
+		while (valuebits < 64 && (pi->values[pi->nvalues - 1] >> valuebits) != 0)
+			valuebits++;
+	int bits = 0;
+	while (bits < max_directory_bits && bits < valuebits && (1 << bits) < pi->nvalues)
+		bits++;
+	pi->shift = valuebits - bits;
 
+	int nbuckets = 1 << bits;
+	pi->directory = malloc(sizeof(*pi->directory) * (nbuckets + 1));
+	if (pi->directory == NULL) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the primer index\n");
+		exit(-1);
+	}
+	int v = 0;
+	for (int b = 0; b <= nbuckets; b++) {
+		while (v < pi->nvalues && (pi->values[v] >> pi->shift) < (uint64_t) b)
+			v++;
+		pi->directory[b] = v;
+	}
+	pi->nbuckets = nbuckets;
+	pi->built = true;
+}
+
+const int* find_primer(uint64_t encoding, primer_index_t* pi, int *nids) {
+	/*
+	 * Find an encoding in the index. Returns the ids of the primers
+	 * with this encoding (and sets nids to how many there are), or NULL
+	 * if there are none.
+	 */
+	*nids = 0;
+	uint64_t b = pi->shift < 64 ? encoding >> pi->shift : 0;
+	if (b >= (uint64_t) pi->nbuckets)
+		return NULL;
+	for (int i = pi->directory[b]; i < pi->directory[b + 1]; i++) {
+		if (pi->values[i] == encoding) {
+			*nids = pi->starts[i + 1] - pi->starts[i];
+			return pi->ids + pi->starts[i];
+		}
+		if (pi->values[i] > encoding)
+			break;
+	}
+	return NULL;
+}
+
+void primer_index_free(primer_index_t* pi) {
+	if (pi == NULL)
+		return;
+	free(pi->pairs);
+	free(pi->values);
+	free(pi->starts);
+	free(pi->ids);
+	free(pi->directory);
+	free(pi);
+}
@@ -2,33 +2,40 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
 #include "compare-seqs.h"
 #include "print-sequences.h"
+#include "gzshard.h"
+#include "packedread.h"
+#include "trimprimers.h"
 
 
 
 void test_primers() {
-	// populate the bst
+	// populate the index, including a duplicate encoding
 	
-	kmer_bst_t *kmers;
-	kmers = (kmer_bst_t *) malloc(sizeof(*kmers));
-	uint64_t is[] = {10, 12, 11, 9, 5, 8, 14, 13};
+	primer_index_t *kmers = primer_index_init();
+	uint64_t is[] = {10, 12, 11, 9, 5, 8, 14, 13, 12};
 	// uint64_t is[] = {5, 8, 9, 10, 11, 12, 13, 14};
-	for (int i=0; i<= 7; i++) {
-		char s[100];
-		sprintf(s, "NAME: %ld", is[i]);
-		add_primer(is[i], s, kmers);
+	for (int i=0; i<= 8; i++) {
+		add_primer(is[i], i, kmers);
 		printf("Added: %ld\n", is[i]);
 	}
 
+	primer_index_build(kmers);
+
 	uint64_t is2[] = {10, 12, 11, 9, 5, 8, 14, 13, 17, 2, 99};
 	for (int i=0; i<= 10; i++) {
-		kmer_bst_t* ks = find_primer(is2[i], kmers);
-		if ( ks == NULL )
+		int nids;
+		const int* ids = find_primer(is2[i], kmers, &nids);
+		if ( ids == NULL )
 			printf("NOT found: %ld\n", is2[i]);
-		else
-			printf("Found: %ld:id '%s'\n", is2[i], ks->id);
+		for (int j=0; j<nids; j++)
+			printf("Found: %ld:id %d\n", is2[i], ids[j]);
 	}
+	primer_index_free(kmers);
 }
 
 void test_comparisons() {
@@ -53,9 +60,488 @@ void test_comparisons() {
 
 }
 
+/*
+ * The reverse complement of the k bases of seq at posn, so we can encode it from scratch
+ */
+char *reverse_kmer(char *seq, int posn, int k) {
+	char *rc = malloc(k + 1);
+	for (int i = 0; i < k; i++) {
+		switch (seq[posn + k - i - 1]) {
+			case 'A': case 'a': rc[i] = 'T'; break;
+			case 'C': case 'c': rc[i] = 'G'; break;
+			case 'G': case 'g': rc[i] = 'C'; break;
+			default: rc[i] = 'A';
+		}
+	}
+	rc[k] = 0;
+	return rc;
+}
+
+int test_iterator() {
+	// the rolling encodings should match encoding each k-mer (and its reverse complement) from scratch, and skip the Ns
+	char * seq = "CCCGCCCCTCCactgNCCCCAAAAATTTTNNACGTACGT";
+	kmer_iterator_t it;
+	kmer_iterator_init(&it, seq, strlen(seq), 5);
+	uint64_t enc, canonical;
+	int posn, failed = 0;
+	printf("\n\n\nRolling k-mers\n\n");
+	while (kmer_iterator_next(&it, &enc, &canonical, &posn)) {
+		char* ss = substr(seq, posn, 5);
+		char *rc = reverse_kmer(seq, posn, 5);
+		uint64_t e = kmer_encoding(seq, posn, 5), r = kmer_encoding(rc, 0, 5);
+		bool ok = enc == e && canonical == (e < r ? e : r) && strchr(ss, 'N') == NULL;
+		printf("i: %d str: %s enc: %ld canonical: %ld %s\n", posn, ss, enc, canonical, ok ? "OK" : "WRONG");
+		failed += !ok;
+		free(rc);
+	}
+	return failed;
+}
+
+int test_iterator128() {
+	// k-mers longer than 32 bp need both words
+	char * seq = "GATCGGAAGAGCACACGTCTGAACTCCAGTCACNATCTCGTATGCCGTCTTCTGCTTGAAAAACCCCCGGGGGTTTTTACGTACGTACGTACGTACGTAC";
+	int k = 40;
+	kmer_iterator_t it;
+	kmer_iterator_init(&it, seq, strlen(seq), k);
+	kmer128_t enc, canonical;
+	int posn, failed = 0;
+	printf("\n\n\nRolling 128-bit k-mers\n\n");
+	while (kmer_iterator_next128(&it, &enc, &canonical, &posn)) {
+		char *rc = reverse_kmer(seq, posn, k);
+		kmer128_t e = kmer_encoding128(seq, posn, k), r = kmer_encoding128(rc, 0, k);
+		kmer128_t c = e.hi < r.hi || (e.hi == r.hi && e.lo < r.lo) ? e : r;
+		bool ok = enc.hi == e.hi && enc.lo == e.lo && canonical.hi == c.hi && canonical.lo == c.lo && posn > 33;
+		printf("i: %d enc: %lx %016lx canonical: %lx %016lx %s\n", posn, enc.hi, enc.lo, canonical.hi, canonical.lo,
+				ok ? "OK" : "WRONG");
+		failed += !ok;
+		free(rc);
+	}
+	return failed;
+}
+
+/*
+ * The bases an (upper case) IUPAC code stands for
+ */
+const char *iupac_bases(char c) {
+	switch (c) {
+		case 'A': return "A";
+		case 'C': return "C";
+		case 'G': return "G";
+		case 'T': case 'U': return "T";
+		case 'R': return "AG";
+		case 'Y': return "CT";
+		case 'S': return "CG";
+		case 'W': return "AT";
+		case 'K': return "GT";
+		case 'M': return "AC";
+		case 'B': return "CGT";
+		case 'D': return "AGT";
+		case 'H': return "ACT";
+		case 'V': return "ACG";
+		case 'N': return "ACGT";
+		default: return "";
+	}
+}
+
+/*
+ * A primer is only degenerate if it has an IUPAC code for more than one base
+ */
+bool naive_degenerate(const char *primer) {
+	for (; *primer; primer++)
+		if (strlen(iupac_bases(*primer)) > 1)
+			return true;
+	return false;
+}
+
+/*
+ * Does primer base p match read base r? Read bases have to be A, C, G, or T, and primer bases are only
+ * IUPAC codes if the primer is degenerate (otherwise an N, or a U, never matches).
+ */
+bool naive_match(char p, char r, bool degenerate) {
+	if (r != 'A' && r != 'C' && r != 'G' && r != 'T')
+		return false;
+	if (!degenerate)
+		return p == r;
+	return strchr(iupac_bases(p), r) != NULL;
+}
+
+/*
+ * Count the mismatches in len characters of a from apos and b from bpos, where b may be a degenerate
+ * primer and anything past the end of either never matches
+ */
+int naive_mismatches(const char *a, int apos, const char *b, int bpos, int len, bool degenerate) {
+	int alen = (int) strlen(a), blen = (int) strlen(b), mm = 0;
+	for (int j = 0; j < len; j++)
+		mm += apos + j >= alen || bpos + j >= blen || !naive_match(b[bpos + j], a[apos + j], degenerate);
+	return mm;
+}
+
+/*
+ * The allow masks of packed primers, and the mismatches between packed primers and reads, should be the
+ * same as comparing the characters. Returns the number of comparisons that were not.
+ */
+int test_iupac() {
+	const char *reads[] = {
+		"ACGTACGTACGTACGTACGTACGTACGTACGTACGTACGTACGT",
+		"ACGTNCGTACGTACGAACGTACGTTCGTACGTACNTACGTACGTAACG",
+		"GATCGGAAGAGCACACGTCTGAACTCCAGTCACGATCTCGTATGCCGTCTTCTGCTTGAAAAAAAAAA",
+		"TTTTTGATCGGAAGANCACACGTCTGAACTCCAGTCACTATCTCGTATGCCGTCTTCTGCTTGCCCCC",
+	};
+	const char *primers[] = {
+		"ACGTACGTACGT",				// no IUPAC codes
+		"ACGTNCGTACGU",				// an N and a U that never match
+		"RCGTAYGTMCGK",				// two bases at some positions
+		"NNNNACGTACGTSWKMBDHV",			// every IUPAC code
+		"GATCGGAAGANCACACGTCTGAACTCCAGTCACNATCTCGTATGCCGTCTTCTGCTTG",	// IUPAC codes in both words
+	};
+	int nreads = sizeof(reads) / sizeof(*reads), nprimers = sizeof(primers) / sizeof(*primers);
+	int lens[] = {11, 32, 40, 100};
+	int failed = 0;
+	struct packedread read, primer;
+	packedread_init(&read);
+	packedread_init(&primer);
+	printf("\n\n\nIUPAC primers\n\n");
+	for (int p = 0; p < nprimers; p++) {
+		int plen = (int) strlen(primers[p]), wrong = 0, compared = 0;
+		bool degenerate = naive_degenerate(primers[p]);
+		packedread_pack_iupac(&primer, primers[p], plen);
+		wrong += primer.degenerate != degenerate;
+		// every base we allow at every position
+		for (int i = 0; degenerate && i < plen; i++)
+			for (int b = 0; b < 4; b++)
+				wrong += (int) ((primer.allow[b][i / 32] >> (2 * (i % 32))) & 1) != naive_match(primers[p][i], "ACGT"[b], true);
+		for (int r = 0; r < nreads; r++) {
+			int rlen = (int) strlen(reads[r]);
+			packedread_pack(&read, reads[r], rlen);
+			for (int rpos = 0; rpos <= rlen; rpos++) {
+				for (int ppos = 0; ppos <= plen; ppos++) {
+					for (int l = 0; l < 4; l++) {
+						int expected = naive_mismatches(reads[r], rpos, primers[p], ppos, lens[l], degenerate);
+						// the primer can be either argument, and with a maximum we only have to get past it
+						int mm = packed_mismatches(&read, rpos, &primer, ppos, lens[l], lens[l]);
+						int swapped = packed_mismatches(&primer, ppos, &read, rpos, lens[l], lens[l]);
+						int most = packed_mismatches(&read, rpos, &primer, ppos, lens[l], 2);
+						wrong += mm != expected || swapped != expected || (expected <= 2 ? most != expected : most <= 2);
+						compared++;
+					}
+				}
+			}
+		}
+		printf("%s: %d comparisons %s\n", primers[p], compared, wrong ? "WRONG" : "OK");
+		failed += wrong;
+	}
+	packedread_free(&read);
+	packedread_free(&primer);
+	return failed;
+}
+
+/*
+ * Myers' algorithm the slow way: fill in the edit distance matrix of the m bases of pattern against the n
+ * bases of seq (both in the order we search them). The pattern can start anywhere in the first band bases
+ * of seq, or part way through at the very start as long as we use at least 11 of its bases. Returns the
+ * lowest distance in the first (or if last is true, the last) run of bases that are within maxedits, and
+ * the base it ends at in end, or -1 if there aren't any.
+ */
+int naive_search(const char *pattern, int m, const char *seq, int n, int band, int maxedits, bool last, bool degenerate,
+		int *end) {
+	int minimum = m < 11 ? m : 11;
+	int column[m + 1];
+	for (int i = 0; i <= m; i++)
+		column[i] = i > m - minimum ? i - (m - minimum) : 0;
+	int best = -1;
+	bool inrun = false;
+	for (int t = 0; t < n; t++) {
+		int diagonal = column[0];
+		if (t >= band - 1)
+			column[0]++;
+		for (int i = 1; i <= m; i++) {
+			int d = diagonal + !naive_match(pattern[i - 1], seq[t], degenerate);
+			diagonal = column[i];
+			int best_here = column[i] + 1 < column[i - 1] + 1 ? column[i] + 1 : column[i - 1] + 1;
+			column[i] = d < best_here ? d : best_here;
+		}
+		if (column[m] <= maxedits) {
+			if (!inrun && last)
+				best = -1;
+			inrun = true;
+			if (best < 0 || column[m] < best) {
+				best = column[m];
+				*end = t;
+			}
+		} else {
+			inrun = false;
+			if (best >= 0 && !last)
+				break;
+		}
+	}
+	return best;
+}
+
+/*
+ * trim_left_indels with naive_search: the last 64 bases of each primer in the first 20 + m + maxedits
+ * bases of the read
+ */
+int naive_trim_left(char **primers, const char *read, int maxedits, struct indelhit *hit) {
+	int rlen = (int) strlen(read);
+	*hit = (struct indelhit) {-1, -1, 0};
+	for (int p = 0; primers[p] != NULL && hit->distance != 0; p++) {
+		int plen = (int) strlen(primers[p]);
+		if (plen < 11)
+			continue;
+		int m = plen < 64 ? plen : 64, n = 20 + m + maxedits, end;
+		int distance = naive_search(primers[p] + plen - m, m, read, n < rlen ? n : rlen, 20, maxedits, false,
+				naive_degenerate(primers[p]), &end);
+		if (distance >= 0 && (hit->distance < 0 || distance < hit->distance))
+			*hit = (struct indelhit) {p, distance, end + 1};
+	}
+	return hit->distance < 0 ? 0 : hit->end;
+}
+
+/*
+ * trim_right_indels with naive_search: the first 64 bases of each primer backwards, from the end of the
+ * read back to indexL, keeping the last match
+ */
+int naive_trim_right(char **primers, const char *read, int indexL, int maxedits, struct indelhit *hit) {
+	int rlen = (int) strlen(read);
+	char backwards[rlen + 1];
+	for (int i = 0; i < rlen; i++)
+		backwards[i] = read[rlen - 1 - i];
+	*hit = (struct indelhit) {-1, -1, rlen};
+	for (int p = 0; primers[p] != NULL && hit->distance != 0; p++) {
+		int plen = (int) strlen(primers[p]);
+		if (plen < 11 || rlen - indexL < 11)
+			continue;
+		int m = plen < 64 ? plen : 64, end;
+		char pattern[m];
+		for (int i = 0; i < m; i++)
+			pattern[i] = primers[p][m - 1 - i];
+		int distance = naive_search(pattern, m, backwards, rlen - indexL, rlen, maxedits, true,
+				naive_degenerate(primers[p]), &end);
+		if (distance >= 0 && (hit->distance < 0 || distance < hit->distance))
+			*hit = (struct indelhit) {p, distance, rlen - 1 - end};
+	}
+	return hit->distance < 0 ? rlen : hit->end;
+}
+
+/*
+ * Write len random bases to seq, with an IUPAC code one time in degenerate (if it is more than 0)
+ */
+void random_bases(char *seq, int len, int degenerate) {
+	for (int i = 0; i < len; i++)
+		seq[i] = degenerate > 0 && rand() % degenerate == 0 ? "RYSWKMBDHVN"[rand() % 11] : "ACGT"[rand() % 4];
+	seq[len] = 0;
+}
+
+/*
+ * Copy primer to seq with edits random substitutions, insertions, deletions, and Ns, and return the length
+ */
+int mutate(const char *primer, char *seq, int edits) {
+	int len = (int) strlen(primer);
+	strcpy(seq, primer);
+	for (int e = 0; e < edits && len > 1; e++) {
+		int i = rand() % len;
+		switch (rand() % 4) {
+			case 0: seq[i] = "ACGT"[rand() % 4]; break;
+			case 1: memmove(seq + i + 1, seq + i, len - i + 1); seq[i] = "ACGT"[rand() % 4]; len++; break;
+			case 2: memmove(seq + i, seq + i + 1, len - i); len--; break;
+			default: seq[i] = 'N';
+		}
+	}
+	return len;
+}
+
+/*
+ * Compare what trim_left_indels or trim_right_indels found with what we expected
+ */
+bool same_hit(int trimmed, const struct indelhit *hit, int expected, const struct indelhit *want) {
+	return trimmed == expected && hit->primer == want->primer && hit->distance == want->distance && hit->end == want->end;
+}
+
+/*
+ * trim_left_indels and trim_right_indels should find the same primers, edit distances, and ends as the
+ * edit distance matrix, first for some reads we know the answer for, then for random ones. Returns the
+ * number of reads that were not the same.
+ */
+int test_indels() {
+	char *left[] = {"AGAGTTTGATCCTGGCTCAG", "GTGYCAGCMGCCGCGGTAA", NULL};
+	char *right[] = {"GATCGGAAGAGCACACGTCTGAACTCCAGTCAC", NULL};
+	// the read, whether it is for the left or the right primers, maxedits, indexL, and the primer, distance, and end we expect
+	struct {
+		const char *name;
+		const char *read;
+		bool isleft;
+		int maxedits;
+		int indexL;
+		struct indelhit want;
+	} cases[] = {
+		{"left exact", "AGAGTTTGATCCTGGCTCAGTACGGAGGGTGCAAGCGTTAATCGG", true, 2, 0, {0, 0, 20}},
+		{"left after 5 bases", "CCTTAAGAGTTTGATCCTGGCTCAGTACGGAGGGTGCAAGCGTTAATCGG", true, 2, 0, {0, 0, 25}},
+		{"left substitution", "AGAGTTTGATCATGGCTCAGTACGGAGGGTGCAAGCGTTAATCGG", true, 2, 0, {0, 1, 20}},
+		{"left insertion", "AGAGTTTGATCCCTGGCTCAGTACGGAGGGTGCAAGCGTTAATCGG", true, 2, 0, {0, 1, 21}},
+		{"left deletion", "AGAGTTTATCCTGGCTCAGTACGGAGGGTGCAAGCGTTAATCGG", true, 2, 0, {0, 1, 19}},
+		{"left N", "AGAGTTTGATNCTGGCTCAGTACGGAGGGTGCAAGCGTTAATCGG", true, 2, 0, {0, 1, 20}},
+		{"left too many edits", "AGAGTATGATNCTGGCTCAGTACGGAGGGTGCAAGCGTTAATCGG", true, 1, 0, {-1, -1, 0}},
+		{"left degenerate C, A", "ACGTGCCAGCAGCCGCGGTAATACGGAGGGTGCAAGCGTTAATCGG", true, 0, 0, {1, 0, 21}},
+		{"left degenerate T, C", "GTGTCAGCCGCCGCGGTAATACGGAGGGTGCAAGCGTTAATCGG", true, 0, 0, {1, 0, 19}},
+		{"left degenerate G", "GTGGCAGCAGCCGCGGTAATACGGAGGGTGCAAGCGTTAATCGG", true, 1, 0, {1, 1, 19}},
+		{"left last 12 bases", "ATCCTGGCTCAGTACGGAGGGTGCAAGCGTTAATCGG", true, 0, 0, {0, 0, 12}},
+		{"right exact", "TACGGAGGGTGCAAGCGTTAATCGGAATTACTGGGCGTAAAGGATCGGAAGAGCACACGTCTGAACTCCAGTCACAAAA", false, 2, 0, {0, 0, 42}},
+		{"right at the end", "TACGGAGGGTGCAAGCGTTAATCGGAATTACTGGGCGTAAAGGATCGGAAGAGCACAC", false, 2, 0, {0, 0, 42}},
+		{"right insertion", "TACGGAGGGTGCAAGCGTTAATCGGAATTACTGGGCGTAAAGGATCGGAAAGAGCACACGTCTGAACTCCAGTCAC", false, 2, 0, {0, 1, 42}},
+		{"right deletion", "TACGGAGGGTGCAAGCGTTAATCGGAATTACTGGGCGTAAAGGATCGGAGAGCACACGTCTGAACTCCAGTCAC", false, 2, 0, {0, 1, 42}},
+		{"right N", "TACGGAGGGTGCAAGCGTTAATCGGAATTACTGGGCGTAAAGGATCGGAAGAGCANACGTCTGAACTCCAGTCAC", false, 2, 0, {0, 1, 42}},
+		{"right twice", "TACGGAGGGTGCAAGCGTTAATCGGAATTACTGGGCGTAAAGGATCGGAAGAGCACACGTCTGAACTCCAGTCACGATCGGAAGAGCACACGTCTGAACTCCAGTCAC", false, 0, 0, {0, 0, 42}},
+		{"right before indexL", "TACGGAGGGTGCAAGCGTTAATCGGAATTACTGGGCGTAAAGGATCGGAAGAGCACACGTCTGAACTCCAGTCAC", false, 2, 47, {-1, -1, 75}},
+	};
+	int ncases = sizeof(cases) / sizeof(*cases), failed = 0;
+	struct packedprimers *pleft = pack_primers(left), *pright = pack_primers(right);
+	struct packedread read;
+	packedread_init(&read);
+	struct indelhit hit, naive;
+	printf("\n\n\nPrimers with insertions and deletions\n\n");
+	for (int c = 0; c < ncases; c++) {
+		const char *seq = cases[c].read;
+		int trimmed, expected = cases[c].want.distance < 0 ? (cases[c].isleft ? 0 : (int) strlen(seq)) : cases[c].want.end;
+		packedread_pack(&read, seq, strlen(seq));
+		if (cases[c].isleft) {
+			trimmed = trim_left_indels(pleft, &read, cases[c].maxedits, &hit);
+			naive_trim_left(left, seq, cases[c].maxedits, &naive);
+		} else {
+			trimmed = trim_right_indels(pright, &read, cases[c].indexL, cases[c].maxedits, &hit);
+			naive_trim_right(right, seq, cases[c].indexL, cases[c].maxedits, &naive);
+		}
+		bool ok = same_hit(trimmed, &hit, expected, &cases[c].want) && same_hit(trimmed, &naive, expected, &cases[c].want);
+		printf("%s: primer %d distance %d end %d %s\n", cases[c].name, hit.primer, hit.distance, hit.end, ok ? "OK" : "WRONG");
+		failed += !ok;
+	}
+	free_packed_primers(pleft);
+	free_packed_primers(pright);
+
+	// random primers (some degenerate, some longer than 64 bases) with random edits in random reads
+	srand(7);
+	int wrong = 0, nreads = 5000;
+	for (int r = 0; r < nreads; r++) {
+		char primer[81], other[81], seq[300];
+		random_bases(primer, 11 + rand() % 70, r % 2 ? 0 : 10);
+		random_bases(other, 11 + rand() % 30, r % 3 ? 0 : 10);
+		char *primers[] = {other, primer, NULL};
+		struct packedprimers *pp = pack_primers(primers);
+		int maxedits = rand() % 4, before = rand() % (r % 2 ? 30 : 70), after = rand() % 40;
+		random_bases(seq, before, 0);
+		int len = before + mutate(primer, seq + before, rand() % 4);
+		random_bases(seq + len, after, 0);
+		packedread_pack(&read, seq, strlen(seq));
+		int trimmed = trim_left_indels(pp, &read, maxedits, &hit);
+		int expected = naive_trim_left(primers, seq, maxedits, &naive);
+		wrong += !same_hit(trimmed, &hit, expected, &naive);
+		int indexL = rand() % 20;
+		trimmed = trim_right_indels(pp, &read, indexL, maxedits, &hit);
+		expected = naive_trim_right(primers, seq, indexL, maxedits, &naive);
+		wrong += !same_hit(trimmed, &hit, expected, &naive);
+		free_packed_primers(pp);
+	}
+	printf("%d random reads: %s\n", nreads, wrong ? "WRONG" : "OK");
+	failed += wrong;
+	packedread_free(&read);
+	return failed;
+}
+
+/*
+ * Write nrecords random fastq (or fasta) records to filename, as nmembers gzip members one after another
+ */
+void write_sequences(char *filename, int nrecords, bool fastq, int nmembers) {
+	srand(42);
+	for (int m = 0; m < nmembers; m++) {
+		gzFile out = gzopen(filename, m == 0 ? "wb" : "ab");
+		for (int i = m * nrecords / nmembers; i < (m + 1) * nrecords / nmembers; i++) {
+			int len = 50 + rand() % 100;
+			char seq[len + 1], qual[len + 1];
+			for (int j = 0; j < len; j++) {
+				seq[j] = "ACGTN"[rand() % 5];
+				qual[j] = 'A' + rand() % 30;
+			}
+			seq[len] = qual[len] = 0;
+			if (fastq)
+				gzprintf(out, "@read%d\n%s\n+\n%s\n", i, seq, qual);
+			else
+				gzprintf(out, ">read%d\n%s\n", i, seq);
+		}
+		gzclose(out);
+	}
+}
+
+/*
+ * Read all of a shard (or the whole file if nshards is 1) and append it to buf
+ */
+size_t read_shard(char *filename, int shard, int nshards, char **buf, size_t used, size_t *capacity) {
+	struct gzshard *s = gzshard_open(filename, shard, nshards);
+	if (s == NULL)
+		return used;
+	int r;
+	do {
+		if (used + 65536 > *capacity) {
+			*capacity = 2 * (used + 65536);
+			*buf = realloc(*buf, *capacity);
+		}
+		r = gzshard_read(s, *buf + used, 65536);
+		if (r > 0)
+			used += r;
+	} while (r > 0);
+	gzshard_close(s);
+	return used;
+}
+
+/*
+ * The shards of a file, one after another, should be exactly the whole file. Returns the number of
+ * ways of sharding that were not.
+ */
+int test_shards() {
+	char dir[] = "/tmp/primertrim-test.XXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "Could not make a directory for the shards\n");
+		return 1;
+	}
+	char filename[sizeof(dir) + 16], index[sizeof(dir) + 32];
+	sprintf(filename, "%s/reads.gz", dir);
+	sprintf(index, "%s.ptidx", filename);
+
+	// one gzip member of fastq, one of fasta, and fastq in several members like BGZF
+	bool fastq[] = {true, false, true};
+	int members[] = {1, 1, 7};
+	int nshards[] = {2, 3, 7, 16};
+	int failed = 0;
+	for (int t = 0; t < 3; t++) {
+		write_sequences(filename, 20000, fastq[t], members[t]);
+		size_t wcap = 0, scap = 0;
+		char *whole = NULL, *sharded = NULL;
+		size_t wlen = read_shard(filename, 0, 1, &whole, 0, &wcap);
+		for (int n = 0; n < 4; n++) {
+			size_t slen = 0;
+			for (int i = 0; i < nshards[n]; i++)
+				slen = read_shard(filename, i, nshards[n], &sharded, slen, &scap);
+			bool same = wlen > 0 && slen == wlen && memcmp(whole, sharded, wlen) == 0;
+			printf("%s in %d gzip members, %d shards: %s\n", fastq[t] ? "fastq" : "fasta", members[t], nshards[n],
+				same ? "same as the whole file" : "DIFFERENT");
+			failed += !same;
+		}
+		free(whole);
+		free(sharded);
+		// the index is for the old file, so make a new one for the next
+		unlink(index);
+	}
+	unlink(filename);
+	rmdir(dir);
+	return failed;
+}
 
 int main(int argc, char *argv[]) {
 	test_primers();
 	test_comparisons();
+	int failed = test_iterator();
+	failed += test_iterator128();
+	failed += test_iupac();
+	failed += test_indels();
+	failed += test_shards();
+	return failed;
 }
 
@@ -0,0 +1,444 @@
+/*
+ * Trim all the samples in a manifest in one pool of threads.
+ *
+ * The primers are loaded and packed once. The work is a batch of records from one sample: a thread
+ * reads a batch (only one thread reads a sample at a time, because gzip has to be read in order), trims
+ * it, and writes it to the sample's output in the order it was read. A thread keeps reading from the same
+ * sample while it can. When it can't, it starts a sample nobody has started, and once they have all been
+ * started it steals batches from any sample that is still being read. So lots of small samples are
+ * trimmed side by side, and at the end every thread is helping with the big ones.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "kseq.h"
+#include "trimprimers.h"
+#include "trimmanifest.h"
+#include "packedread.h"
+
+KSEQ_INIT(gzFile, gzread)
+
+// records per batch
+#define manifest_batch 4096
+
+/*
+ * A trimmed batch waiting to be written
+ */
+struct outbatch {
+    long number;
+    char *text;
+    size_t len;
+    struct outbatch *next;
+};
+
+struct sample {
+    char *input;
+    char *output;
+    gzFile in;
+    kseq_t *seq;
+    gzFile out;
+    bool started;
+    bool reading;               // a thread is reading a batch
+    bool eof;                   // everything has been read
+    bool closed;
+    bool failed;
+    long nread;                 // batches read
+    long nwritten;              // batches written
+    long nextwrite;             // the next batch to write (like nwritten, but with writelock not the pool lock)
+    struct outbatch *pending;   // batches that are trimmed but waiting for an earlier batch, in order
+    pthread_mutex_t writelock;
+};
+
+struct pool {
+    struct sample *samples;
+    int n;
+    int next;                   // the next sample nobody has started
+    int maxinflight;            // batches of one sample that can be read but not written yet
+    const struct packedprimers *left;
+    const struct packedprimers *right;
+    const struct trimoptions *options;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+/*
+ * The records in a batch, as they were read
+ */
+struct inbatch {
+    int n;
+    size_t *header;
+    size_t *seq;
+    int *len;
+    bool *hasqual;
+    char *data;
+    size_t used;
+    size_t capacity;
+};
+
+static void inbatch_append(struct inbatch *b, const char *s, size_t len) {
+    if (b->used + len > b->capacity) {
+        while (b->used + len > b->capacity)
+            b->capacity *= 2;
+        b->data = realloc(b->data, b->capacity);
+        if (b->data == NULL) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for the sequences\n");
+            exit(-1);
+        }
+    }
+    memcpy(b->data + b->used, s, len);
+    b->used += len;
+}
+
+static void inbatch_add(struct inbatch *b, const kseq_t *seq) {
+    int i = b->n++;
+    b->header[i] = b->used;
+    inbatch_append(b, seq->name.s, seq->name.l);
+    if (seq->comment.l) {
+        inbatch_append(b, " ", 1);
+        inbatch_append(b, seq->comment.s, seq->comment.l);
+    }
+    inbatch_append(b, "", 1);
+    b->seq[i] = b->used;
+    b->len[i] = (int) seq->seq.l;
+    b->hasqual[i] = seq->qual.l == seq->seq.l;
+    inbatch_append(b, seq->seq.s, seq->seq.l);
+    if (b->hasqual[i])
+        inbatch_append(b, seq->qual.s, seq->qual.l);
+}
+
+static void free_samples(struct sample *samples, int n) {
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_destroy(&samples[i].writelock);
+        free(samples[i].input);
+        free(samples[i].output);
+    }
+    free(samples);
+}
+
+/*
+ * Read the manifest. Returns the number of samples, or -1 (with no samples) if it can't be read.
+ */
+static int read_manifest(char *manifest, struct sample **samples) {
+    *samples = NULL;
+    FILE *fp = fopen(manifest, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "ERROR: Can not open the manifest %s\n", manifest);
+        return -1;
+    }
+    int n = 0, size = 64, lineno = 0;
+    struct sample *list = malloc(sizeof(*list) * size);
+    if (list == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the manifest\n");
+        exit(-1);
+    }
+    char *line = NULL;
+    size_t linesize = 0;
+    ssize_t l;
+    while ((l = getline(&line, &linesize, fp)) >= 0) {
+        lineno++;
+        while (l > 0 && (line[l - 1] == '\n' || line[l - 1] == '\r'))
+            line[--l] = 0;
+        if (l == 0 || line[0] == '#')
+            continue;
+        char *tab = strchr(line, '\t');
+        if (tab == NULL || tab == line || tab[1] == 0) {
+            fprintf(stderr, "ERROR: Line %d of %s needs an input and an output file separated by a tab\n", lineno, manifest);
+            free_samples(list, n);
+            list = NULL;
+            n = -1;
+            break;
+        }
+        *tab = 0;
+        if (n == size) {
+            size *= 2;
+            list = realloc(list, sizeof(*list) * size);
+        }
+        if (list == NULL) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for the manifest\n");
+            exit(-1);
+        }
+        struct sample *s = &list[n++];
+        memset(s, 0, sizeof(*s));
+        s->input = strdup(line);
+        s->output = strdup(tab + 1);
+        if (s->input == NULL || s->output == NULL) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for the manifest\n");
+            exit(-1);
+        }
+        pthread_mutex_init(&s->writelock, NULL);
+    }
+    free(line);
+    fclose(fp);
+    *samples = list;
+    return n;
+}
+
+/*
+ * Open the input and output of a sample. Returns false (and marks it failed) if we can't.
+ */
+static bool open_sample(struct sample *s) {
+    s->in = gzopen(s->input, "r");
+    if (s->in == NULL) {
+        fprintf(stderr, "ERROR: Can not open %s\n", s->input);
+        s->failed = true;
+        return false;
+    }
+    s->seq = kseq_init(s->in);
+    size_t len = strlen(s->output);
+    // zlib writes plain text with T
+    s->out = gzopen(s->output, len > 3 && strcmp(s->output + len - 3, ".gz") == 0 ? "wb" : "wT");
+    if (s->out == NULL) {
+        fprintf(stderr, "ERROR: Can not write to %s\n", s->output);
+        s->failed = true;
+        return false;
+    }
+    return true;
+}
+
+static bool can_read(const struct pool *pool, const struct sample *s) {
+    return s->started && !s->reading && !s->eof && s->nread - s->nwritten < pool->maxinflight;
+}
+
+/*
+ * The sample to read from next (with pool->lock held): the one we were reading if we can, otherwise a new
+ * one, otherwise any sample with something left to read. Returns NULL if there is nothing left to read
+ * at all, and waits if everything left is being read by another thread.
+ */
+static struct sample *next_sample(struct pool *pool, struct sample *current) {
+    for (;;) {
+        if (current && can_read(pool, current))
+            return current;
+        if (pool->next < pool->n) {
+            struct sample *s = &pool->samples[pool->next++];
+            s->started = true;
+            return s;
+        }
+        bool unfinished = false;
+        for (int i = 0; i < pool->n; i++) {
+            if (can_read(pool, &pool->samples[i]))
+                return &pool->samples[i];
+            unfinished |= !pool->samples[i].eof;
+        }
+        if (!unfinished)
+            return NULL;
+        pthread_cond_wait(&pool->changed, &pool->lock);
+    }
+}
+
+/*
+ * Close the sample (with pool->lock held) if it has all been read and written. Returns true if we did.
+ */
+static bool finish_sample(struct sample *s) {
+    if (!s->eof || s->closed || s->nwritten < s->nread)
+        return false;
+    s->closed = true;
+    return true;
+}
+
+static void close_sample(struct sample *s) {
+    if (s->seq)
+        kseq_destroy(s->seq);
+    if (s->in)
+        gzclose(s->in);
+    if (s->out && gzclose(s->out) != Z_OK) {
+        fprintf(stderr, "ERROR: Could not finish writing %s\n", s->output);
+        s->failed = true;
+    }
+    s->seq = NULL;
+    s->in = s->out = NULL;
+}
+
+/*
+ * Trim the batch and write it out the way trim_primers does
+ */
+static struct outbatch *trim_batch(const struct pool *pool, const struct inbatch *b, struct packedread *read) {
+    struct outbatch *out = malloc(sizeof(*out));
+    size_t capacity = b->used + (size_t) b->n * 6;
+    if (out != NULL)
+        out->text = malloc(capacity);
+    if (out == NULL || out->text == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the sequences\n");
+        exit(-1);
+    }
+    char *p = out->text;
+    struct trimresult result;
+    for (int i = 0; i < b->n; i++) {
+        const char *seq = b->data + b->seq[i];
+        if (!packedread_pack(read, seq, b->len[i])) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for %s\n", b->data + b->header[i]);
+            exit(-1);
+        }
+        trim_read(pool->left, pool->right, seq, read, pool->options, &result);
+        int keep = result.end - result.start;
+        size_t hlen = strlen(b->data + b->header[i]);
+        *p++ = b->hasqual[i] ? '@' : '>';
+        memcpy(p, b->data + b->header[i], hlen);
+        p += hlen;
+        *p++ = '\n';
+        memcpy(p, seq + result.start, keep);
+        p += keep;
+        *p++ = '\n';
+        if (b->hasqual[i]) {
+            *p++ = '+';
+            *p++ = '\n';
+            memcpy(p, seq + b->len[i] + result.start, keep);
+            p += keep;
+            *p++ = '\n';
+        }
+    }
+    out->len = p - out->text;
+    return out;
+}
+
+/*
+ * Write this batch, and any that were waiting for it, to the sample's output. Returns how many batches
+ * we wrote.
+ */
+static long write_batch(struct sample *s, struct outbatch *out) {
+    pthread_mutex_lock(&s->writelock);
+    struct outbatch **pos = &s->pending;
+    while (*pos && (*pos)->number < out->number)
+        pos = &(*pos)->next;
+    out->next = *pos;
+    *pos = out;
+    long written = 0;
+    while (s->pending && s->pending->number == s->nextwrite) {
+        struct outbatch *next = s->pending;
+        s->pending = next->next;
+        if (!s->failed && next->len > 0 && gzwrite(s->out, next->text, (unsigned) next->len) <= 0) {
+            fprintf(stderr, "ERROR: Could not write to %s\n", s->output);
+            s->failed = true;
+        }
+        free(next->text);
+        free(next);
+        s->nextwrite++;
+        written++;
+    }
+    pthread_mutex_unlock(&s->writelock);
+    return written;
+}
+
+static void *trim_worker(void *arg) {
+    struct pool *pool = arg;
+    struct inbatch b;
+    b.header = malloc(sizeof(*b.header) * manifest_batch);
+    b.seq = malloc(sizeof(*b.seq) * manifest_batch);
+    b.len = malloc(sizeof(*b.len) * manifest_batch);
+    b.hasqual = malloc(sizeof(*b.hasqual) * manifest_batch);
+    b.capacity = 1 << 20;
+    b.data = malloc(b.capacity);
+    if (!b.header || !b.seq || !b.len || !b.hasqual || !b.data) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the sequences\n");
+        exit(-1);
+    }
+    struct packedread read;
+    packedread_init(&read);
+    struct sample *s = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    while ((s = next_sample(pool, s)) != NULL) {
+        s->reading = true;
+        long number = s->nread;
+        bool opened = s->in != NULL || (!s->failed && open_sample(s));
+        pthread_mutex_unlock(&pool->lock);
+
+        // read a batch (we are the only thread reading this sample)
+        int l = -1;
+        b.n = 0;
+        b.used = 0;
+        while (opened && b.n < manifest_batch && (l = kseq_read(s->seq)) >= 0)
+            inbatch_add(&b, s->seq);
+        if (l < -1) {
+            fprintf(stderr, "ERROR: %s is %s\n", s->input, l == -2 ? "truncated (the quality scores are missing)" : "corrupt");
+            // write_batch checks failed while other threads write this sample's earlier batches
+            pthread_mutex_lock(&s->writelock);
+            s->failed = true;
+            pthread_mutex_unlock(&s->writelock);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        s->reading = false;
+        if (b.n > 0)
+            s->nread++;
+        if (l < 0)
+            s->eof = true;
+        bool close = finish_sample(s);
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+        if (close)
+            close_sample(s);
+
+        if (b.n > 0) {
+            struct outbatch *out = trim_batch(pool, &b, &read);
+            out->number = number;
+            long written = write_batch(s, out);
+            pthread_mutex_lock(&pool->lock);
+            s->nwritten += written;
+            close = finish_sample(s);
+            pthread_cond_broadcast(&pool->changed);
+            pthread_mutex_unlock(&pool->lock);
+            if (close)
+                close_sample(s);
+        }
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    packedread_free(&read);
+    free(b.header);
+    free(b.seq);
+    free(b.len);
+    free(b.hasqual);
+    free(b.data);
+    return NULL;
+}
+
+int trim_manifest(char *manifest, char **primersL, char **primersR, const struct trimoptions *options, int threads) {
+    struct pool pool;
+    pool.n = read_manifest(manifest, &pool.samples);
+    if (pool.n < 0)
+        return 1;
+    pool.next = 0;
+    pool.maxinflight = 2 * threads;
+    struct packedprimers *packedL = primersL ? pack_primers(primersL) : NULL;
+    struct packedprimers *packedR = primersR ? pack_primers(primersR) : NULL;
+    pool.left = packedL;
+    pool.right = packedR;
+    pool.options = options;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+
+    // this thread is one of the workers
+    pthread_t workers[threads];
+    int started = 0;
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&workers[i], NULL, trim_worker, &pool) != 0)
+            break;
+        started++;
+    }
+    // we can always trim in this thread, even if we couldn't start any others
+    trim_worker(&pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+
+    int ro = 0;
+    for (int i = 0; i < pool.n; i++) {
+        struct sample *s = &pool.samples[i];
+        if (s->failed) {
+            fprintf(stderr, "ERROR: %s was not trimmed completely\n", s->input);
+            ro = 1;
+        }
+    }
+    free_samples(pool.samples, pool.n);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.changed);
+    if (packedL)
+        free_packed_primers(packedL);
+    if (packedR)
+        free_packed_primers(packedR);
+    return ro;
+}
@@ -0,0 +1,17 @@
+/*
+ * Trim lots of samples in one process. The manifest has an input and an output file on each line
+ * (separated by a tab), and all the samples share one pool of threads.
+ */
+
+#ifndef TRIMMANIFEST_H
+#define TRIMMANIFEST_H
+
+#include "trimprimers.h"
+
+/*
+ * Trim every sample in the manifest with the same primers (either can be NULL) in threads threads.
+ * An output file that ends .gz is gzipped. Returns 0 if every sample was trimmed.
+ */
+int trim_manifest(char *manifest, char **primersL, char **primersR, const struct trimoptions *options, int threads);
+
+#endif //TRIMMANIFEST_H
@@ -2,9 +2,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <pthread.h>
 #include "kseq.h"
 #include "version.h"
 #include "trimprimers.h"
+#include "packedread.h"
+#include "gzshard.h"
+#include "readcache.h"
 
 //#include "uthash.h"
 //struct my_struct {
@@ -15,7 +21,7 @@
 //};
 
 
-KSEQ_INIT(gzFile, gzread)
+KSEQ_INIT(struct gzshard *, gzshard_read)
 
 #define len(x) (int)strlen(x)
 #define min(x, y) (((x) < (y)) ? (x) : (y))
@@ -28,65 +34,568 @@ void remove_newline(char *line){
 		line[new_line] = '\0';
 }
 
-int trim_left(char** primers, char *seq){
-	int p, offsetS, offsetP, i, mismatch;
+/*
+ * The primers and reads are packed two bits per base (packedread.h), so we compare 32 bases at a time and
+ * count mismatches with XOR and popcount rather than a byte at a time. The trimming rules are the same as
+ * when we compared characters: we line each primer up with the read at each offset, keep going until the
+ * second mismatch, and need at least 11 bases. The end of the primer only matches the end of the read, and
+ * an N in the read never matches anything.
+ *
+ * Primers can have IUPAC codes, so an R matches an A or a G, and an N in the primer matches any base. These
+ * are compared with the allow masks from packedread_pack_iupac, which costs the same for any number of them.
+ */
+
+/*
+ * Is position j a mismatch when we line up the primer from offsetP with the read from offsetS?
+ */
+static inline bool mismatch_at(const struct packedread *primer, int offsetP, const struct packedread *read, int offsetS, int j) {
+	int end = (int) primer->len - offsetP;
+	if (j > end)
+		return true;
+	if (j == end)
+		return offsetS + j != (int) read->len;
+	return (packed_mismatch_bits(primer, offsetP + j, read, offsetS + j) & 1) != 0;
+}
+
+/*
+ * Compare the primer from offsetP with the read from offsetS up to the end of the primer, and return the
+ * number of positions we compared before we stopped at the second mismatch.
+ */
+static inline int compare_to_second_mismatch(const struct packedread *primer, int offsetP, const struct packedread *read, int offsetS) {
+	int end = (int) primer->len - offsetP;
+	int seen = 0;
+	for (int j0 = 0; j0 <= end; j0 += 32) {
+		uint64_t m = packed_mismatch_bits(primer, offsetP + j0, read, offsetS + j0);
+		if (end - j0 < 32) {
+			m &= packed_mask(end - j0 + 1);
+			if (offsetS + end == (int) read->len)
+				m &= ~(1ULL << (2 * (end - j0)));
+		}
+		while (m) {
+			int j = j0 + __builtin_ctzll(m) / 2;
+			if (++seen == 2)
+				return j + 1;
+			m &= m - 1;
+		}
+	}
+	return end + 1;
+}
+
+/*
+ * If there are three mismatches in the first 11 bases we can't get to 11 before the second mismatch.
+ * Most offsets fail this test, so we keep the first 32 bases of each primer at each offset ready to go.
+ */
+static inline bool too_many_mismatches(const struct packedprimers *pp, int p, int offsetP, uint64_t rbases, uint64_t rnmask) {
+	uint64_t m;
+	if (pp->allowwindows[p]) {
+		m = packed_iupac_mismatch_word(rbases, rnmask, pp->allowwindows[p][offsetP], pp->nwindows[p][offsetP]);
+	} else {
+		uint64_t x = pp->windows[p][offsetP] ^ rbases;
+		m = ((x | (x >> 1)) & packed_low_bits) | pp->nwindows[p][offsetP] | rnmask;
+	}
+	return __builtin_popcountll(m & packed_mask(11)) >= 3;
+}
+
+/*
+ * trim_left_packed, and which primer we found and how many mismatches it had in *found
+ * (the distance is -1 if we didn't find one)
+ */
+static int trim_left_hit(const struct packedprimers *pp, const struct packedread *read, struct indelhit *found) {
+	int p, offsetS, offsetP, i;
 
-    for(p=0; primers[p] != NULL; p++){
+	for(p=0; p < pp->n; p++){
+		const struct packedread *primer = &pp->primers[p];
+		int plen = (int) primer->len;
 		for(offsetS = 0; offsetS < 20; offsetS++){
-			for(offsetP = 0; offsetP <= len(primers[p])-11; offsetP++){
-				i = mismatch = 0;
-				while((mismatch < 2) & (i+offsetP <= len(primers[p]))){
-					if(primers[p][i+offsetP] != seq[i+offsetS])
-						mismatch++;
-					i++;
-				}
+			uint64_t rbases = packedread_bases(read, offsetS), rnmask = packedread_nmask(read, offsetS);
+			for(offsetP = 0; offsetP <= plen-11; offsetP++){
+				if (too_many_mismatches(pp, p, offsetP, rbases, rnmask))
+					continue;
+				i = compare_to_second_mismatch(primer, offsetP, read, offsetS);
 				// this is because the last bases cannot be a mismatch
-				if(primers[p][i+offsetP] == seq[i+offsetS])
+				if(!mismatch_at(primer, offsetP, read, offsetS, i))
 					i++;
-				if(i >= 11)
-					return (i+offsetS-1);
+				if(i >= 11) {
+					int matched = min(i - 1, (int) read->len - offsetS);
+					found->primer = p;
+					found->distance = packed_mismatches(primer, offsetP, read, offsetS, matched, matched);
+					found->end = i+offsetS-1;
+					return found->end;
+				}
 			}
 		}
-	}	
+	}
+	found->primer = found->distance = -1;
+	found->end = 0;
 	return 0;
 }
 
-int trim_right(char** primers, char *seq, int indexL){
-	int p, offsetS, offsetP, i, mismatch;
-
-    for(p=0; primers[p] != NULL; p++){
-		for(offsetS = indexL; offsetS <= len(seq)-11; offsetS++){
-			for(offsetP = 0; offsetP <= len(primers[p])-11; offsetP++){
-				i = mismatch = 0;
-				while((mismatch < 2) & (i+offsetP <= len(primers[p]))){
-					if(primers[p][i+offsetP] != seq[i+offsetS])
-						mismatch++;
-					i++;
-				}
+int trim_left_packed(const struct packedprimers *pp, const struct packedread *read) {
+	struct indelhit found;
+	return trim_left_hit(pp, read, &found);
+}
+
+/*
+ * trim_right_packed, and which primer we found and how many mismatches it had in *found
+ * (the distance is -1 if we didn't find one)
+ */
+static int trim_right_hit(const struct packedprimers *pp, const struct packedread *read, int indexL, struct indelhit *found) {
+	int p, offsetS, offsetP, i;
+	int slen = (int) read->len;
+
+	for(p=0; p < pp->n; p++){
+		const struct packedread *primer = &pp->primers[p];
+		int plen = (int) primer->len;
+		for(offsetS = indexL; offsetS <= slen-11; offsetS++){
+			uint64_t rbases = packedread_bases(read, offsetS), rnmask = packedread_nmask(read, offsetS);
+			for(offsetP = 0; offsetP <= plen-11; offsetP++){
+				if (too_many_mismatches(pp, p, offsetP, rbases, rnmask))
+					continue;
+				i = compare_to_second_mismatch(primer, offsetP, read, offsetS);
 				// this is because the last bases cannot be a mismatch
-				if(primers[p][i+offsetP] != seq[i+offsetS])
+				if(mismatch_at(primer, offsetP, read, offsetS, i))
 					i--;
 				// this is because the first bases cannot be a mismatch
-				if(primers[p][offsetP] != seq[offsetS])
+				if(mismatch_at(primer, offsetP, read, offsetS, 0))
 					i--;
-				if(i >= 11)
+				if(i >= 11) {
+					int matched = min(i, min(plen - offsetP, slen - offsetS));
+					found->primer = p;
+					found->distance = packed_mismatches(primer, offsetP, read, offsetS, matched, matched);
+					found->end = offsetS;
 					return (offsetS);
+				}
 			}
 		}
-	}	
-	return len(seq);
+	}
+	found->primer = found->distance = -1;
+	found->end = slen;
+	return slen;
 }
 
-int trim_poly(char *seq, int n){
-	int i = len(seq);
-	char c = seq[i-1];
+int trim_right_packed(const struct packedprimers *pp, const struct packedread *read, int indexL) {
+	struct indelhit found;
+	return trim_right_hit(pp, read, indexL, &found);
+}
+
+/*
+ * To allow insertions and deletions we use Myers' bit-vector algorithm (Myers 1999, in the form in Hyyrö
+ * 2003): the primer is the pattern, up to 64 bases in one word, and we keep the differences between the
+ * rows of one column of the edit distance matrix as two bit vectors, so each base of the read is a few
+ * word operations whatever the length of the primer. Row 0 is free (the primer can start anywhere in
+ * the read) for the first band bases. The last 11 rows of column 0 cost one each, and the others are
+ * free, so the primer can also start part way through if it is at the start of what we search, as long
+ * as we use at least 11 bases of it.
+ */
+
+// the most bases of a primer we use for the indel search, one word of bits
+#define max_indel_primer 64
+
+// the edits we allow when we look for primers inside the reads, if we were not given --max_edits
+#define default_internal_edits 2
+
+/*
+ * The bases that can be at position i of a primer: bit 0 for A, 1 for C, 2 for G, 3 for T
+ */
+static int primer_allows(const struct packedread *pr, size_t i) {
+	int shift = 2 * (i % 32);
+	if (pr->degenerate) {
+		int mask = 0;
+		for (int b = 0; b < 4; b++)
+			mask |= (int) ((pr->allow[b][i / 32] >> shift) & 1) << b;
+		return mask;
+	}
+	if ((pr->nmask[i / 32] >> shift) & 1)
+		return 0;
+	return 1 << ((pr->bases[i / 32] >> shift) & 3);
+}
+
+/*
+ * One column of Myers' algorithm: the vertical differences (pv for +1, mv for -1) and the score in the last row
+ */
+struct myers {
+	uint64_t pv;
+	uint64_t mv;
+	uint64_t high;
+	int score;
+};
+
+/*
+ * Start a primer of m bases, where the last minimum rows of column 0 cost one each (so m for the
+ * whole primer)
+ */
+static inline void myers_init(struct myers *s, int m, int minimum) {
+	s->high = 1ULL << (m - 1);
+	s->pv = (minimum == 64 ? ~0ULL : (1ULL << minimum) - 1) << (m - minimum);
+	s->mv = 0;
+	s->score = minimum;
+}
+
+/*
+ * The positions of the primer that match the read base at pos (none for an N)
+ */
+static inline uint64_t myers_eq(const uint64_t peq[4], const struct packedread *read, size_t pos) {
+	int shift = 2 * (pos % 32);
+	if ((read->nmask[pos / 32] >> shift) & 1)
+		return 0;
+	return peq[(read->bases[pos / 32] >> shift) & 3];
+}
+
+/*
+ * Add the next base of the read. If hin is 1 it costs one to start the primer after this base.
+ */
+static inline void myers_step(struct myers *s, uint64_t eq, uint64_t hin) {
+	uint64_t xv = eq | s->mv;
+	uint64_t xh = (((eq & s->pv) + s->pv) ^ s->pv) | eq;
+	uint64_t ph = s->mv | ~(xh | s->pv);
+	uint64_t mh = s->pv & xh;
+	if (ph & s->high)
+		s->score++;
+	else if (mh & s->high)
+		s->score--;
+	ph = (ph << 1) | hin;
+	mh <<= 1;
+	s->pv = mh | ~(xv | ph);
+	s->mv = ph & xv;
+}
 
-	while(seq[--i] == c) {}
+/*
+ * Search n bases of the read from start, going forwards (dir 1) or backwards (dir -1), for the primer
+ * with m bases whose positions are in peq. Returns the lowest edit distance, and the step it ended at
+ * in end, from the first (or if last is true, the last) run of steps that are within maxedits.
+ * Returns -1 if there aren't any.
+ */
+static int myers_search(const uint64_t peq[4], int m, const struct packedread *read, int start, int n, int dir, int band, int maxedits, bool last, int *end) {
+	struct myers s;
+	myers_init(&s, m, m < 11 ? m : 11);
+	int best = -1;
+	bool inrun = false;
+	for (int t = 0; t < n; t++) {
+		// after the band it costs one to start the primer one base later
+		myers_step(&s, myers_eq(peq, read, (size_t) (start + dir * t)), t >= band - 1);
+		if (s.score <= maxedits) {
+			if (!inrun && last)
+				best = -1;
+			inrun = true;
+			if (best < 0 || s.score < best) {
+				best = s.score;
+				*end = t;
+			}
+		} else {
+			inrun = false;
+			if (best >= 0 && !last)
+				break;
+		}
+	}
+	return best;
+}
+
+int trim_left_indels(const struct packedprimers *pp, const struct packedread *read, int maxedits, struct indelhit *hit) {
+	struct indelhit best = {-1, -1, 0};
+	for (int p = 0; p < pp->n && best.distance != 0; p++) {
+		int plen = (int) pp->primers[p].len;
+		if (plen < 11)
+			continue;
+		int m = plen < max_indel_primer ? plen : max_indel_primer;
+		int n = 20 + m + maxedits;
+		if (n > (int) read->len)
+			n = (int) read->len;
+		int end;
+		int distance = myers_search(pp->peqleft[p], m, read, 0, n, 1, 20, maxedits, false, &end);
+		if (distance >= 0 && (best.distance < 0 || distance < best.distance)) {
+			best.primer = p;
+			best.distance = distance;
+			best.end = end + 1;
+		}
+	}
+	if (hit)
+		*hit = best;
+	return best.distance < 0 ? 0 : best.end;
+}
+
+int trim_right_indels(const struct packedprimers *pp, const struct packedread *read, int indexL, int maxedits, struct indelhit *hit) {
+	int slen = (int) read->len;
+	struct indelhit best = {-1, -1, slen};
+	for (int p = 0; p < pp->n && best.distance != 0; p++) {
+		int plen = (int) pp->primers[p].len;
+		if (plen < 11 || slen - indexL < 11)
+			continue;
+		int m = plen < max_indel_primer ? plen : max_indel_primer;
+		int end;
+		// search backwards from the end of the read, so the alignment ends where the primer starts,
+		// and keep the last match so we trim from the first primer in the read
+		int distance = myers_search(pp->peqright[p], m, read, slen - 1, slen - indexL, -1, slen, maxedits, true, &end);
+		if (distance >= 0 && (best.distance < 0 || distance < best.distance)) {
+			best.primer = p;
+			best.distance = distance;
+			best.end = slen - 1 - end;
+		}
+	}
+	if (hit)
+		*hit = best;
+	return best.distance < 0 ? slen : best.end;
+}
+
+/*
+ * The chunks of one read that one thread searches for find_internal_primers: first, first + step, ...
+ */
+struct chunkscan {
+	pthread_t thread;
+	const struct packedprimers *pp;
+	const struct packedread *read;
+	int maxedits;
+	int chunk_size;
+	int first;
+	int step;
+	int nchunks;
+	struct indelhit *hits;
+	long n;
+	long capacity;
+	bool ok;
+	bool started;
+};
 
-	if(i < len(seq)-5)
-		return i+1;
-	else
-		return len(seq);
+static void add_internal_hit(struct chunkscan *c, int p, int distance, int end) {
+	if (c->n == c->capacity) {
+		long capacity = c->capacity ? 2 * c->capacity : 16;
+		struct indelhit *hits = realloc(c->hits, sizeof(*hits) * capacity);
+		if (hits == NULL) {
+			c->ok = false;
+			return;
+		}
+		c->hits = hits;
+		c->capacity = capacity;
+	}
+	c->hits[c->n].primer = p;
+	c->hits[c->n].distance = distance;
+	c->hits[c->n].end = end;
+	c->n++;
+}
+
+/*
+ * Search one chunk for every primer. We start a primer length (plus maxedits) before the chunk, so
+ * the scores are right by the time we get to it, and keep going after the end of the chunk until we
+ * finish any run of hits that started in it. Each run of hits is one primer, and we report its best end.
+ */
+static void scan_chunk(struct chunkscan *c, int chunk) {
+	int len = (int) c->read->len;
+	int cstart = chunk * c->chunk_size;
+	int cend = cstart + c->chunk_size < len ? cstart + c->chunk_size : len;
+	for (int p = 0; p < c->pp->n && c->ok; p++) {
+		int plen = (int) c->pp->primers[p].len;
+		if (plen < 11)
+			continue;
+		int m = plen < max_indel_primer ? plen : max_indel_primer;
+		int from = cstart - m - c->maxedits > 0 ? cstart - m - c->maxedits : 0;
+		struct myers s;
+		myers_init(&s, m, m);
+		bool inrun = false, mine = false;
+		int best = 0, bestend = 0;
+		for (int pos = from; pos < len; pos++) {
+			myers_step(&s, myers_eq(c->pp->peqleft[p], c->read, pos), 0);
+			bool within = s.score <= c->maxedits;
+			if (inrun && !within) {
+				if (mine)
+					add_internal_hit(c, p, best, bestend + 1);
+				inrun = false;
+			}
+			if (pos >= cend && !inrun)
+				break;
+			if (within && !inrun) {
+				inrun = true;
+				mine = pos >= cstart;
+				best = s.score;
+				bestend = pos;
+			} else if (within && s.score < best) {
+				best = s.score;
+				bestend = pos;
+			}
+		}
+		if (inrun && mine)
+			add_internal_hit(c, p, best, bestend + 1);
+	}
+}
+
+static void *scan_chunks(void *arg) {
+	struct chunkscan *c = arg;
+	for (int chunk = c->first; chunk < c->nchunks && c->ok; chunk += c->step)
+		scan_chunk(c, chunk);
+	return NULL;
+}
+
+static int compare_hits(const void *a, const void *b) {
+	const struct indelhit *x = a, *y = b;
+	if (x->end != y->end)
+		return x->end < y->end ? -1 : 1;
+	return x->primer - y->primer;
+}
+
+long find_internal_primers(const struct packedprimers *pp, const struct packedread *read, int maxedits,
+		int chunk_size, int threads, struct indelhit **hits) {
+	if (chunk_size < 1)
+		chunk_size = (int) read->len > 0 ? (int) read->len : 1;
+	int nchunks = ((int) read->len + chunk_size - 1) / chunk_size;
+	if (threads > nchunks)
+		threads = nchunks;
+	if (threads < 1)
+		threads = 1;
+	struct chunkscan *scans = calloc(threads, sizeof(*scans));
+	if (scans == NULL)
+		return -1;
+	for (int t = 0; t < threads; t++) {
+		scans[t].pp = pp;
+		scans[t].read = read;
+		scans[t].maxedits = maxedits;
+		scans[t].chunk_size = chunk_size;
+		scans[t].first = t;
+		scans[t].step = threads;
+		scans[t].nchunks = nchunks;
+		scans[t].ok = true;
+	}
+	// the first chunks are searched in this thread, and so are any we can't start a thread for
+	for (int t = 1; t < threads; t++)
+		scans[t].started = pthread_create(&scans[t].thread, NULL, scan_chunks, &scans[t]) == 0;
+	scan_chunks(&scans[0]);
+	for (int t = 1; t < threads; t++) {
+		if (scans[t].started)
+			pthread_join(scans[t].thread, NULL);
+		else
+			scan_chunks(&scans[t]);
+	}
+
+	long n = 0;
+	bool ok = true;
+	for (int t = 0; t < threads; t++) {
+		n += scans[t].n;
+		ok = ok && scans[t].ok;
+	}
+	*hits = ok ? malloc(sizeof(**hits) * (n > 0 ? n : 1)) : NULL;
+	if (*hits != NULL) {
+		long i = 0;
+		for (int t = 0; t < threads; t++) {
+			// a thread that found nothing may not have allocated its hits
+			if (scans[t].n == 0)
+				continue;
+			memcpy(*hits + i, scans[t].hits, sizeof(**hits) * scans[t].n);
+			i += scans[t].n;
+		}
+		qsort(*hits, n, sizeof(**hits), compare_hits);
+	}
+	for (int t = 0; t < threads; t++)
+		free(scans[t].hits);
+	free(scans);
+	return *hits == NULL ? -1 : n;
+}
+
+struct packedprimers *pack_primers(char **primers) {
+	int n = 0;
+	while (primers[n] != NULL)
+		n++;
+	struct packedprimers *pp = malloc(sizeof(*pp));
+	if (pp != NULL) {
+		pp->n = n;
+		pp->primers = malloc(sizeof(*pp->primers) * (n > 0 ? n : 1));
+		pp->windows = malloc(sizeof(*pp->windows) * (n > 0 ? n : 1));
+		pp->nwindows = malloc(sizeof(*pp->nwindows) * (n > 0 ? n : 1));
+		pp->allowwindows = calloc(n > 0 ? n : 1, sizeof(*pp->allowwindows));
+		pp->peqleft = calloc(n > 0 ? n : 1, sizeof(*pp->peqleft));
+		pp->peqright = calloc(n > 0 ? n : 1, sizeof(*pp->peqright));
+	}
+	if (pp == NULL || pp->primers == NULL || pp->windows == NULL || pp->nwindows == NULL || pp->allowwindows == NULL
+			|| pp->peqleft == NULL || pp->peqright == NULL) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+		exit(-1);
+	}
+	for (int p = 0; p < n; p++) {
+		size_t plen = strlen(primers[p]);
+		packedread_init(&pp->primers[p]);
+		pp->windows[p] = malloc(sizeof(**pp->windows) * (plen + 1));
+		pp->nwindows[p] = malloc(sizeof(**pp->nwindows) * (plen + 1));
+		if (!packedread_pack_iupac(&pp->primers[p], primers[p], plen) || !pp->windows[p] || !pp->nwindows[p]) {
+			fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+			exit(-1);
+		}
+		if (pp->primers[p].degenerate) {
+			pp->allowwindows[p] = malloc(sizeof(**pp->allowwindows) * (plen + 1));
+			if (pp->allowwindows[p] == NULL) {
+				fprintf(stderr, "ERROR: We cannot allocate memory for the primers\n");
+				exit(-1);
+			}
+		}
+		for (size_t offset = 0; offset <= plen; offset++) {
+			pp->windows[p][offset] = packedread_bases(&pp->primers[p], offset);
+			pp->nwindows[p][offset] = packedread_nmask(&pp->primers[p], offset);
+			if (pp->allowwindows[p])
+				packedread_allow(&pp->primers[p], offset, pp->allowwindows[p][offset]);
+		}
+		// the last 64 bases for left primers, and the first 64 bases backwards for right primers
+		size_t m = plen < max_indel_primer ? plen : max_indel_primer;
+		for (size_t i = 0; i < m; i++) {
+			int left = primer_allows(&pp->primers[p], plen - m + i);
+			int right = primer_allows(&pp->primers[p], m - 1 - i);
+			for (int b = 0; b < 4; b++) {
+				if (left & (1 << b))
+					pp->peqleft[p][b] |= 1ULL << i;
+				if (right & (1 << b))
+					pp->peqright[p][b] |= 1ULL << i;
+			}
+		}
+	}
+	return pp;
+}
+
+void free_packed_primers(struct packedprimers *pp) {
+	for (int p = 0; p < pp->n; p++) {
+		packedread_free(&pp->primers[p]);
+		free(pp->windows[p]);
+		free(pp->nwindows[p]);
+		free(pp->allowwindows[p]);
+	}
+	free(pp->primers);
+	free(pp->windows);
+	free(pp->nwindows);
+	free(pp->allowwindows);
+	free(pp->peqleft);
+	free(pp->peqright);
+	free(pp);
+}
+
+int trim_left(char** primers, char *seq){
+	struct packedprimers *packed = pack_primers(primers);
+	struct packedread read;
+	packedread_init(&read);
+	packedread_pack(&read, seq, strlen(seq));
+	int index = trim_left_packed(packed, &read);
+	packedread_free(&read);
+	free_packed_primers(packed);
+	return index;
+}
+
+int trim_right(char** primers, char *seq, int indexL){
+	struct packedprimers *packed = pack_primers(primers);
+	struct packedread read;
+	packedread_init(&read);
+	packedread_pack(&read, seq, strlen(seq));
+	int index = trim_right_packed(packed, &read, indexL);
+	packedread_free(&read);
+	free_packed_primers(packed);
+	return index;
+}
+
+/*
+ * Where the run of the same base at the end of a sequence of length slen starts, if it is more than 4 bases
+ */
+static int poly_start(const char *seq, int slen) {
+	int i = slen;
+	while (i > 0 && seq[i-1] == seq[slen-1])
+		i--;
+	if (i < slen-4)
+		return i;
+	return slen;
+}
+
+int trim_poly(char *seq, int n){
+	return poly_start(seq, len(seq));
 }
 
 char** load_primers(char *filename){
@@ -95,7 +604,7 @@ char** load_primers(char *filename){
 	FILE* fp = fopen(filename, "r");
 
 	if(fp ==0){
-		printf("Error opening file: %s\n", filename);
+		fprintf(stderr, "ERROR: Can not open the primer file %s\n", filename);
 		exit(EXIT_FAILURE);
 	}
 		
@@ -122,59 +631,373 @@ char** load_primers(char *filename){
 	return primers;
 }
 
+void free_primers(char **primers) {
+	if (primers == NULL)
+		return;
+	for (int i = 0; primers[i] != NULL; i++)
+		free(primers[i]);
+	free(primers);
+}
+
+/*
+ * One of the trimming steps, and how often it trims anything
+ */
+struct trimstep {
+	const char *name;
+	bool used;          // we were asked to do this step
+	bool enabled;       // we are doing it right now
+	long probed;        // reads we tried in the probe
+	long hits;          // and how many of them were trimmed
+	long sampled;       // reads we tried while the step was skipped
+	long samplehits;
+	long skipped;       // reads we did not try at all
+};
+
+static void init_step(struct trimstep *step, const char *name, bool enabled) {
+	memset(step, 0, sizeof(*step));
+	step->name = name;
+	step->used = step->enabled = enabled;
+}
+
+/*
+ * Record whether a step trimmed this read, and at the end of the probe decide whether to keep it
+ */
+static void probe_step(struct trimstep *step, bool hit, long nreads, const struct trimprobe *probe) {
+	step->probed++;
+	step->hits += hit;
+	if (step->probed < probe->reads)
+		return;
+	double rate = (double) step->hits / step->probed;
+	if (rate < probe->threshold) {
+		step->enabled = false;
+		fprintf(probe->report, "Probe: %s trimmed %ld of %ld reads (%.3f%%), below %.3f%%, so we are skipping it\n",
+				step->name, step->hits, step->probed, 100 * rate, 100 * probe->threshold);
+	} else
+		fprintf(probe->report, "Probe: %s trimmed %ld of %ld reads (%.3f%%), so we are keeping it\n",
+				step->name, step->hits, step->probed, 100 * rate);
+}
+
+/*
+ * Record a sample of a skipped step, and turn it back on if it is trimming enough reads
+ */
+static void sample_step(struct trimstep *step, bool hit, long nreads, const struct trimprobe *probe) {
+	step->sampled++;
+	step->samplehits += hit;
+	double rate = (double) step->samplehits / step->sampled;
+	// a sample is as many reads as we would need to expect 10 hits at the threshold (but no more than the probe),
+	// but if the step has already trimmed 10 of them at more than the threshold we don't wait for the rest
+	long needed = probe->threshold > 0 ? (long) ceil(10 / probe->threshold) : step->probed;
+	bool enough = step->samplehits >= 10 && rate >= probe->threshold;
+	if (!enough && step->sampled < (needed < step->probed ? needed : step->probed))
+		return;
+	if (rate >= probe->threshold) {
+		step->enabled = true;
+		fprintf(probe->report, "Probe: %s trimmed %ld of %ld sampled reads (%.3f%%) by read %ld, so we have turned it back on\n",
+				step->name, step->samplehits, step->sampled, 100 * rate, nreads);
+	} else {
+		// start a new sample so we can see drift later in the file
+		step->sampled = step->samplehits = 0;
+	}
+}
+
+static void report_step(const struct trimstep *step, const struct trimprobe *probe) {
+	fprintf(probe->report, "%s: %s. Probe %ld/%ld reads trimmed. Skipped %ld reads.\n", step->name,
+			step->enabled ? "on" : "off", step->hits, step->probed, step->skipped);
+}
+
+/*
+ * Run one step on a read, unless we are skipping it. Returns true if we ran it.
+ */
+static bool run_step(struct trimstep *step, long nreads, const struct trimprobe *probe) {
+	if (probe == NULL || step->enabled)
+		return true;
+	if (probe->sample_every > 0 && nreads % probe->sample_every == 0)
+		return true;
+	step->skipped++;
+	return false;
+}
+
+/*
+ * Find the left and right primers in a read with the options, and which primers they were
+ */
+static int find_left(const struct packedprimers *pp, const struct packedread *read, const struct trimoptions *options, struct indelhit *hit) {
+	if (options->maxedits < 0)
+		return trim_left_hit(pp, read, hit);
+	return trim_left_indels(pp, read, options->maxedits, hit);
+}
+
+static int find_right(const struct packedprimers *pp, const struct packedread *read, int indexL, const struct trimoptions *options, struct indelhit *hit) {
+	// with an end window we only look for the right primers near the end of the read
+	int slen = (int) read->len;
+	if (options->end_window > 0 && slen - options->end_window > indexL)
+		indexL = slen - options->end_window;
+	if (options->maxedits < 0)
+		return trim_right_hit(pp, read, indexL, hit);
+	return trim_right_indels(pp, read, indexL, options->maxedits, hit);
+}
+
+void trimoptions_default(struct trimoptions *options) {
+	options->maxedits = -1;
+	options->end_window = 0;
+	options->chimeras = NULL;
+	options->chunk_size = 10000;
+	options->threads = 1;
+	options->shard = 0;
+	options->nshards = 1;
+	options->coordinates = NULL;
+	options->cache = NULL;
+}
+
+void trim_read(const struct packedprimers *left, const struct packedprimers *right, const char *seq,
+		const struct packedread *read, const struct trimoptions *options, struct trimresult *result) {
+	struct trimoptions defaults;
+	if (options == NULL) {
+		trimoptions_default(&defaults);
+		options = &defaults;
+	}
+	int slen = (int) read->len;
+	result->start = 0;
+	result->end = slen;
+	result->left_primer = result->right_primer = -1;
+	result->left_edits = result->right_edits = -1;
+	struct indelhit hit;
+	if (left != NULL) {
+		result->start = find_left(left, read, options, &hit);
+		result->left_primer = hit.primer;
+		result->left_edits = hit.distance;
+	}
+	if (right != NULL) {
+		result->end = find_right(right, read, result->start, options, &hit);
+		result->right_primer = hit.primer;
+		result->right_edits = hit.distance;
+	}
+	int poly = poly_start(seq, slen);
+	if (poly < result->end)
+		result->end = poly;
+	if (result->end < result->start)
+		result->end = result->start;
+}
+
 int trim_primers(char * infile, char **primersL, char **primersR) {
-	gzFile fp;
+	return trim_primers_probe(infile, primersL, primersR, NULL, NULL);
+}
+
+/*
+ * Write where the primers are inside the read (the end is the base after the primer, counting from 1)
+ */
+static void report_internal_primers(FILE *fp, const char *name, const char *set, char **primers,
+		const struct packedprimers *pp, const struct packedread *read, const struct trimoptions *options) {
+	struct indelhit *hits;
+	int maxedits = options->maxedits < 0 ? default_internal_edits : options->maxedits;
+	long n = find_internal_primers(pp, read, maxedits, options->chunk_size, options->threads, &hits);
+	if (n < 0) {
+		fprintf(stderr, "ERROR: We cannot allocate memory for the primers in %s\n", name);
+		exit(-1);
+	}
+	for (long i = 0; i < n; i++)
+		fprintf(fp, "%s\t%s\t%s\t%d\t%d\n", name, set, primers[hits[i].primer], hits[i].end, hits[i].distance);
+	free(hits);
+}
+
+/*
+ * Write the part of the read from start up to (but not including) end
+ */
+static void write_read(const kseq_t *seq, int start, int end) {
+	// HEADER
+	printf("%c%s", seq->qual.l == seq->seq.l? '@' : '>', seq->name.s);
+	if (seq->comment.l) printf(" %s", seq->comment.s);
+	putchar('\n');
+	// SEQUENCE: write the part of the read we keep in one go, rather than a base at a time
+	int keep = end - start;
+	if (keep > 0)
+		fwrite(seq->seq.s + start, 1, keep, stdout);
+	putchar('\n');
+
+	// QUALITY
+	if (seq->qual.l != seq->seq.l)
+		return;
+	printf("+\n");
+	if (keep > 0)
+		fwrite(seq->qual.s + start, 1, keep, stdout);
+	putchar('\n');
+}
+
+int trim_primers_probe(char * infile, char **primersL, char **primersR, const struct trimprobe *probe, const struct trimoptions *options) {
+	struct gzshard *fp;
 	kseq_t *seq;
 	//struct my_struct *s;
-	int i, l;
+	int l;
 	int indexL, indexR1, indexR2;
+	long nreads = 0;
+	struct trimstep left, right, poly;
+	init_step(&left, "Left primer trimming", primersL != NULL);
+	init_step(&right, "Right primer trimming", primersR != NULL);
+	init_step(&poly, "Poly-A trimming", true);
+	struct trimstep *steps[] = {&left, &right, &poly};
+	struct trimoptions defaults;
+	if (options == NULL) {
+		trimoptions_default(&defaults);
+		options = &defaults;
+	}
+	struct indelhit hit;
+
+	// pack the primers once, and each read once as we get to it
+	struct packedprimers *packedL = primersL ? pack_primers(primersL) : NULL;
+	struct packedprimers *packedR = primersR ? pack_primers(primersR) : NULL;
+	struct packedread read;
+	packedread_init(&read);
 
 
 	// FASTQ
 	//int line_format;
 	//line_format = 0;
-	fp = gzopen(infile, "r");
+	fp = gzshard_open(infile, options->shard, options->nshards);
+	if (fp == NULL) {
+		fprintf(stderr, "ERROR: Can not open %s\n", infile);
+		packedread_free(&read);
+		if (packedL)
+			free_packed_primers(packedL);
+		if (packedR)
+			free_packed_primers(packedR);
+		return 1;
+	}
 	seq = kseq_init(fp);
-	while ((l = kseq_read(seq)) >= 0) {
+	struct readcache *cache = options->cache ? readcache_open(options->cache, infile) : NULL;
+	while ((l = readcache_kseq_read(cache, seq)) >= 0) {
+		int slen = (int) seq->seq.l;
 		indexL = 0;
-		indexR1 = indexR2 = len(seq->seq.s);
-		// HEADER
-		printf("%c%s", seq->qual.l == seq->seq.l? '@' : '>', seq->name.s);
-		if (seq->comment.l) printf(" %s", seq->comment.s);
-		putchar('\n');
-		/*
-		for (i = 0; i < l; ++i) {
-			fputc(seq->seq.s[i], s->fptr);
-		}
-		*/
-		// SEQUENCE
-		if(primersL != NULL)
-			indexL = trim_left(primersL, seq->seq.s);
-		if(primersR != NULL)
-			indexR1 = trim_right(primersR, seq->seq.s, indexL);
-		if(1)
-			indexR2 = trim_poly(seq->seq.s, 5);
-		//printf("%s", seq->seq.s);
-		for(i=indexL; i < min(indexR1, indexR2); i++)
-			putchar(seq->seq.s[i]);
-		putchar('\n');
-
-		// QUALITY
-		if (seq->qual.l != seq->seq.l) continue;
-		printf("+\n");
-		for(i=indexL; i < min(indexR1, indexR2); i++)
-			putchar(seq->qual.s[i]);
-		//printf("%s", seq->qual.s);
-		/*
-		for (i = 0; i < l; ++i) {
-			if (i == 0 || (line_format > 0 && i % line_format == 0)) fputc('\n', s->fptr);
-			fputc(seq->qual.s[i], s->fptr);
-		}
-		*/
-		putchar('\n');
+		indexR1 = indexR2 = slen;
+		int leftprimer = -1, leftedits = -1, rightprimer = -1, rightedits = -1;
+		nreads++;
+		if ((primersL != NULL || primersR != NULL) && !packedread_pack(&read, seq->seq.s, seq->seq.l)) {
+			fprintf(stderr, "ERROR: We cannot allocate memory for %s\n", seq->name.s);
+			exit(-1);
+		}
+		if(primersL != NULL && run_step(&left, nreads, probe)) {
+			bool enabled = left.enabled;
+			indexL = find_left(packedL, &read, options, &hit);
+			leftprimer = hit.primer;
+			leftedits = hit.distance;
+			if (probe && enabled && left.probed < probe->reads)
+				probe_step(&left, indexL > 0, nreads, probe);
+			else if (probe && !enabled)
+				sample_step(&left, indexL > 0, nreads, probe);
+		}
+		if(primersR != NULL && run_step(&right, nreads, probe)) {
+			bool enabled = right.enabled;
+			indexR1 = find_right(packedR, &read, indexL, options, &hit);
+			rightprimer = hit.primer;
+			rightedits = hit.distance;
+			if (probe && enabled && right.probed < probe->reads)
+				probe_step(&right, indexR1 < slen, nreads, probe);
+			else if (probe && !enabled)
+				sample_step(&right, indexR1 < slen, nreads, probe);
+		}
+		if(run_step(&poly, nreads, probe)) {
+			bool enabled = poly.enabled;
+			indexR2 = poly_start(seq->seq.s, slen);
+			if (probe && enabled && poly.probed < probe->reads)
+				probe_step(&poly, indexR2 < slen, nreads, probe);
+			else if (probe && !enabled)
+				sample_step(&poly, indexR2 < slen, nreads, probe);
+		}
+		if (options->chimeras) {
+			if (primersL != NULL)
+				report_internal_primers(options->chimeras, seq->name.s, "left", primersL, packedL, &read, options);
+			if (primersR != NULL)
+				report_internal_primers(options->chimeras, seq->name.s, "right", primersR, packedR, &read, options);
+		}
+		int end = max(min(indexR1, indexR2), indexL);
+		if (options->coordinates)
+			gzprintf(options->coordinates, "%ld\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n", nreads - 1, slen, indexL, end,
+					leftprimer, leftedits, rightprimer, rightedits);
+		else
+			write_read(seq, indexL, end);
 	}
+	readcache_close(cache);
 	kseq_destroy(seq);
-	gzclose(fp);
+	gzshard_close(fp);
+	packedread_free(&read);
+	if (packedL)
+		free_packed_primers(packedL);
+	if (packedR)
+		free_packed_primers(packedR);
+
+	if (probe) {
+		fprintf(probe->report, "Trimmed %ld reads\n", nreads);
+		for (int s = 0; s < 3; s++)
+			if (steps[s]->used)
+				report_step(steps[s], probe);
+	}
 
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Read the next line of coordinates, skipping the header (and any comments). Returns NULL at the end.
+ */
+static char *next_coordinates(gzFile coordinates, char *line, int size) {
+	char *got;
+	while ((got = gzgets(coordinates, line, size)) != NULL && line[0] == '#')
+		;
+	return got;
+}
+
+/*
+ * Is this line of coordinates the first read of a file?
+ */
+static bool first_coordinates(const char *line) {
+	long index;
+	return sscanf(line, "%ld", &index) == 1 && index == 0;
+}
+
+int apply_coordinates(char **infiles, int ninfiles, gzFile coordinates, const struct trimoptions *options) {
+	struct trimoptions defaults;
+	if (options == NULL) {
+		trimoptions_default(&defaults);
+		options = &defaults;
+	}
+	// we read one line ahead, so we know where the coordinates for each file end
+	char line[1024];
+	char *got = next_coordinates(coordinates, line, sizeof(line));
+	int ro = 0;
+	for (int f = 0; f < ninfiles && ro == 0; f++) {
+		char *infile = infiles[f];
+		struct gzshard *fp = gzshard_open(infile, options->shard, options->nshards);
+		if (fp == NULL) {
+			fprintf(stderr, "ERROR: Can not open %s\n", infile);
+			return 1;
+		}
+		kseq_t *seq = kseq_init(fp);
+		struct readcache *cache = options->cache ? readcache_open(options->cache, infile) : NULL;
+		long nreads = 0;
+		while (ro == 0 && readcache_kseq_read(cache, seq) >= 0) {
+			long index;
+			int length, start, end;
+			// a read 0 after the first read is where the next file starts
+			if (got == NULL || (nreads > 0 && first_coordinates(line))) {
+				fprintf(stderr, "ERROR: We ran out of coordinates at read %ld (%s) of %s\n", nreads, seq->name.s, infile);
+				ro = 1;
+			}
+			else if (sscanf(line, "%ld\t%d\t%d\t%d", &index, &length, &start, &end) != 4 || index != nreads ||
+					length != (int) seq->seq.l || start < 0 || start > end || end > length) {
+				fprintf(stderr, "ERROR: The coordinates for read %ld (%s) of %s do not match it\n", nreads, seq->name.s, infile);
+				ro = 1;
+			}
+			else {
+				write_read(seq, start, end);
+				got = next_coordinates(coordinates, line, sizeof(line));
+			}
+			nreads++;
+		}
+		readcache_close(cache);
+		kseq_destroy(seq);
+		gzshard_close(fp);
+		// after the last file there should be nothing left, and after the others the next file should start
+		if (ro == 0 && got != NULL && (f == ninfiles - 1 || !first_coordinates(line))) {
+			fprintf(stderr, "ERROR: There are more coordinates than reads in %s (it has %ld reads)\n", infile, nreads);
+			ro = 1;
+		}
+	}
+	return ro;
+}
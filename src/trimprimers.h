@@ -5,22 +5,178 @@
 #ifndef PRIMER_TRIMMING_PRIMER_TRIMMING_H
 #define PRIMER_TRIMMING_PRIMER_TRIMMING_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <zlib.h>
+
 /*
  * Trim the primers
  */
 
 int trim_primers(char * infile, char **primersL, char **primersR);
 
+/*
+ * Options for the probe: we try every trimming step on the first reads, and skip any step
+ * that trims fewer than threshold of them. While a step is skipped we still try it on every
+ * sample_every'th read, and turn it back on if it starts trimming reads again. The decisions
+ * are written to report.
+ */
+struct trimprobe {
+	long reads;
+	double threshold;
+	long sample_every;
+	FILE *report;
+};
+
+/*
+ * The other trimming options:
+ *  - maxedits: if 0 or more we allow insertions and deletions as well as mismatches (see trim_left_indels),
+ *    otherwise we only allow mismatches.
+ *  - end_window: if more than 0, only look for the right primers in the last end_window bases of the reads
+ *    (for long reads, where we don't want to look along the whole read).
+ *  - chimeras: if not NULL, also look for the primers inside the reads (see find_internal_primers), and
+ *    write where they are to this file. Each read is cut into chunks of chunk_size bases that are
+ *    searched in up to threads threads.
+ *  - shard, nshards: if nshards is more than 1, only trim shard of nshards (counting from 0) of each file
+ *    (see gzshard.h).
+ *  - coordinates: if not NULL, write where to trim each read to this file (see apply_coordinates) instead
+ *    of writing the trimmed reads.
+ *  - cache: if not NULL, read the reads from this cache of the file, or write it if it is not up to date
+ *    (see readcache.h). Only use it with one file.
+ */
+struct trimoptions {
+	int maxedits;
+	int end_window;
+	FILE *chimeras;
+	int chunk_size;
+	int threads;
+	int shard;
+	int nshards;
+	gzFile coordinates;
+	const char *cache;
+};
+
+/*
+ * Set options to the defaults: only allow mismatches, look along the whole read, no chimeras (with chunks of
+ * 10000 bases in one thread if they are turned on), the whole file, and write the trimmed reads.
+ */
+void trimoptions_default(struct trimoptions *options);
+
+/*
+ * Trim the primers, but use the probe to skip the steps that we don't need (if probe is not NULL).
+ * options can be NULL to only allow mismatches and look along the whole read.
+ */
+int trim_primers_probe(char * infile, char **primersL, char **primersR, const struct trimprobe *probe, const struct trimoptions *options);
+
+/*
+ * The coordinates file has a tab separated line for each read: the read (counting from 0 in each file), its
+ * length, where to trim it (keep start up to but not including end), the left primer and its edits, and the
+ * right primer and its edits (the primers are numbered from 0 in their files, and are -1 if there wasn't one).
+ *
+ * Trim the reads in the ninfiles infiles (or the shard of each in options, which can be NULL) to stdout with
+ * the coordinates, without looking for the primers again. Returns 1 if the coordinates don't match the reads,
+ * including if there are coordinates left over for any of the files.
+ */
+int apply_coordinates(char **infiles, int ninfiles, gzFile coordinates, const struct trimoptions *options);
+
 /*
  * trim left primers
+ *
+ * These pack all the primers again (and free them) every time, so they are deprecated: pack the primers
+ * once with pack_primers and use trim_left_packed and trim_right_packed instead.
  */
 
-int trim_left(char** primers, char *seq);
+int trim_left(char** primers, char *seq) __attribute__((deprecated("use pack_primers and trim_left_packed")));
 
 /*
  * trim right primers
  */
-int trim_right(char** primers, char *seq, int indexL);
+int trim_right(char** primers, char *seq, int indexL) __attribute__((deprecated("use pack_primers and trim_right_packed")));
+
+/*
+ * The primers packed two bits per base (see packedread.h), with the first 32 bases from every
+ * offset in each primer (windows[p][offset]) so we don't have to shift them for every read.
+ * Primers with IUPAC codes also have their allow masks from every offset in allowwindows[p]
+ * (which is NULL for primers that only have A, C, G, T, and N).
+ * peqleft and peqright are the bit vectors of where each base is in the primer for trim_left_indels
+ * (the last 64 bases) and trim_right_indels (the first 64 bases, reversed).
+ */
+struct packedread;
+struct packedprimers {
+	int n;
+	struct packedread *primers;
+	uint64_t **windows;
+	uint64_t **nwindows;
+	uint64_t (**allowwindows)[4];
+	uint64_t (*peqleft)[4];
+	uint64_t (*peqright)[4];
+};
+
+/*
+ * Pack a NULL terminated list of primers
+ */
+struct packedprimers *pack_primers(char **primers);
+
+void free_packed_primers(struct packedprimers *pp);
+
+/*
+ * trim_left and trim_right on primers and a read that are already packed.
+ */
+int trim_left_packed(const struct packedprimers *primers, const struct packedread *read);
+int trim_right_packed(const struct packedprimers *primers, const struct packedread *read, int indexL);
+
+/*
+ * The best match of a primer allowing insertions and deletions: which primer it was, the edit distance,
+ * and where the alignment ends in the read (the first base after a left primer, or the first base of a
+ * right primer, which is where we trim).
+ */
+struct indelhit {
+	int primer;
+	int distance;
+	int end;
+};
+
+/*
+ * Trim primers allowing up to maxedits mismatches, insertions, and deletions (e.g. homopolymer errors).
+ * A left primer has to start in the first 20 bases of the read, or be at least the last 11 bases of the
+ * primer at the very start of the read. A right primer can be anywhere after indexL, or be at least the
+ * first 11 bases of the primer at the very end of the read. These return the same as trim_left_packed and
+ * trim_right_packed, and if hit is not NULL the match (or a distance of -1 if there wasn't one).
+ */
+int trim_left_indels(const struct packedprimers *primers, const struct packedread *read, int maxedits, struct indelhit *hit);
+int trim_right_indels(const struct packedprimers *primers, const struct packedread *read, int indexL, int maxedits, struct indelhit *hit);
+
+/*
+ * Find every place a whole primer (or its first 64 bases) is in the read with at most maxedits edits,
+ * e.g. adapters in the middle of chimeric long reads. The read is cut into chunks of chunk_size bases
+ * (that overlap by a primer length, so we find every primer once) which are searched in up to threads
+ * threads. Returns the number of hits, which are in *hits sorted by where they end (free them), or -1
+ * if we run out of memory.
+ */
+long find_internal_primers(const struct packedprimers *primers, const struct packedread *read, int maxedits,
+		int chunk_size, int threads, struct indelhit **hits);
+
+/*
+ * Where to trim one read (keep start up to but not including end), which primers we found there
+ * (their position in the list of primers, or -1), and how many mismatches (or edits, with maxedits)
+ * they had (or -1)
+ */
+struct trimresult {
+	int start;
+	int end;
+	int left_primer;
+	int right_primer;
+	int left_edits;
+	int right_edits;
+};
+
+/*
+ * Trim one read that has already been packed into read: the left primers, the right primers, and the
+ * poly(A?) tail, like trim_primers does, but without printing anything. left, right, and options can
+ * be NULL.
+ */
+void trim_read(const struct packedprimers *left, const struct packedprimers *right, const char *seq,
+		const struct packedread *read, const struct trimoptions *options, struct trimresult *result);
 
 /*
  * trim poly(A?) tails
@@ -34,5 +190,10 @@ int trim_poly(char *seq, int n);
 
 char** load_primers(char *filename);
 
+/*
+ * Free the primers from load_primers
+ */
+void free_primers(char **primers);
+
 
 #endif //PRIMER_TRIMMING_PRIMER_TRIMMING_H
@@ -0,0 +1,635 @@
+/*
+ * The trimming service.
+ *
+ * Each client connects, sends one command (the fields separated by tabs, ending with a newline), and
+ * gets the results back followed by a status line, which is the last line and starts with OK or ERROR.
+ * The commands are:
+ *
+ *   trim INPUT OUTPUT                   trim a file the server can read, and write it to OUTPUT (.gz is gzipped)
+ *   stream                              trim the fastq or fasta records the client sends (until it shuts down
+ *                                       its side of the socket), and send them back
+ *   predict INPUT [KMER [PERCENT [3]]]  predict the primers in a file, and send them back as fasta
+ *   stats                               how much we have done since we started
+ *   shutdown                            finish the jobs we have and stop
+ *
+ * The connections are handed to a pool of threads that all share the packed primers, so several jobs
+ * can run at once. A client that sends nothing (or reads nothing) for server_timeout seconds is
+ * disconnected, so it can't keep a thread, or a shutdown, waiting forever.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <zlib.h>
+#include "kseq.h"
+#include "trimprimers.h"
+#include "trimserver.h"
+#include "predictprimers.h"
+#include "packedread.h"
+
+KSEQ_INIT(gzFile, gzread)
+
+// connections waiting for a thread
+#define server_queue 64
+#define server_fields 8
+// seconds a client can leave us waiting to read or write
+#define server_timeout 60
+
+struct trimstats {
+    long reads;
+    long left;                  // reads we found a left primer in
+    long right;                 // reads we found a right primer in
+    long bases;                 // bases we kept
+};
+
+struct server {
+    const struct packedprimers *left;
+    const struct packedprimers *right;
+    const struct trimoptions *options;
+    int listenfd;
+    int wake[2];                // shutdown writes to wake[1] to stop the accept loop
+    time_t started;
+
+    int queue[server_queue];
+    int head;
+    int n;
+    bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+
+    long jobs;
+    struct trimstats total;
+};
+
+/*
+ * Read the command, one byte at a time so we don't read any of the records that follow it
+ */
+static bool read_command(int fd, char *line, size_t size) {
+    size_t n = 0;
+    char c;
+    while (n + 1 < size) {
+        ssize_t r = read(fd, &c, 1);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        if (c == '\n')
+            break;
+        line[n++] = c;
+    }
+    if (n > 0 && line[n - 1] == '\r')
+        n--;
+    line[n] = 0;
+    return n + 1 < size;
+}
+
+static int split_fields(char *line, char **fields) {
+    int n = 0;
+    char *save = NULL;
+    for (char *f = strtok_r(line, "\t", &save); f && n < server_fields; f = strtok_r(NULL, "\t", &save))
+        fields[n++] = f;
+    return n;
+}
+
+/*
+ * Trim every record from in, and write them to out the way trim_primers does. Returns the kseq status
+ * (-1 when we got to the end), or -4 if we couldn't write.
+ */
+static int trim_records(struct server *sv, gzFile in, gzFile out, struct trimstats *stats) {
+    kseq_t *seq = kseq_init(in);
+    struct packedread read;
+    packedread_init(&read);
+    struct trimresult result;
+    size_t capacity = 1 << 16;
+    char *buf = malloc(capacity);
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: We cannot allocate memory for the sequences\n");
+        exit(-1);
+    }
+    int l;
+    while ((l = kseq_read(seq)) >= 0) {
+        if (!packedread_pack(&read, seq->seq.s, seq->seq.l)) {
+            fprintf(stderr, "ERROR: We cannot allocate memory for %s\n", seq->name.s);
+            exit(-1);
+        }
+        trim_read(sv->left, sv->right, seq->seq.s, &read, sv->options, &result);
+        int keep = result.end - result.start;
+        bool hasqual = seq->qual.l == seq->seq.l;
+        size_t need = seq->name.l + seq->comment.l + 2 * (size_t) keep + 8;
+        if (need > capacity) {
+            while (need > capacity)
+                capacity *= 2;
+            buf = realloc(buf, capacity);
+            if (buf == NULL) {
+                fprintf(stderr, "ERROR: We cannot allocate memory for the sequences\n");
+                exit(-1);
+            }
+        }
+        char *p = buf;
+        *p++ = hasqual ? '@' : '>';
+        memcpy(p, seq->name.s, seq->name.l);
+        p += seq->name.l;
+        if (seq->comment.l) {
+            *p++ = ' ';
+            memcpy(p, seq->comment.s, seq->comment.l);
+            p += seq->comment.l;
+        }
+        *p++ = '\n';
+        memcpy(p, seq->seq.s + result.start, keep);
+        p += keep;
+        *p++ = '\n';
+        if (hasqual) {
+            *p++ = '+';
+            *p++ = '\n';
+            memcpy(p, seq->qual.s + result.start, keep);
+            p += keep;
+            *p++ = '\n';
+        }
+        if (gzwrite(out, buf, (unsigned) (p - buf)) <= 0) {
+            l = -4;
+            break;
+        }
+        stats->reads++;
+        stats->left += result.left_primer >= 0;
+        stats->right += result.right_primer >= 0;
+        stats->bases += keep;
+    }
+    free(buf);
+    packedread_free(&read);
+    kseq_destroy(seq);
+    return l;
+}
+
+static const char *trim_error(int l) {
+    if (l == -2)
+        return "the input is truncated (the quality scores are missing)";
+    if (l == -3)
+        return "the input is corrupt";
+    if (l == -4)
+        return "could not write the output";
+    if (l == -5)
+        return "the client stopped sending the records";
+    return NULL;
+}
+
+static void add_stats(struct server *sv, const struct trimstats *stats) {
+    pthread_mutex_lock(&sv->lock);
+    sv->jobs++;
+    sv->total.reads += stats->reads;
+    sv->total.left += stats->left;
+    sv->total.right += stats->right;
+    sv->total.bases += stats->bases;
+    pthread_mutex_unlock(&sv->lock);
+}
+
+static void reply_stats(int fd, const struct trimstats *stats) {
+    dprintf(fd, "OK reads=%ld left=%ld right=%ld bases=%ld\n", stats->reads, stats->left, stats->right, stats->bases);
+}
+
+static void serve_trim(struct server *sv, int fd, char *input, char *output) {
+    struct trimstats stats = {0, 0, 0, 0};
+    gzFile in = gzopen(input, "r");
+    if (in == NULL) {
+        dprintf(fd, "ERROR Can not open %s\n", input);
+        return;
+    }
+    size_t len = strlen(output);
+    gzFile out = gzopen(output, len > 3 && strcmp(output + len - 3, ".gz") == 0 ? "wb" : "wT");
+    if (out == NULL) {
+        gzclose(in);
+        dprintf(fd, "ERROR Can not write to %s\n", output);
+        return;
+    }
+    int l = trim_records(sv, in, out, &stats);
+    gzclose(in);
+    if (gzclose(out) != Z_OK && l == -1)
+        l = -4;
+    add_stats(sv, &stats);
+    if (trim_error(l))
+        dprintf(fd, "ERROR %s: %s\n", input, trim_error(l));
+    else
+        reply_stats(fd, &stats);
+}
+
+static void serve_stream(struct server *sv, int fd) {
+    struct trimstats stats = {0, 0, 0, 0};
+    // zlib reads plain text as it is, so the client can send gzipped records too
+    int infd = dup(fd), outfd = dup(fd);
+    gzFile in = infd >= 0 ? gzdopen(infd, "r") : NULL;
+    gzFile out = outfd >= 0 ? gzdopen(outfd, "wT") : NULL;
+    if (in == NULL || out == NULL) {
+        if (in)
+            gzclose(in);
+        else if (infd >= 0)
+            close(infd);
+        if (out)
+            gzclose(out);
+        else if (outfd >= 0)
+            close(outfd);
+        dprintf(fd, "ERROR Can not read the records\n");
+        return;
+    }
+    int l = trim_records(sv, in, out, &stats);
+    // a read that failed (rather than records that didn't make sense) is the timeout
+    int err;
+    gzerror(in, &err);
+    if (l == -3 && err == Z_ERRNO)
+        l = -5;
+    gzclose(in);
+    if (gzclose(out) != Z_OK && l == -1)
+        l = -4;
+    add_stats(sv, &stats);
+    if (trim_error(l))
+        dprintf(fd, "ERROR %s\n", trim_error(l));
+    else
+        reply_stats(fd, &stats);
+}
+
+static void serve_predict(struct server *sv, int fd, char **fields, int nfields) {
+    int kmerlen = nfields > 2 ? atoi(fields[2]) : 8;
+    double minpercent = nfields > 3 ? strtod(fields[3], NULL) : 1;
+    bool three_prime = nfields > 4 && strcmp(fields[4], "3") == 0;
+    if (kmerlen < 2) {
+        dprintf(fd, "ERROR The kmer length must be at least 2\n");
+        return;
+    }
+    char **primers = NULL;
+    int nprimers = 0;
+    int ro = predict_primers(fields[1], 0, 1, NULL, kmerlen, minpercent, false, three_prime, 0, 0, NULL, NULL, 0,
+            false, false, false, false, &primers, &nprimers);
+    if (ro != 0) {
+        dprintf(fd, "ERROR Could not predict the primers in %s\n", fields[1]);
+        return;
+    }
+    for (int i = 0; i < nprimers; i++) {
+        dprintf(fd, ">primer_%d\n%s\n", i, primers[i]);
+        free(primers[i]);
+    }
+    free(primers);
+    pthread_mutex_lock(&sv->lock);
+    sv->jobs++;
+    pthread_mutex_unlock(&sv->lock);
+    dprintf(fd, "OK primers=%d\n", nprimers);
+}
+
+static void serve_client(struct server *sv, int fd) {
+    char line[PATH_MAX * 2 + 64];
+    char *fields[server_fields];
+    if (!read_command(fd, line, sizeof(line))) {
+        dprintf(fd, "ERROR Could not read the command\n");
+        return;
+    }
+    int n = split_fields(line, fields);
+    if (n == 0) {
+        dprintf(fd, "ERROR No command\n");
+        return;
+    }
+    if (strcmp(fields[0], "trim") == 0 && n == 3)
+        serve_trim(sv, fd, fields[1], fields[2]);
+    else if (strcmp(fields[0], "stream") == 0 && n == 1)
+        serve_stream(sv, fd);
+    else if (strcmp(fields[0], "predict") == 0 && n >= 2)
+        serve_predict(sv, fd, fields, n);
+    else if (strcmp(fields[0], "stats") == 0 && n == 1) {
+        pthread_mutex_lock(&sv->lock);
+        dprintf(fd, "OK jobs=%ld reads=%ld left=%ld right=%ld bases=%ld uptime=%ld\n", sv->jobs, sv->total.reads,
+                sv->total.left, sv->total.right, sv->total.bases, (long) (time(NULL) - sv->started));
+        pthread_mutex_unlock(&sv->lock);
+    }
+    else if (strcmp(fields[0], "shutdown") == 0 && n == 1) {
+        pthread_mutex_lock(&sv->lock);
+        sv->stop = true;
+        pthread_mutex_unlock(&sv->lock);
+        // this wakes up the poll in trim_serve
+        while (write(sv->wake[1], "", 1) < 0 && errno == EINTR)
+            ;
+        dprintf(fd, "OK\n");
+    }
+    else
+        dprintf(fd, "ERROR Unknown command %s (or the wrong number of arguments)\n", fields[0]);
+}
+
+static void *serve_worker(void *arg) {
+    struct server *sv = arg;
+    for (;;) {
+        pthread_mutex_lock(&sv->lock);
+        while (sv->n == 0 && !sv->stop)
+            pthread_cond_wait(&sv->notempty, &sv->lock);
+        if (sv->n == 0) {
+            pthread_mutex_unlock(&sv->lock);
+            return NULL;
+        }
+        int fd = sv->queue[sv->head];
+        sv->head = (sv->head + 1) % server_queue;
+        sv->n--;
+        pthread_cond_signal(&sv->notfull);
+        pthread_mutex_unlock(&sv->lock);
+        serve_client(sv, fd);
+        close(fd);
+    }
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "ERROR: The socket path %s is too long\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+int trim_serve(char *socketpath, char **primersL, char **primersR, const struct trimoptions *options, int threads) {
+    struct sockaddr_un addr;
+    if (!socket_address(socketpath, &addr))
+        return 1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Can not make a socket: %s\n", strerror(errno));
+        return 1;
+    }
+    // a socket file that nobody is listening on is left over from before, so we can replace it
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "ERROR: Something is already serving on %s\n", socketpath);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "ERROR: Can not make a socket: %s\n", strerror(errno));
+        return 1;
+    }
+    unlink(socketpath);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, server_queue) < 0) {
+        fprintf(stderr, "ERROR: Can not serve on %s: %s\n", socketpath, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    // a client that goes away shouldn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    struct server sv;
+    memset(&sv, 0, sizeof(sv));
+    // we poll before we accept, so accept never waits for a client that has already gone
+    if (pipe(sv.wake) < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        fprintf(stderr, "ERROR: Can not serve on %s: %s\n", socketpath, strerror(errno));
+        close(fd);
+        unlink(socketpath);
+        return 1;
+    }
+    struct packedprimers *packedL = primersL ? pack_primers(primersL) : NULL;
+    struct packedprimers *packedR = primersR ? pack_primers(primersR) : NULL;
+    sv.left = packedL;
+    sv.right = packedR;
+    sv.options = options;
+    sv.listenfd = fd;
+    sv.started = time(NULL);
+    pthread_mutex_init(&sv.lock, NULL);
+    pthread_cond_init(&sv.notempty, NULL);
+    pthread_cond_init(&sv.notfull, NULL);
+
+    pthread_t workers[threads];
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, serve_worker, &sv) != 0)
+            break;
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "ERROR: Can not start any threads to serve with\n");
+        close(fd);
+        close(sv.wake[0]);
+        close(sv.wake[1]);
+        unlink(socketpath);
+        return 1;
+    }
+    fprintf(stderr, "Serving on %s with %d threads\n", socketpath, started);
+
+    struct timeval timeout = {server_timeout, 0};
+    for (;;) {
+        struct pollfd fds[2] = {{fd, POLLIN, 0}, {sv.wake[0], POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: Can not wait for a connection: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        int client = accept(fd, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            fprintf(stderr, "ERROR: Can not accept a connection: %s\n", strerror(errno));
+            break;
+        }
+        // some systems give us a non-blocking socket because the listening socket is
+        if (fcntl(client, F_SETFL, fcntl(client, F_GETFL) & ~O_NONBLOCK) < 0 ||
+                setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+                setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0) {
+            fprintf(stderr, "ERROR: Can not set up a connection: %s\n", strerror(errno));
+            close(client);
+            continue;
+        }
+        pthread_mutex_lock(&sv.lock);
+        while (sv.n == server_queue)
+            pthread_cond_wait(&sv.notfull, &sv.lock);
+        sv.queue[(sv.head + sv.n++) % server_queue] = client;
+        pthread_cond_signal(&sv.notempty);
+        pthread_mutex_unlock(&sv.lock);
+    }
+
+    // let the threads finish the connections they have
+    pthread_mutex_lock(&sv.lock);
+    sv.stop = true;
+    pthread_cond_broadcast(&sv.notempty);
+    pthread_mutex_unlock(&sv.lock);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    close(fd);
+    close(sv.wake[0]);
+    close(sv.wake[1]);
+    unlink(socketpath);
+    fprintf(stderr, "Served %ld jobs and trimmed %ld reads\n", sv.jobs, sv.total.reads);
+
+    pthread_mutex_destroy(&sv.lock);
+    pthread_cond_destroy(&sv.notempty);
+    pthread_cond_destroy(&sv.notfull);
+    if (packedL)
+        free_packed_primers(packedL);
+    if (packedR)
+        free_packed_primers(packedR);
+    return 0;
+}
+
+/*
+ * The server knows nothing about our directory, so send it absolute paths
+ */
+static char *absolute_path(const char *path, bool exists) {
+    if (path[0] == '/')
+        return strdup(path);
+    if (exists) {
+        char *real = realpath(path, NULL);
+        if (real)
+            return real;
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return strdup(path);
+    char *abs = malloc(strlen(cwd) + strlen(path) + 2);
+    sprintf(abs, "%s/%s", cwd, path);
+    return abs;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(fd, buf, len);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return false;
+        buf += w;
+        len -= w;
+    }
+    return true;
+}
+
+static void client_usage() {
+    fprintf(stderr, "Usage: primer-trimming client SOCKET COMMAND\n");
+    fprintf(stderr, "\ttrim INPUT OUTPUT\ttrim INPUT (on the same computer as the server) to OUTPUT\n");
+    fprintf(stderr, "\tstream\ttrim the records on stdin, and write them to stdout\n");
+    fprintf(stderr, "\tpredict INPUT [KMER [PERCENT [3]]]\tpredict the primers in INPUT, and write them to stdout as fasta\n");
+    fprintf(stderr, "\tstats\tprint what the server has done\n");
+    fprintf(stderr, "\tshutdown\tstop the server\n");
+}
+
+/*
+ * Send the command, send stdin too if we are streaming, and copy everything that comes back to stdout
+ * apart from the status line at the end, which goes to stderr. We read and write at the same time so
+ * neither side can fill the socket and wait for the other.
+ */
+int trim_client(int argc, char *argv[]) {
+    if (argc < 3) {
+        client_usage();
+        return 1;
+    }
+    struct sockaddr_un addr;
+    if (!socket_address(argv[1], &addr))
+        return 1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "ERROR: Can not connect to %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char *command = argv[2];
+    bool streaming = strcmp(command, "stream") == 0;
+    size_t len = strlen(command) + 2;
+    char *line = malloc(len);
+    strcpy(line, command);
+    for (int i = 3; i < argc; i++) {
+        // the input and output files are paths, but the predict options are not
+        bool path = (strcmp(command, "trim") == 0 && i <= 4) || (strcmp(command, "predict") == 0 && i == 3);
+        char *field = path ? absolute_path(argv[i], i == 3) : strdup(argv[i]);
+        len += strlen(field) + 1;
+        line = realloc(line, len);
+        strcat(line, "\t");
+        strcat(line, field);
+        free(field);
+    }
+    strcat(line, "\n");
+    bool ok = write_all(fd, line, strlen(line));
+    free(line);
+    if (!streaming)
+        shutdown(fd, SHUT_WR);
+
+    // hold back the last line, because that is the status
+    size_t capacity = 1 << 16, held = 0;
+    char *buf = malloc(capacity);
+    char outbuf[1 << 16];
+    size_t outpos = 0, outlen = 0;
+    bool sending = streaming;
+    while (ok) {
+        // we only read more of stdin once we have sent everything we read last time
+        bool reading = sending && outpos == outlen;
+        struct pollfd fds[2] = {{fd, POLLIN | (outpos < outlen ? POLLOUT : 0), 0}, {STDIN_FILENO, POLLIN, 0}};
+        if (poll(fds, reading ? 2 : 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ok = false;
+            break;
+        }
+        if (reading && fds[1].revents) {
+            ssize_t r = read(STDIN_FILENO, outbuf, sizeof(outbuf));
+            if (r <= 0) {
+                sending = false;
+                shutdown(fd, SHUT_WR);
+            }
+            else {
+                outpos = 0;
+                outlen = r;
+            }
+        }
+        if (fds[0].revents & POLLOUT) {
+            ssize_t w = send(fd, outbuf + outpos, outlen - outpos, MSG_DONTWAIT);
+            if (w > 0)
+                outpos += w;
+            else if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                // the server has stopped reading, but we still want its answer
+                sending = false;
+                outpos = outlen;
+            }
+        }
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (held + (1 << 16) >= capacity) {
+                capacity *= 2;
+                buf = realloc(buf, capacity);
+            }
+            // leave room to end the status line
+            ssize_t r = read(fd, buf + held, capacity - held - 1);
+            if (r <= 0)
+                break;
+            held += r;
+            // write out everything up to the start of the last complete line
+            char *end = buf + held;
+            if (held > 0 && end[-1] == '\n')
+                end--;
+            char *last = end;
+            while (last > buf && last[-1] != '\n')
+                last--;
+            if (last > buf) {
+                fwrite(buf, 1, last - buf, stdout);
+                held -= last - buf;
+                memmove(buf, last, held);
+            }
+        }
+    }
+    fflush(stdout);
+    close(fd);
+
+    if (held > 0 && buf[held - 1] == '\n')
+        held--;
+    buf[held] = 0;
+    int ro = strncmp(buf, "OK", 2) == 0 ? 0 : 1;
+    if (held == 0)
+        fprintf(stderr, "ERROR: The server did not answer\n");
+    else
+        fprintf(stderr, "%s\n", buf);
+    free(buf);
+    return ro;
+}
@@ -0,0 +1,22 @@
+/*
+ * A trimming service on a Unix domain socket, so the primers are only loaded once and small jobs don't
+ * pay for starting a new process, and the client that talks to it.
+ */
+
+#ifndef TRIMSERVER_H
+#define TRIMSERVER_H
+
+#include "trimprimers.h"
+
+/*
+ * Serve trimming (and prediction) jobs on socketpath with threads threads, until a client asks us to
+ * shut down. Returns 0 if we could serve.
+ */
+int trim_serve(char *socketpath, char **primersL, char **primersR, const struct trimoptions *options, int threads);
+
+/*
+ * primer-trimming client SOCKET COMMAND [ARGUMENTS]. Returns the exit code.
+ */
+int trim_client(int argc, char *argv[]);
+
+#endif //TRIMSERVER_H